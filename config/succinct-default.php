@@ -40,14 +40,28 @@ class Succinct {
 
     const MAGPI_FORMS_DIR = self::SPOOL_DIR . '/magpi';
 
+    // socket of the placement service (place_fragment -s), tools are run directly if it is not listening
+    const PLACE_SOCKET = self::SPOOL_DIR . '/place.sock';
+    const PLACE_SOCKET_TIMEOUT = 5;
+
     // below here is not configuration but is a useful place to put helper functions
     // and global initialisation code rather than including another file
 
     private static $mysqli = false;
 
+    // Directory of a team in the spool, sharded by the end of its id once SPOOL_DIR/teams exists.
+    public static function team_dir($team) {
+        if (is_dir(self::SPOOL_DIR.'/teams')) {
+            return self::SPOOL_DIR.'/teams/'.substr($team, 12, 2).'/'.substr($team, 14, 2).'/'.$team;
+        }
+        return self::SPOOL_DIR.'/'.$team;
+    }
+
     public static function fraginfo($file, $infotype) {
         if (strlen($file) == 0 || strlen($infotype) == 0) return false;
-        $cmd = escapeshellarg(self::FRAGINFO).' '.escapeshellarg($infotype).' '.escapeshellarg($file).' 2>/dev/null';
+        // spool directory lets fraginfo resolve compact header aliases
+        $cmd = escapeshellarg(self::FRAGINFO).' '.escapeshellarg($infotype).' '.escapeshellarg($file)
+            .' '.escapeshellarg(self::SPOOL_DIR).' 2>/dev/null';
         $out = exec($cmd, $outa, $ret);
         if ($ret != 0) {
             return false;
@@ -55,11 +69,106 @@ class Succinct {
         return $out;
     }
 
-    public static function place_fragment($file) {
+    // Everything fraginfo knows about each fragment file (or directory of them) in one run,
+    // as arrays with teamid, seq, rawoffset, msgstarts and messages (offset, type, length, span).
+    // Fragments that could not be read have an error member instead.
+    public static function fraginfo_all($files) {
+        if (!is_array($files)) $files = [$files];
+        if (count($files) == 0) return [];
+        $cmd = escapeshellarg(self::FRAGINFO).' all -s '.escapeshellarg(self::SPOOL_DIR);
+        foreach ($files as $file) $cmd .= ' '.escapeshellarg($file);
+        exec($cmd.' 2>/dev/null', $outa, $ret);
+        $info = [];
+        foreach ($outa as $line) {
+            $fragment = json_decode($line, true);
+            if ($fragment !== null) $info[] = $fragment;
+        }
+        return $info;
+    }
+
+    // $channel (rock7, textmagic or api) is recorded with the fragment for tracing, as is when this request arrived
+    public static function place_fragment($file, $channel = null) {
         if (strlen($file) == 0) return false;
-        $cmd = escapeshellarg(self::PLACE_FRAGMENT).' '.escapeshellarg($file).' '.escapeshellarg(self::SPOOL_DIR);
+        $cmd = escapeshellarg(self::PLACE_FRAGMENT);
+        if ($channel !== null) $cmd .= ' -c '.escapeshellarg($channel);
+        if (isset($_SERVER['REQUEST_TIME_FLOAT'])) $cmd .= ' -r '.escapeshellarg(sprintf('%.6f', $_SERVER['REQUEST_TIME_FLOAT']));
+        $cmd .= ' '.escapeshellarg($file).' '.escapeshellarg(self::SPOOL_DIR);
         $out = exec($cmd, $outa, $ret);
-        return ($ret == 0);
+        if ($ret != 0) return false;
+        // fragment already received over another channel, nothing new to rebuild
+        return ($out === 'duplicate') ? 'duplicate' : 'placed';
+    }
+
+    // Place fragment data in the spool, using the placement service if available.
+    // Returns ['status' => 'placed'|'duplicate'|'mismatch', 'teamid' => ..., 'seq' => ...] or false.
+    // If $teamid is given, fragments from any other team are not placed and give status 'mismatch'.
+    // $channel is as for place_fragment.
+    public static function place_fragment_data($fragment, $tmpprefix, $teamid = null, $channel = null) {
+        $placed = self::place_fragment_socket('place', $fragment, $teamid, $channel);
+        if ($placed !== null) return $placed;
+
+        $tmp = tempnam(self::TMP_DIR, $tmpprefix);
+        if ($tmp === false) {
+            self::loge('Succinct', 'place_fragment_data: could not create temporary file');
+            return false;
+        }
+        if (file_put_contents($tmp, $fragment) === false) {
+            self::loge('Succinct', "place_fragment_data: could not write to temporary file $tmp");
+            unlink($tmp);
+            return false;
+        }
+        $info = self::fraginfo_all($tmp);
+        if (count($info) != 1 || isset($info[0]['error'])) {
+            self::loge('Succinct', 'place_fragment_data: could not decode teamid and seq from fragment');
+            unlink($tmp);
+            return false;
+        }
+        $fragment_teamid = $info[0]['teamid'];
+        $seq = $info[0]['seq'];
+        if ($teamid !== null && $teamid !== $fragment_teamid) {
+            unlink($tmp);
+            return ['status' => 'mismatch', 'teamid' => $fragment_teamid, 'seq' => $seq];
+        }
+        $placed = self::place_fragment($tmp, $channel);
+        if ($placed === false) {
+            unlink($tmp);
+            return false;
+        }
+        return ['status' => $placed, 'teamid' => $fragment_teamid, 'seq' => $seq];
+    }
+
+    // As place_fragment_data, for fragment data given as hex digits, which the
+    // placement service decodes itself.
+    public static function place_fragment_hex($hex, $tmpprefix, $teamid = null, $channel = null) {
+        $placed = self::place_fragment_socket('placehex', $hex, $teamid, $channel);
+        if ($placed !== null) return $placed;
+        $fragment = hex2bin($hex);
+        if ($fragment === false) return false;
+        return self::place_fragment_data($fragment, $tmpprefix, $teamid, $channel);
+    }
+
+    // Send a request to the placement service, returns null if the service is not running.
+    private static function place_fragment_socket($command, $data, $teamid, $channel) {
+        $sock = @stream_socket_client('unix://'.self::PLACE_SOCKET, $errno, $errstr, self::PLACE_SOCKET_TIMEOUT);
+        if ($sock === false) return null;
+        stream_set_timeout($sock, self::PLACE_SOCKET_TIMEOUT);
+        $request = $command;
+        if ($teamid !== null) $request .= " $teamid";
+        if ($channel !== null) $request .= " channel=$channel";
+        if (isset($_SERVER['REQUEST_TIME_FLOAT'])) $request .= sprintf(' received=%.6f', $_SERVER['REQUEST_TIME_FLOAT']);
+        $request .= "\n" . $data;
+        for ($written = 0; $written < strlen($request); $written += $n) {
+            $n = fwrite($sock, substr($request, $written));
+            if ($n === false || $n == 0) break;
+        }
+        stream_socket_shutdown($sock, STREAM_SHUT_WR);
+        $reply = fgets($sock);
+        fclose($sock);
+        if ($reply === false || !preg_match('/^(placed|duplicate|mismatch) ([0-9a-f]{16}) ([0-9]{10})$/', trim($reply), $m)) {
+            self::loge('Succinct', 'place_fragment_socket: placement service failed: '.($reply === false ? 'no reply' : trim($reply)));
+            return false;
+        }
+        return ['status' => $m[1], 'teamid' => $m[2], 'seq' => $m[3]];
     }
 
     public static function rebuild_messages($team, $seq, $background = true) {
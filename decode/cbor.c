@@ -0,0 +1,114 @@
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cbor.h"
+
+#define CBOR_UINT 0
+#define CBOR_NEGINT 1
+#define CBOR_BYTES 2
+#define CBOR_TEXT 3
+#define CBOR_ARRAY 4
+#define CBOR_MAP 5
+#define CBOR_SIMPLE 7
+
+#define CBOR_FLOAT32 26
+
+void cbor_init(cbor_buf *buf) {
+    memset(buf, 0, sizeof(cbor_buf));
+}
+
+void cbor_free(cbor_buf *buf) {
+    free(buf->data);
+    cbor_init(buf);
+}
+
+static uint8_t *reserve(cbor_buf *buf, size_t len) {
+    if (buf->error) return NULL;
+    if (buf->length + len > buf->size) {
+        size_t size = buf->size ? buf->size : 256;
+        while (size < buf->length + len) size *= 2;
+        uint8_t *data = realloc(buf->data, size);
+        if (!data) {
+            warn("%s: could not allocate memory", __func__);
+            buf->error = 1;
+            return NULL;
+        }
+        buf->data = data;
+        buf->size = size;
+    }
+    uint8_t *p = buf->data + buf->length;
+    buf->length += len;
+    return p;
+}
+
+/* initial byte and argument in the shortest form */
+static void put_head(cbor_buf *buf, int major, uint64_t arg) {
+    int extra;
+    uint8_t info;
+    if (arg < 24) {
+        extra = 0;
+        info = arg;
+    } else if (arg <= UINT8_MAX) {
+        extra = 1;
+        info = 24;
+    } else if (arg <= UINT16_MAX) {
+        extra = 2;
+        info = 25;
+    } else if (arg <= UINT32_MAX) {
+        extra = 4;
+        info = 26;
+    } else {
+        extra = 8;
+        info = 27;
+    }
+    uint8_t *p = reserve(buf, 1 + extra);
+    if (!p) return;
+    p[0] = (major << 5) | info;
+    for (int i=0; i<extra; i++) {
+        p[1+i] = arg >> (8 * (extra-1-i));
+    }
+}
+
+void cbor_put_uint(cbor_buf *buf, uint64_t value) {
+    put_head(buf, CBOR_UINT, value);
+}
+
+void cbor_put_int(cbor_buf *buf, int64_t value) {
+    if (value < 0) {
+        put_head(buf, CBOR_NEGINT, -1 - value);
+    } else {
+        put_head(buf, CBOR_UINT, value);
+    }
+}
+
+void cbor_put_float(cbor_buf *buf, float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint8_t *p = reserve(buf, 5);
+    if (!p) return;
+    p[0] = (CBOR_SIMPLE << 5) | CBOR_FLOAT32;
+    for (int i=0; i<4; i++) {
+        p[1+i] = bits >> (8 * (3-i));
+    }
+}
+
+void cbor_put_bytes(cbor_buf *buf, const uint8_t *data, size_t len) {
+    put_head(buf, CBOR_BYTES, len);
+    uint8_t *p = reserve(buf, len);
+    if (p && len) memcpy(p, data, len);
+}
+
+void cbor_put_text(cbor_buf *buf, const char *str) {
+    size_t len = strlen(str);
+    put_head(buf, CBOR_TEXT, len);
+    uint8_t *p = reserve(buf, len);
+    if (p && len) memcpy(p, str, len);
+}
+
+void cbor_put_array(cbor_buf *buf, size_t count) {
+    put_head(buf, CBOR_ARRAY, count);
+}
+
+void cbor_put_map(cbor_buf *buf, size_t count) {
+    put_head(buf, CBOR_MAP, count);
+}
@@ -0,0 +1,28 @@
+#ifndef CBOR_H
+#define CBOR_H
+#include <stddef.h>
+#include <stdint.h>
+
+/* minimal CBOR (RFC 7049) encoder writing definite-length items to a growing buffer */
+typedef struct cbor_buf {
+    uint8_t *data;
+    size_t length;
+    size_t size;
+    int error; /* set if memory could not be allocated, later items are dropped */
+} cbor_buf;
+
+/* empty buffer, free with cbor_free */
+void cbor_init(cbor_buf *buf);
+void cbor_free(cbor_buf *buf);
+
+void cbor_put_uint(cbor_buf *buf, uint64_t value);
+void cbor_put_int(cbor_buf *buf, int64_t value);
+void cbor_put_float(cbor_buf *buf, float value);
+void cbor_put_bytes(cbor_buf *buf, const uint8_t *data, size_t len);
+void cbor_put_text(cbor_buf *buf, const char *str);
+
+/* start an array or map, followed by count items (count key/value pairs for a map) */
+void cbor_put_array(cbor_buf *buf, size_t count);
+void cbor_put_map(cbor_buf *buf, size_t count);
+
+#endif /* !CBOR_H */
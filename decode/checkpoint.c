@@ -0,0 +1,337 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "checkpoint.h"
+#include "ccan/json/json.h"
+
+/* journalled teams before the checkpoint is rewritten */
+#define CHECKPOINT_JOURNAL_MAX 1024
+
+struct checkpoint {
+    char *path;
+    char *journal;
+    pthread_mutex_t lock;
+    team_checkpoint *teams; /* sorted by id, so each is found by bisection */
+    long nteams;
+    long max;
+    int journalfd;
+    long journalled;
+};
+
+void team_checkpoint_clear(team_checkpoint *t) {
+    free(t->fragments);
+    free(t->waiting);
+    t->fragments = NULL;
+    t->nfragments = 0;
+    t->waiting = NULL;
+    t->nwaiting = 0;
+}
+
+int team_checkpoint_add_fragment(team_checkpoint *t, int64_t seq) {
+    /* doubling, as the count is a power of two whenever it is full */
+    if ((t->nfragments & (t->nfragments - 1)) == 0) {
+        int64_t *f = realloc(t->fragments, (t->nfragments ? 2*t->nfragments : 1) * sizeof(int64_t));
+        if (!f) return 0;
+        t->fragments = f;
+    }
+    t->fragments[t->nfragments++] = seq;
+    return 1;
+}
+
+int team_checkpoint_add_waiting(team_checkpoint *t, int64_t seq, int n) {
+    if ((t->nwaiting & (t->nwaiting - 1)) == 0) {
+        checkpoint_message *w = realloc(t->waiting, (t->nwaiting ? 2*t->nwaiting : 1) * sizeof(checkpoint_message));
+        if (!w) return 0;
+        t->waiting = w;
+    }
+    t->waiting[t->nwaiting].seq = seq;
+    t->waiting[t->nwaiting].n = n;
+    t->nwaiting++;
+    return 1;
+}
+
+static team_checkpoint copy_team(const team_checkpoint *t) {
+    team_checkpoint copy = {.frontier = t->frontier, .done_mtime = t->done_mtime};
+    strcpy(copy.team, t->team);
+    for (long i=0; i<t->nfragments; i++) {
+        if (!team_checkpoint_add_fragment(&copy, t->fragments[i])) err(1, "realloc");
+    }
+    for (long i=0; i<t->nwaiting; i++) {
+        if (!team_checkpoint_add_waiting(&copy, t->waiting[i].seq, t->waiting[i].n)) err(1, "realloc");
+    }
+    return copy;
+}
+
+static char *encode_team(const team_checkpoint *t) {
+    JsonNode *root = json_mkobject();
+    json_append_member(root, "team", json_mkstring(t->team));
+    json_append_member(root, "frontier", json_mknumber(t->frontier));
+    JsonNode *fragments = json_mkarray();
+    for (long i=0; i<t->nfragments; i++) json_append_element(fragments, json_mknumber(t->fragments[i]));
+    json_append_member(root, "fragments", fragments);
+    JsonNode *waiting = json_mkarray();
+    for (long i=0; i<t->nwaiting; i++) {
+        JsonNode *msg = json_mkarray();
+        json_append_element(msg, json_mknumber(t->waiting[i].seq));
+        json_append_element(msg, json_mknumber(t->waiting[i].n));
+        json_append_element(waiting, msg);
+    }
+    json_append_member(root, "waiting", waiting);
+    if (t->done_mtime.tv_sec || t->done_mtime.tv_nsec) {
+        JsonNode *mtime = json_mkarray();
+        json_append_element(mtime, json_mknumber(t->done_mtime.tv_sec));
+        json_append_element(mtime, json_mknumber(t->done_mtime.tv_nsec));
+        json_append_member(root, "done_mtime", mtime);
+    }
+    char *line = json_encode(root);
+    json_delete(root);
+    return line;
+}
+
+/* 0 if line is not a team's state, as the last line of a journal cut short may not be */
+static int decode_team(const char *line, team_checkpoint *t) {
+    JsonNode *root = json_decode(line);
+    if (!root) return 0;
+    JsonNode *team = json_find_member(root, "team");
+    JsonNode *frontier = json_find_member(root, "frontier");
+    JsonNode *fragments = json_find_member(root, "fragments");
+    JsonNode *waiting = json_find_member(root, "waiting");
+    JsonNode *mtime = json_find_member(root, "done_mtime");
+    int ok = team && team->tag == JSON_STRING && strlen(team->string_) == 2*TEAMLEN
+        && frontier && frontier->tag == JSON_NUMBER
+        && fragments && fragments->tag == JSON_ARRAY && waiting && waiting->tag == JSON_ARRAY;
+    *t = (team_checkpoint) {.frontier = -1};
+    if (ok) {
+        strcpy(t->team, team->string_);
+        t->frontier = frontier->number_;
+        JsonNode *e;
+        json_foreach(e, fragments) {
+            if (e->tag != JSON_NUMBER || !team_checkpoint_add_fragment(t, e->number_)) ok = 0;
+        }
+        json_foreach(e, waiting) {
+            JsonNode *seq = json_find_element(e, 0), *n = json_find_element(e, 1);
+            if (!seq || !n || seq->tag != JSON_NUMBER || n->tag != JSON_NUMBER
+                || !team_checkpoint_add_waiting(t, seq->number_, n->number_)) ok = 0;
+        }
+        /* not written by earlier versions */
+        if (mtime) {
+            JsonNode *sec = json_find_element(mtime, 0), *nsec = json_find_element(mtime, 1);
+            if (!sec || !nsec || sec->tag != JSON_NUMBER || nsec->tag != JSON_NUMBER) ok = 0;
+            else t->done_mtime = (struct timespec) {.tv_sec = sec->number_, .tv_nsec = nsec->number_};
+        }
+    }
+    json_delete(root);
+    if (!ok) team_checkpoint_clear(t);
+    return ok;
+}
+
+/* index of team in c, or where it would be inserted if *found is set to 0 */
+static long team_index(checkpoint *c, const char *team, int *found) {
+    long lo = 0, hi = c->nteams;
+    while (lo < hi) {
+        long mid = lo + (hi-lo)/2;
+        int cmp = strcmp(c->teams[mid].team, team);
+        if (cmp == 0) {
+            *found = 1;
+            return mid;
+        }
+        if (cmp < 0) lo = mid+1;
+        else hi = mid;
+    }
+    *found = 0;
+    return lo;
+}
+
+static team_checkpoint *find_team(checkpoint *c, const char *team) {
+    int found;
+    long i = team_index(c, team, &found);
+    return found ? &c->teams[i] : NULL;
+}
+
+/* caller holds lock (or has c to itself) */
+static void set_team(checkpoint *c, team_checkpoint t) {
+    int found;
+    long i = team_index(c, t.team, &found);
+    if (found) {
+        team_checkpoint_clear(&c->teams[i]);
+        c->teams[i] = t;
+        return;
+    }
+    if (c->nteams == c->max) {
+        c->max = c->max ? 2*c->max : 64;
+        c->teams = realloc(c->teams, c->max * sizeof(team_checkpoint));
+        if (!c->teams) err(1, "realloc");
+    }
+    /* checkpoints are written in order, so loading one only ever appends */
+    memmove(&c->teams[i+1], &c->teams[i], (c->nteams-i) * sizeof(team_checkpoint));
+    c->teams[i] = t;
+    c->nteams++;
+}
+
+/* read the lines of path into c, number read or negative on error */
+static long load(checkpoint *c, const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        if (errno == ENOENT) return 0;
+        warn("%s", path);
+        return -1;
+    }
+    long n = 0;
+    long lineno = 0;
+    char *line = NULL;
+    size_t size = 0;
+    while (getline(&line, &size, fp) > 0) {
+        lineno++;
+        team_checkpoint t;
+        if (decode_team(line, &t)) {
+            set_team(c, t);
+            n++;
+        } else {
+            warnx("%s: ignoring line %ld", path, lineno);
+        }
+    }
+    free(line);
+    fclose(fp);
+    return n;
+}
+
+checkpoint *checkpoint_open(const char *path) {
+    checkpoint *c = calloc(1, sizeof(checkpoint));
+    if (!c) {
+        warn("%s: could not allocate memory", __func__);
+        return NULL;
+    }
+    c->journalfd = -1;
+    pthread_mutex_init(&c->lock, NULL);
+    c->path = strdup(path);
+    if (!c->path || asprintf(&c->journal, "%s.journal", path) < 0) {
+        warn("%s: could not allocate memory", __func__);
+        c->journal = NULL;
+        checkpoint_free(c);
+        return NULL;
+    }
+
+    if (load(c, c->path) < 0 || (c->journalled = load(c, c->journal)) < 0) {
+        checkpoint_free(c);
+        return NULL;
+    }
+    c->journalfd = open(c->journal, O_RDWR|O_APPEND|O_CREAT, 0666);
+    if (c->journalfd < 0) {
+        warn("%s", c->journal);
+        checkpoint_free(c);
+        return NULL;
+    }
+
+    /* a line cut short by a crash must not run into the next */
+    struct stat st;
+    char last = '\n';
+    if (fstat(c->journalfd, &st) != 0
+        || (st.st_size > 0 && pread(c->journalfd, &last, 1, st.st_size-1) != 1)
+        || (last != '\n' && write(c->journalfd, "\n", 1) != 1)) {
+        warn("%s", c->journal);
+        checkpoint_free(c);
+        return NULL;
+    }
+    return c;
+}
+
+team_checkpoint checkpoint_get(checkpoint *c, const char *team) {
+    team_checkpoint t = {.frontier = -1};
+    if (c) {
+        pthread_mutex_lock(&c->lock);
+        team_checkpoint *found = find_team(c, team);
+        if (found) t = copy_team(found);
+        pthread_mutex_unlock(&c->lock);
+    }
+    strcpy(t.team, team);
+    return t;
+}
+
+/* caller holds lock */
+static int write_locked(checkpoint *c) {
+    char tmp[strlen(c->path)+strlen(".tmp")+1];
+    sprintf(tmp, "%s.tmp", c->path);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        warn("%s", tmp);
+        return 0;
+    }
+    for (long i=0; i<c->nteams; i++) {
+        char *line = encode_team(&c->teams[i]);
+        fprintf(fp, "%s\n", line);
+        free(line);
+    }
+    int ok = (fflush(fp) == 0 && fdatasync(fileno(fp)) == 0);
+    if (fclose(fp) != 0) ok = 0;
+    if (!ok || rename(tmp, c->path) != 0) {
+        warn("%s", tmp);
+        unlink(tmp);
+        return 0;
+    }
+
+    /* the new checkpoint must be in place before the journal it replaces is emptied */
+    char *copy = strdup(c->path);
+    int dirfd = copy ? open(dirname(copy), O_RDONLY|O_DIRECTORY) : -1;
+    free(copy);
+    if (dirfd < 0 || fsync(dirfd) != 0) {
+        warn("%s: fsync directory", c->path);
+        if (dirfd >= 0) close(dirfd);
+        return 0;
+    }
+    close(dirfd);
+
+    if (ftruncate(c->journalfd, 0) != 0 || fdatasync(c->journalfd) != 0) {
+        warn("%s", c->journal);
+        return 0;
+    }
+    c->journalled = 0;
+    return 1;
+}
+
+int checkpoint_record(checkpoint *c, const team_checkpoint *t) {
+    char *line = encode_team(t);
+    if (!line) return 0;
+    size_t len = strlen(line);
+    line = realloc(line, len+2);
+    if (!line) return 0;
+    line[len++] = '\n';
+    line[len] = '\0';
+
+    pthread_mutex_lock(&c->lock);
+    /* a single write, so a crash leaves at most the last line incomplete */
+    int ok = (write(c->journalfd, line, len) == len && fdatasync(c->journalfd) == 0);
+    if (!ok) warn("%s", c->journal);
+    if (ok) {
+        set_team(c, copy_team(t));
+        if (++c->journalled >= CHECKPOINT_JOURNAL_MAX) write_locked(c);
+    }
+    pthread_mutex_unlock(&c->lock);
+    free(line);
+    return ok;
+}
+
+int checkpoint_write(checkpoint *c) {
+    pthread_mutex_lock(&c->lock);
+    int ok = write_locked(c);
+    pthread_mutex_unlock(&c->lock);
+    return ok;
+}
+
+void checkpoint_free(checkpoint *c) {
+    if (!c) return;
+    for (long i=0; i<c->nteams; i++) team_checkpoint_clear(&c->teams[i]);
+    free(c->teams);
+    if (c->journalfd >= 0) close(c->journalfd);
+    free(c->path);
+    free(c->journal);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
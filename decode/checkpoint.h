@@ -0,0 +1,53 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+#include <stdint.h>
+#include <time.h>
+#include "fragment.h"
+
+/* How far decoding of each team has got, so a restart resumes there rather than decoding
+ * every fragment again. Kept as a checkpoint file with a line of JSON per team, plus a
+ * journal (<path>.journal) of teams recorded since, which is folded into the checkpoint
+ * once it grows long. Later lines for a team replace earlier ones. */
+typedef struct checkpoint checkpoint;
+
+typedef struct {
+    int64_t seq;
+    int n;
+} checkpoint_message;
+
+typedef struct {
+    char team[2*TEAMLEN+1];
+    int64_t frontier; /* every fragment up to here is present and decoded, -1 if none */
+    int64_t *fragments; /* sorted fragments after frontier already decoded */
+    long nfragments;
+    checkpoint_message *waiting; /* messages in those fragments still incomplete */
+    long nwaiting;
+    struct timespec done_mtime; /* of the team's fragments/done while it held nothing after
+                                 * frontier, zero if not known */
+} team_checkpoint;
+
+/* load the checkpoint at path and replay its journal, starting empty if neither exists,
+ * NULL on error */
+checkpoint *checkpoint_open(const char *path);
+
+/* copy of the state of team, from (if not NULL) the checkpoint or nothing decoded,
+ * free with team_checkpoint_clear */
+team_checkpoint checkpoint_get(checkpoint *c, const char *team);
+
+/* durably journal the state of a team, whose outputs must already be durable, 0 on error */
+int checkpoint_record(checkpoint *c, const team_checkpoint *t);
+
+/* replace the checkpoint with the state of every team and empty the journal, 0 on error */
+int checkpoint_write(checkpoint *c);
+
+/* add a message to t, 0 on error */
+int team_checkpoint_add_waiting(team_checkpoint *t, int64_t seq, int n);
+
+/* add a decoded fragment to t, in order, 0 on error */
+int team_checkpoint_add_fragment(team_checkpoint *t, int64_t seq);
+
+void team_checkpoint_clear(team_checkpoint *t);
+
+void checkpoint_free(checkpoint *c);
+
+#endif /* !CHECKPOINT_H */
@@ -1,14 +1,56 @@
+#define _GNU_SOURCE
+#include <stdio.h>
 #include <sys/stat.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include "decode.h"
 
 int mkdir_or_die(const char *path) {
+    int r = mkdir_or_warn(path);
+    if (r < 0) exit(1);
+    return r;
+}
+
+int mkdir_or_warn(const char *path) {
     if (mkdir(path, 0777) == 0) {
         return 1;
     } else if (errno == EEXIST) {
         return 0;
     } else {
-        err(1, "%s: mkdir", path);
+        warn("%s: mkdir", path);
+        return -1;
+    }
+}
+
+int open_tmpfile(int dirfd, const char *path) {
+    /* linked by its /proc name, as that needs no privileges */
+    static int have_proc = -1;
+    if (have_proc < 0) have_proc = (access("/proc/self/fd", X_OK) == 0);
+    if (!have_proc) return -1;
+    return openat(dirfd, path, O_TMPFILE|O_RDWR, 0666);
+}
+
+int link_tmpfile(int fd, int dirfd, const char *name) {
+    char proc[64];
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+    if (linkat(AT_FDCWD, proc, dirfd, name, AT_SYMLINK_FOLLOW) == 0) return 1;
+    if (errno != EEXIST) return 0;
+
+    /* link can not replace a file, so rename over it from a hidden name */
+    const char *slash = strrchr(name, '/');
+    int dirlen = slash ? slash+1 - name : 0;
+    char tmp[strlen(name)+strlen("..tmp")+1];
+    sprintf(tmp, "%.*s.%s.tmp", dirlen, name, name+dirlen);
+    if (linkat(AT_FDCWD, proc, dirfd, tmp, AT_SYMLINK_FOLLOW) != 0) return 0;
+    if (renameat(dirfd, tmp, dirfd, name) != 0) {
+        int e = errno;
+        unlinkat(dirfd, tmp, 0);
+        errno = e;
+        return 0;
     }
+    return 1;
 }
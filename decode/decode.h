@@ -4,4 +4,15 @@
 /* returns 1 if directory created, 0 if already existed, exits with error otherwise */
 int mkdir_or_die(const char *path);
 
+/* as mkdir_or_die, but returns -1 on error, for long running processes */
+int mkdir_or_warn(const char *path);
+
+/* read/write file with no name in directory path (relative to dirfd), which only appears
+ * once given one by link_tmpfile, so nothing is left behind if not finished. -1 on error,
+ * including filesystems without O_TMPFILE, where callers fall back to a temporary name */
+int open_tmpfile(int dirfd, const char *path);
+
+/* give fd from open_tmpfile name (relative to dirfd), replacing any file already there, 0 on error */
+int link_tmpfile(int fd, int dirfd, const char *name);
+
 #endif /* !DECODE_H */
@@ -0,0 +1,41 @@
+#include <stdio.h>
+#include <err.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include "metrics.h"
+
+int main(int argc, char *argv[]) {
+    char *outfile = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:")) != -1) {
+        switch (opt) {
+            case 'o':
+                outfile = optarg;
+                break;
+            default:
+                argc = 0;
+        }
+    }
+    if (argc - optind != 1) {
+        fprintf(stderr, "Usage: decode_metrics [-o file] spooldir\n");
+        return 2;
+    }
+    char *spool = argv[optind];
+    if (!metrics_open(spool)) errx(1, "%s: metrics not enabled (no %s directory)", spool, METRICS_DIR);
+
+    if (!outfile) return metrics_write(stdout) && fflush(stdout) == 0 ? 0 : 1;
+
+    /* replaced whole, so a collector never reads half of it */
+    char tmp[strlen(outfile)+strlen(".tmp")+1];
+    sprintf(tmp, "%s.tmp", outfile);
+    FILE *out = fopen(tmp, "w");
+    if (!out) err(1, "%s", tmp);
+    int ok = metrics_write(out);
+    if (fclose(out) != 0) ok = 0;
+    if (!ok || rename(tmp, outfile) != 0) {
+        unlink(tmp);
+        err(1, "%s", outfile);
+    }
+    return 0;
+}
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "fragment.h"
+#include "decode.h"
+#include "spool.h"
+
+/* a team id starting with the compact marker and alias would be ambiguous */
+static int alias_shadows_team(uint16_t alias) {
+    char pattern[SPOOL_SHARD_PATHLEN+2+2*ALIASLEN+2];
+    if (spool_sharded(NULL)) {
+        sprintf(pattern, "%s/*/*/%02x%04"PRIx16"*", SPOOL_SHARD_DIR, FRAGHDR_COMPACT_V1, alias);
+    } else {
+        sprintf(pattern, "%02x%04"PRIx16"*", FRAGHDR_COMPACT_V1, alias);
+    }
+    glob_t g;
+    int r = glob(pattern, GLOB_NOSORT|GLOB_ONLYDIR, NULL, &g);
+    globfree(&g);
+    return r == 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "Usage: fragalias spooldir teamid [baseseq]\n");
+        return 2;
+    }
+    char *dir = argv[1];
+    char *team = argv[2];
+    int64_t base = (argc == 4) ? parse_seq(argv[3]) : 0;
+    if (base < 0) errx(1, "%s: invalid sequence number", argv[3]);
+
+    if (strlen(team) != 2*TEAMLEN || strspn(team, "0123456789abcdef") != 2*TEAMLEN) {
+        errx(1, "%s: invalid team identifier", team);
+    }
+
+    if (chdir(dir) != 0) err(1, "%s: chdir", dir);
+
+    char *teamdir = spool_make_team_dir(NULL, team);
+    if (!teamdir) return 1;
+    mkdir_or_die("alias");
+
+    char teamalias[strlen(teamdir)+strlen("/alias")+1];
+    sprintf(teamalias, "%s/alias", teamdir);
+    free(teamdir);
+
+    /* already allocated */
+    FILE *fp = fopen(teamalias, "r");
+    if (fp) {
+        unsigned int a;
+        uint32_t b;
+        if (fscanf(fp, "%4x %"SCNu32, &a, &b) != 2) errx(1, "%s: invalid alias record", teamalias);
+        fclose(fp);
+        printf("%04x %"PRIu32"\n", a, b);
+        return 0;
+    } else if (errno != ENOENT) {
+        err(1, "%s", teamalias);
+    }
+
+    /* start from a value derived from the team id to spread allocations */
+    uint16_t start = strtoul(team+2*TEAMLEN-2*ALIASLEN, NULL, 16);
+    uint16_t alias = start;
+    int fd = -1;
+    do {
+        if (!alias_shadows_team(alias)) {
+            char path[strlen("alias/")+2*ALIASLEN+1];
+            sprintf(path, "alias/%04"PRIx16, alias);
+            fd = open(path, O_WRONLY|O_CREAT|O_EXCL, 0666);
+            if (fd >= 0) break;
+            if (errno != EEXIST) err(1, "%s", path);
+        }
+        alias++;
+    } while (alias != start);
+    if (fd < 0) errx(1, "no free team aliases");
+
+    fp = fdopen(fd, "w");
+    if (!fp) err(1, "fdopen");
+    fprintf(fp, "%s %"PRIu32"\n", team, (uint32_t) base);
+    if (fclose(fp) != 0) err(1, "alias/%04"PRIx16, alias);
+
+    fp = fopen(teamalias, "w");
+    if (!fp) err(1, "%s", teamalias);
+    fprintf(fp, "%04"PRIx16" %"PRIu32"\n", alias, (uint32_t) base);
+    if (fclose(fp) != 0) err(1, "%s", teamalias);
+
+    printf("%04"PRIx16" %"PRIu32"\n", alias, (uint32_t) base);
+    return 0;
+}
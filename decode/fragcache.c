@@ -0,0 +1,204 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include "fragment.h"
+#include "fragcache.h"
+
+#define FRAGCACHE_BUCKETS 4096
+
+typedef struct entry {
+    char team[2*TEAMLEN+1];
+    uint32_t seq;
+    uint8_t *data;
+    size_t len;
+    int refs;     /* one while cached, and one for each open stream */
+    int cached;
+    struct entry *newer, *older; /* recently used order, while cached */
+    struct entry *chain;         /* in its bucket, while cached */
+} entry;
+
+struct fragcache {
+    size_t budget;
+    pthread_mutex_t lock;
+    entry *buckets[FRAGCACHE_BUCKETS];
+    entry *newest, *oldest;
+    fragcache_stats stats;
+};
+
+/* an open stream over an entry */
+typedef struct {
+    fragcache *cache;
+    entry *e;
+    off_t pos;
+} reader;
+
+static unsigned bucket(const char *team, uint32_t seq) {
+    /* FNV-1a */
+    uint32_t h = 2166136261u;
+    for (const char *p = team; *p; p++) h = (h ^ (uint8_t) *p) * 16777619u;
+    for (int i=0; i<4; i++) h = (h ^ ((seq >> (8*i)) & 0xff)) * 16777619u;
+    return h % FRAGCACHE_BUCKETS;
+}
+
+fragcache *fragcache_new(size_t budget) {
+    fragcache *c = calloc(1, sizeof(fragcache));
+    if (!c) {
+        warn("%s: could not allocate memory", __func__);
+        return NULL;
+    }
+    c->budget = budget;
+    pthread_mutex_init(&c->lock, NULL);
+    return c;
+}
+
+/* caller holds lock */
+static entry **find(fragcache *c, const char *team, uint32_t seq) {
+    entry **e = &c->buckets[bucket(team, seq)];
+    while (*e && ((*e)->seq != seq || strcmp((*e)->team, team) != 0)) e = &(*e)->chain;
+    return e;
+}
+
+/* caller holds lock */
+static void unuse(entry *e) {
+    if (--e->refs > 0) return;
+    free(e->data);
+    free(e);
+}
+
+/* take e out of the cache, caller holds lock */
+static void uncache(fragcache *c, entry *e) {
+    entry **p = find(c, e->team, e->seq);
+    *p = e->chain;
+    if (e->newer) e->newer->older = e->older; else c->newest = e->older;
+    if (e->older) e->older->newer = e->newer; else c->oldest = e->newer;
+    e->cached = 0;
+    c->stats.bytes -= e->len;
+    c->stats.entries--;
+    unuse(e);
+}
+
+/* most recently used, caller holds lock */
+static void touch(fragcache *c, entry *e) {
+    if (c->newest == e) return;
+    if (e->newer) e->newer->older = e->older;
+    if (e->older) e->older->newer = e->newer; else c->oldest = e->newer;
+    e->newer = NULL;
+    e->older = c->newest;
+    if (c->newest) c->newest->newer = e;
+    c->newest = e;
+}
+
+int fragcache_add(fragcache *c, const char *team, uint32_t seq, const uint8_t *data, size_t len) {
+    if (len > c->budget || strlen(team) != 2*TEAMLEN) return 0;
+    entry *e = calloc(1, sizeof(entry));
+    uint8_t *copy = malloc(len > 0 ? len : 1);
+    if (!e || !copy) {
+        free(e);
+        free(copy);
+        return 0;
+    }
+    memcpy(copy, data, len);
+    strcpy(e->team, team);
+    e->seq = seq;
+    e->data = copy;
+    e->len = len;
+    e->refs = 1;
+    e->cached = 1;
+
+    pthread_mutex_lock(&c->lock);
+    entry **p = find(c, team, seq);
+    if (*p) uncache(c, *p);
+    while (c->stats.bytes + len > c->budget && c->oldest) {
+        uncache(c, c->oldest);
+        c->stats.evictions++;
+    }
+    p = find(c, team, seq);
+    *p = e;
+    e->older = c->newest;
+    if (c->newest) c->newest->newer = e;
+    c->newest = e;
+    if (!c->oldest) c->oldest = e;
+    c->stats.bytes += len;
+    if (c->stats.bytes > c->stats.peak_bytes) c->stats.peak_bytes = c->stats.bytes;
+    c->stats.entries++;
+    c->stats.added++;
+    pthread_mutex_unlock(&c->lock);
+    return 1;
+}
+
+static ssize_t reader_read(void *cookie, char *buf, size_t size) {
+    reader *r = cookie;
+    if (r->pos >= r->e->len) return 0;
+    size_t n = r->e->len - r->pos < size ? r->e->len - r->pos : size;
+    memcpy(buf, r->e->data + r->pos, n);
+    r->pos += n;
+    return n;
+}
+
+static int reader_seek(void *cookie, off64_t *offset, int whence) {
+    reader *r = cookie;
+    off64_t pos = *offset;
+    if (whence == SEEK_CUR) pos += r->pos;
+    else if (whence == SEEK_END) pos += r->e->len;
+    if (pos < 0) return -1;
+    r->pos = *offset = pos;
+    return 0;
+}
+
+static int reader_close(void *cookie) {
+    reader *r = cookie;
+    pthread_mutex_lock(&r->cache->lock);
+    unuse(r->e);
+    pthread_mutex_unlock(&r->cache->lock);
+    free(r);
+    return 0;
+}
+
+FILE *fragcache_open(fragcache *c, const char *team, uint32_t seq, int reload) {
+    reader *r = malloc(sizeof(reader));
+    if (!r) return NULL;
+    pthread_mutex_lock(&c->lock);
+    entry *e = *find(c, team, seq);
+    if (!e) {
+        if (reload) c->stats.reloads++;
+        pthread_mutex_unlock(&c->lock);
+        free(r);
+        return NULL;
+    }
+    touch(c, e);
+    e->refs++;
+    c->stats.hits++;
+    pthread_mutex_unlock(&c->lock);
+
+    *r = (reader) {.cache = c, .e = e};
+    cookie_io_functions_t io = {.read = reader_read, .seek = reader_seek, .close = reader_close};
+    FILE *fp = fopencookie(r, "r", io);
+    if (!fp) reader_close(r);
+    return fp;
+}
+
+void fragcache_drop(fragcache *c, const char *team, uint32_t seq) {
+    pthread_mutex_lock(&c->lock);
+    entry *e = *find(c, team, seq);
+    if (e) uncache(c, e);
+    pthread_mutex_unlock(&c->lock);
+}
+
+fragcache_stats fragcache_get_stats(fragcache *c) {
+    pthread_mutex_lock(&c->lock);
+    fragcache_stats stats = c->stats;
+    pthread_mutex_unlock(&c->lock);
+    return stats;
+}
+
+void fragcache_free(fragcache *c) {
+    pthread_mutex_lock(&c->lock);
+    while (c->oldest) uncache(c, c->oldest);
+    pthread_mutex_unlock(&c->lock);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
@@ -0,0 +1,41 @@
+#ifndef FRAGCACHE_H
+#define FRAGCACHE_H
+#include <stdint.h>
+#include <stdio.h>
+#include <stddef.h>
+
+/* Fragments of any team held in memory while their messages are reassembled, within a
+ * byte budget shared by all threads. Adding a fragment past the budget evicts those least
+ * recently used, which are then read again from their file in fragments/ when needed. */
+typedef struct fragcache fragcache;
+
+typedef struct {
+    long long bytes;      /* held now */
+    long long peak_bytes;
+    long entries;
+    long added;
+    long hits;
+    long evictions;       /* dropped to stay within the budget */
+    long reloads;         /* read again from disk after being evicted */
+} fragcache_stats;
+
+/* cache holding at most budget bytes of fragments, NULL on error */
+fragcache *fragcache_new(size_t budget);
+
+/* add a copy of the len bytes of fragment seq of team, evicting others as needed,
+ * 0 if it could not be added (larger than the whole budget, or no memory) */
+int fragcache_add(fragcache *c, const char *team, uint32_t seq, const uint8_t *data, size_t len);
+
+/* stream reading the cached fragment, which remains valid until closed even if evicted
+ * meanwhile. NULL if not cached, in which case it was evicted if reload is set */
+FILE *fragcache_open(fragcache *c, const char *team, uint32_t seq, int reload);
+
+/* forget a fragment that is no longer needed */
+void fragcache_drop(fragcache *c, const char *team, uint32_t seq);
+
+fragcache_stats fragcache_get_stats(fragcache *c);
+
+/* free c and its fragments, once every stream from it has been closed */
+void fragcache_free(fragcache *c);
+
+#endif /* !FRAGCACHE_H */
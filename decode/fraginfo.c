@@ -2,9 +2,30 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <dirent.h>
 #include <err.h>
+#include <sys/stat.h>
 #include "fragment.h"
 #include "message.h"
+#include "hex.h"
+#include "spool.h"
+#include "ccan/json/json.h"
+
+/* enough to describe the gaps a sender could usefully fill in one go */
+#define MAX_RECEIVED_RANGES 64
+
+/* directories given with -f to look for the fragments following each one in */
+#define MAX_FRAGMENT_DIRS 4
+static const char *fragment_dirs[MAX_FRAGMENT_DIRS+1];
+static int nfragment_dirs = 0;
+
+/* spool given to resolve compact header aliases, with the teams they might shadow */
+static const char *spooldir = NULL;
+static int team_known(const uint8_t *teamid) {
+    char team[2*TEAMLEN+1];
+    hex_encode(team, teamid, TEAMLEN);
+    return spool_has_team(spooldir, team);
+}
 
 enum infomode {
     TEAM_ID,
@@ -12,12 +33,17 @@ enum infomode {
     RAW_OFFSET,
     MSG_STARTS,
     MSG_SPAN,
+    RECEIVED,
+    ALL,
     MODE_UNKNOWN = -1
 };
 
 static enum infomode getmode(const char *mode, int argc);
 static void print_usage(FILE *out);
 
+/* print everything about each fragment file or directory of fragments, 0 if all could be read */
+static int print_all(char *paths[], int npaths);
+
 int main(int argc, char *argv[]) {
     enum infomode mode = MODE_UNKNOWN;
     if (argc >= 2) {
@@ -28,6 +54,38 @@ int main(int argc, char *argv[]) {
         return 2;
     }
 
+    /* spool directory is only needed to resolve compact header aliases */
+    if (mode == ALL) {
+        int opt;
+        optind = 2;
+        while ((opt = getopt(argc, argv, "f:s:")) != -1) {
+            if (opt == 's') {
+                spooldir = optarg;
+            } else if (opt == 'f' && nfragment_dirs < MAX_FRAGMENT_DIRS) {
+                fragment_dirs[nfragment_dirs++] = optarg;
+            } else {
+                print_usage(stderr);
+                return 2;
+            }
+        }
+        if (optind == argc) {
+            print_usage(stderr);
+            return 2;
+        }
+    } else if (mode != MSG_SPAN && mode != RECEIVED && argc == 4) {
+        spooldir = argv[3];
+    }
+    if (spooldir) {
+        char *aliasdir = malloc(strlen(spooldir)+strlen("/alias")+1);
+        if (!aliasdir) err(1, "malloc");
+        sprintf(aliasdir, "%s/alias", spooldir);
+        fragment_set_alias_dir(aliasdir, team_known);
+    }
+
+    if (mode == ALL) {
+        return print_all(argv+optind, argc-optind) == 0 ? 0 : 1;
+    }
+
     if (mode == TEAM_ID) {
         char *filename = argv[2];
         FILE *fp = fopen(filename, "r");
@@ -94,22 +152,176 @@ int main(int argc, char *argv[]) {
 
         return 0;
     }
+
+    if (mode == RECEIVED) {
+        int64_t ack = -1;
+        if (strcmp(argv[3], "-1") != 0) {
+            ack = parse_seq(argv[3]);
+            if (ack < 0) errx(1, "%s: invalid sequence number", argv[3]);
+        }
+
+        seq_range ranges[MAX_RECEIVED_RANGES];
+        int n = fragments_received_ranges(argv[2], ack, ranges, MAX_RECEIVED_RANGES);
+        if (n < 0) return 1;
+        for (int i=0; i<n; i++) {
+            if (i > 0) putchar(',');
+            if (ranges[i].first == ranges[i].last) {
+                printf("%u", ranges[i].first);
+            } else {
+                printf("%u-%u", ranges[i].first, ranges[i].last);
+            }
+        }
+        putchar('\n');
+
+        return 0;
+    }
 }
 
 static enum infomode getmode(const char *mode, int argc) {
-    if (strcmp(mode, "teamid") == 0 && argc == 3) return TEAM_ID;
-    if (strcmp(mode, "seq") == 0 && argc == 3) return SEQ_NUM;
-    if (strcmp(mode, "rawoffset") == 0 && argc == 3) return RAW_OFFSET;
-    if (strcmp(mode, "msgstarts") == 0 && argc == 3) return MSG_STARTS;
+    int single = (argc == 3 || argc == 4);
+    if (strcmp(mode, "teamid") == 0 && single) return TEAM_ID;
+    if (strcmp(mode, "seq") == 0 && single) return SEQ_NUM;
+    if (strcmp(mode, "rawoffset") == 0 && single) return RAW_OFFSET;
+    if (strcmp(mode, "msgstarts") == 0 && single) return MSG_STARTS;
     if (strcmp(mode, "msgspan") == 0 && argc == 5) return MSG_SPAN;
+    if (strcmp(mode, "received") == 0 && argc == 4) return RECEIVED;
+    if (strcmp(mode, "all") == 0 && argc >= 3) return ALL;
     return MODE_UNKNOWN;
 }
 
 static void print_usage(FILE *out) {
     fprintf(out, "Usage:\n"
-                 "  fraginfo teamid file\n"
-                 "  fraginfo seq file\n"
-                 "  fraginfo rawoffset file\n"
-                 "  fraginfo msgstarts file\n"
-                 "  fraginfo msgspan directory seq msgnum\n");
+                 "  fraginfo teamid file [spooldir]\n"
+                 "  fraginfo seq file [spooldir]\n"
+                 "  fraginfo rawoffset file [spooldir]\n"
+                 "  fraginfo msgstarts file [spooldir]\n"
+                 "  fraginfo msgspan directory seq msgnum\n"
+                 "  fraginfo received fragmentdir ack\n"
+                 "  fraginfo all [-s spooldir] [-f fragmentdir]... file|directory...\n");
+}
+
+/* type and length of message n, and the number of fragments it spans (0 if not all
+ * there), looking for it and any following fragments in dirs (if not NULL) */
+static JsonNode *describe_message(FILE *fp, const char * const *dirs, uint32_t seq, int n, long off, long size) {
+    JsonNode *msg = json_mkobject();
+    json_append_member(msg, "offset", json_mknumber(off));
+
+    msg_info info = fragment_file_parse_message_header(fp, off);
+    json_append_member(msg, "type", json_mknumber(info.type));
+    int span = (info.length >= 0 && off + MSG_HDRLEN + info.length <= size) ? 1 : 0;
+    if (!span && dirs) {
+        /* header or rest of message in the next fragments */
+        uint8_t header[MSG_HDRLEN];
+        if (fragments_walk_message_in(dirs, seq, n, header, NULL, NULL, &span)) {
+            info.length = ((long) header[1] << 8) + header[2];
+        } else {
+            span = 0;
+        }
+    }
+    json_append_member(msg, "length", info.length >= 0 ? json_mknumber(info.length) : json_mknull());
+    json_append_member(msg, "span", json_mknumber(span));
+    return msg;
+}
+
+/* NULL if the header could not be read */
+static JsonNode *describe_fragment(const char *path, const char * const *dirs) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        warn("%s: open", path);
+        return NULL;
+    }
+    fragment_header hdr;
+    struct stat st;
+    if (fragment_file_read_header(fp, &hdr) < 0 || fstat(fileno(fp), &st) != 0) {
+        warnx("%s: could not read header", path);
+        fclose(fp);
+        return NULL;
+    }
+
+    char team[2*TEAMLEN+1];
+    hex_encode(team, hdr.teamid, TEAMLEN);
+    char *seqf = format_seq(hdr.seq);
+    if (!seqf) err(1, "malloc");
+
+    JsonNode *frag = json_mkobject();
+    json_append_member(frag, "file", json_mkstring(path));
+    json_append_member(frag, "teamid", json_mkstring(team));
+    json_append_member(frag, "seq", json_mkstring(seqf));
+    json_append_member(frag, "compact", json_mkbool(hdr.compact));
+    json_append_member(frag, "headerlength", json_mknumber(hdr.length));
+    json_append_member(frag, "rawoffset", json_mknumber(hdr.raw_offset));
+    json_append_member(frag, "length", json_mknumber(st.st_size));
+
+    JsonNode *msgs = json_mkarray();
+    int started = fragment_file_messages_started(fp);
+    long off = fragment_file_first_message_offset(fp);
+    for (int i=1; i<=started; i++) {
+        JsonNode *msg = describe_message(fp, dirs, hdr.seq, i, off, st.st_size);
+        json_append_element(msgs, msg);
+        JsonNode *len = json_find_member(msg, "length");
+        if (len->tag != JSON_NUMBER) break;
+        off += MSG_HDRLEN + (long) len->number_;
+    }
+    json_append_member(frag, "msgstarts", json_mknumber(started));
+    json_append_member(frag, "messages", msgs);
+
+    free(seqf);
+    fclose(fp);
+    return frag;
+}
+
+static int not_hidden(const struct dirent *d) {
+    return d->d_name[0] != '.';
+}
+
+static int print_fragment(const char *path, const char * const *dirs) {
+    JsonNode *frag = describe_fragment(path, dirs);
+    int okay = (frag != NULL);
+    if (!okay) {
+        frag = json_mkobject();
+        json_append_member(frag, "file", json_mkstring(path));
+        json_append_member(frag, "error", json_mkstring("could not read header"));
+    }
+    char *line = json_encode(frag);
+    puts(line);
+    free(line);
+    json_delete(frag);
+    return okay;
+}
+
+static int print_all(char *paths[], int npaths) {
+    /* a fragment on its own (such as one not yet placed) is only described as far as it goes */
+    const char * const *filedirs = nfragment_dirs ? fragment_dirs : NULL;
+    int failed = 0;
+    for (int i=0; i<npaths; i++) {
+        struct stat st;
+        if (stat(paths[i], &st) != 0) {
+            warn("%s", paths[i]);
+            failed++;
+            continue;
+        }
+        if (!S_ISDIR(st.st_mode)) {
+            if (!print_fragment(paths[i], filedirs)) failed++;
+            continue;
+        }
+        const char *listed[] = {paths[i], NULL};
+        const char * const *dirs = nfragment_dirs ? fragment_dirs : listed;
+
+        /* in sequence order, as fragments are named */
+        struct dirent **entries;
+        int n = scandir(paths[i], &entries, not_hidden, alphasort);
+        if (n < 0) {
+            warn("%s", paths[i]);
+            failed++;
+            continue;
+        }
+        for (int j=0; j<n; j++) {
+            char path[strlen(paths[i])+1+strlen(entries[j]->d_name)+1];
+            sprintf(path, "%s/%s", paths[i], entries[j]->d_name);
+            if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && !print_fragment(path, dirs)) failed++;
+            free(entries[j]);
+        }
+        free(entries);
+    }
+    return failed;
 }
@@ -4,73 +4,176 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
 #include "fragment.h"
 
 static const char hexvalues[] = "0123456789abcdef";
 
-char *fragment_file_read_teamid_hex(FILE *fragment) {
-    if (!fragment) return NULL;
-    if (fseek(fragment, 0, SEEK_SET) != 0) {
-        warn("%s: could not seek in file", __func__);
-        return NULL;
-    }
-    uint8_t buf[TEAMLEN];
-    if (fread(buf, 1, sizeof(buf), fragment) != sizeof(buf)) {
-        warnx("%s: could not read enough data to get team id", __func__);
-        return NULL;
+static const char *alias_dir = NULL;
+static fragment_team_known_fn team_known = NULL;
+
+void fragment_set_alias_dir(const char *dir, fragment_team_known_fn known) {
+    alias_dir = dir;
+    team_known = known;
+}
+
+int fragment_resolve_alias(uint16_t alias, uint8_t *teamid, uint32_t *base) {
+    if (!alias_dir) return 0;
+    char path[strlen(alias_dir)+1+2*ALIASLEN+1];
+    sprintf(path, "%s/%04"PRIx16, alias_dir, alias);
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        if (errno != ENOENT) warn("%s", path);
+        return 0;
     }
-    char *hex = malloc(2*TEAMLEN+1);
-    if (!hex) {
-        warn("%s: could not allocate memory", __func__);
-        return NULL;
+    char hex[2*TEAMLEN+1];
+    uint32_t b;
+    int n = fscanf(fp, "%16[0-9a-f] %"SCNu32, hex, &b);
+    fclose(fp);
+    if (n != 2 || strlen(hex) != 2*TEAMLEN) {
+        warnx("%s: invalid alias record", path);
+        return 0;
     }
     for (int i=0; i<TEAMLEN; i++) {
-        hex[2*i] = hexvalues[buf[i] >> 4];
-        hex[2*i+1] = hexvalues[buf[i] & 0xf];
+        unsigned int byte;
+        sscanf(hex+2*i, "%2x", &byte);
+        teamid[i] = byte;
     }
-    hex[2*TEAMLEN] = '\0';
-    return hex;
+    *base = b;
+    return 1;
 }
 
 static_assert(SEQLEN == 4, "SEQLEN must be 4");
+static_assert(OFFSETLEN == 1, "OFFSETLEN must be 1");
+static_assert(ALIASLEN == 2, "ALIASLEN must be 2");
 
-int64_t fragment_file_read_seq(FILE *fragment) {
+long fragment_parse_header(const uint8_t *buf, long len, int compact, fragment_header *hdr) {
+    memset(hdr, 0, sizeof(*hdr));
+    if (compact && len >= 1 && buf[0] == FRAGHDR_COMPACT_V1) {
+        if (len < FRAGHDR_COMPACT_MINLEN) return 0;
+        hdr->compact = 1;
+        hdr->alias = ((uint16_t) buf[1] << 8) | buf[2];
+        uint64_t delta = 0;
+        long pos = 1 + ALIASLEN;
+        for (int shift = 0; ; shift += 7) {
+            if (pos >= len || pos >= 1 + ALIASLEN + VARINTMAXLEN) return 0;
+            delta |= (uint64_t) (buf[pos] & 0x7f) << shift;
+            if (!(buf[pos++] & 0x80)) break;
+        }
+        if (delta > UINT32_MAX || pos + OFFSETLEN > len) return 0;
+        hdr->seq = delta;
+        hdr->raw_offset = buf[pos++];
+        hdr->length = pos;
+        return pos;
+    }
+    if (len < FRAGHDRLEN) return 0;
+    memcpy(hdr->teamid, buf, TEAMLEN);
+    hdr->seq = ((uint32_t) buf[TEAMLEN] << 24) | ((uint32_t) buf[TEAMLEN+1] << 16)
+             | ((uint32_t) buf[TEAMLEN+2] << 8) | buf[TEAMLEN+3];
+    hdr->raw_offset = buf[TEAMLEN + SEQLEN];
+    hdr->length = FRAGHDRLEN;
+    return FRAGHDRLEN;
+}
+
+int fragment_file_read_header(FILE *fragment, fragment_header *hdr) {
     if (!fragment) return -1;
-    if (fseek(fragment, TEAMLEN, SEEK_SET) != 0) {
+    if (fseek(fragment, 0, SEEK_SET) != 0) {
         warn("%s: could not seek in file", __func__);
         return -1;
     }
-    uint8_t buf[SEQLEN];
-    if (fread(buf, 1, sizeof(buf), fragment) != sizeof(buf)) {
-        warnx("%s: could not read enough data to get sequence number", __func__);
+    uint8_t buf[FRAGHDR_MAXLEN];
+    size_t len = fread(buf, 1, sizeof(buf), fragment);
+    if (ferror(fragment)) {
+        warn("%s: could not read header", __func__);
+        return -1;
+    }
+    /* a team whose id starts with the marker keeps its full headers */
+    if (alias_dir && fragment_parse_header(buf, len, 1, hdr) && hdr->compact
+            && !(len >= FRAGHDRLEN && team_known && team_known(buf))) {
+        uint32_t delta = hdr->seq;
+        if (fragment_resolve_alias(hdr->alias, hdr->teamid, &hdr->base)) {
+            if ((uint64_t) hdr->base + delta > UINT32_MAX) {
+                warnx("%s: sequence number out of range", __func__);
+                return -1;
+            }
+            hdr->seq = hdr->base + delta;
+            return 0;
+        }
+        /* alias not registered, so treat as full header */
+    }
+    if (!fragment_parse_header(buf, len, 0, hdr)) {
+        warnx("%s: could not read enough data to get header", __func__);
         return -1;
     }
-    uint32_t seq = ((uint32_t) buf[0] << 24) | ((uint32_t) buf[1] << 16)
-                 | ((uint32_t) buf[2] << 8) | buf[3];
-    return seq;
+    return 0;
 }
 
-static_assert(OFFSETLEN == 1, "OFFSETLEN must be 1");
+long fragment_file_header_length(FILE *fragment) {
+    fragment_header hdr;
+    if (fragment_file_read_header(fragment, &hdr) < 0) return -1;
+    return hdr.length;
+}
 
-int fragment_file_read_raw_offset(FILE *fragment) {
-    if (!fragment) return -1;
-    if (fseek(fragment, TEAMLEN + SEQLEN, SEEK_SET) != 0) {
-        warn("%s: could not seek in file", __func__);
-        return -1;
+long fragment_format_header(uint8_t *buf, const fragment_header *hdr) {
+    if (hdr->compact) {
+        long pos = 0;
+        buf[pos++] = FRAGHDR_COMPACT_V1;
+        buf[pos++] = hdr->alias >> 8;
+        buf[pos++] = hdr->alias & 0xff;
+        uint32_t delta = hdr->seq - hdr->base;
+        do {
+            buf[pos] = delta & 0x7f;
+            delta >>= 7;
+            if (delta) buf[pos] |= 0x80;
+            pos++;
+        } while (delta);
+        buf[pos++] = hdr->raw_offset;
+        return pos;
     }
-    uint8_t buf[OFFSETLEN];
-    if (fread(buf, 1, sizeof(buf), fragment) != sizeof(buf)) {
-        warnx("%s: could not read enough data to get offset", __func__);
-        return -1;
+    memcpy(buf, hdr->teamid, TEAMLEN);
+    buf[TEAMLEN+0] = (hdr->seq >> 24) & 0xff;
+    buf[TEAMLEN+1] = (hdr->seq >> 16) & 0xff;
+    buf[TEAMLEN+2] = (hdr->seq >> 8)  & 0xff;
+    buf[TEAMLEN+3] = (hdr->seq >> 0)  & 0xff;
+    buf[TEAMLEN+SEQLEN] = hdr->raw_offset;
+    return FRAGHDRLEN;
+}
+
+char *fragment_file_read_teamid_hex(FILE *fragment) {
+    fragment_header hdr;
+    if (fragment_file_read_header(fragment, &hdr) < 0) return NULL;
+    char *hex = malloc(2*TEAMLEN+1);
+    if (!hex) {
+        warn("%s: could not allocate memory", __func__);
+        return NULL;
+    }
+    for (int i=0; i<TEAMLEN; i++) {
+        hex[2*i] = hexvalues[hdr.teamid[i] >> 4];
+        hex[2*i+1] = hexvalues[hdr.teamid[i] & 0xf];
     }
-    return buf[0];
+    hex[2*TEAMLEN] = '\0';
+    return hex;
+}
+
+int64_t fragment_file_read_seq(FILE *fragment) {
+    fragment_header hdr;
+    if (fragment_file_read_header(fragment, &hdr) < 0) return -1;
+    return hdr.seq;
+}
+
+int fragment_file_read_raw_offset(FILE *fragment) {
+    fragment_header hdr;
+    if (fragment_file_read_header(fragment, &hdr) < 0) return -1;
+    return hdr.raw_offset;
 }
 
 long fragment_file_first_message_offset(FILE *fragment) {
-    if (!fragment) return -1;
-    int raw = fragment_file_read_raw_offset(fragment);
-    if (raw < 0) return -1;
-    if (fseek(fragment, FRAGHDRLEN + raw, SEEK_SET) != 0) {
+    fragment_header hdr;
+    if (fragment_file_read_header(fragment, &hdr) < 0) return -1;
+    int raw = hdr.raw_offset;
+    if (fseek(fragment, hdr.length + raw, SEEK_SET) != 0) {
         warn("%s: could not seek in file", __func__);
         return -1;
     }
@@ -87,6 +190,64 @@ long fragment_file_first_message_offset(FILE *fragment) {
     }
 }
 
+static int compare_seq(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+int fragments_received_ranges(const char *dir, int64_t ack, seq_range *ranges, int max) {
+    static const char *subdirs[] = {"new", "partial", "done"};
+    uint32_t *seqs = NULL;
+    size_t count = 0, alloc = 0;
+
+    for (int i=0; i<sizeof(subdirs)/sizeof(subdirs[0]); i++) {
+        char path[strlen(dir)+1+strlen(subdirs[i])+1];
+        sprintf(path, "%s/%s", dir, subdirs[i]);
+        DIR *d = opendir(path);
+        if (!d) {
+            if (errno == ENOENT) continue;
+            warn("%s", path);
+            free(seqs);
+            return -1;
+        }
+        struct dirent *ent;
+        while ((ent = readdir(d))) {
+            /* only fragment names, not temporary files */
+            if (strlen(ent->d_name) != 10 || strspn(ent->d_name, "0123456789") != 10) continue;
+            int64_t seq = parse_seq(ent->d_name);
+            if (seq <= ack) continue;
+            if (count == alloc) {
+                alloc = alloc ? 2*alloc : 256;
+                uint32_t *more = realloc(seqs, alloc*sizeof(*seqs));
+                if (!more) {
+                    warn("%s: could not allocate memory", __func__);
+                    closedir(d);
+                    free(seqs);
+                    return -1;
+                }
+                seqs = more;
+            }
+            seqs[count++] = seq;
+        }
+        closedir(d);
+    }
+
+    qsort(seqs, count, sizeof(*seqs), compare_seq);
+
+    int n = 0;
+    for (size_t i=0; i<count; i++) {
+        if (n > 0 && seqs[i] <= ranges[n-1].last + 1) {
+            if (seqs[i] > ranges[n-1].last) ranges[n-1].last = seqs[i];
+            continue;
+        }
+        if (n == max) break;
+        ranges[n].first = ranges[n].last = seqs[i];
+        n++;
+    }
+    free(seqs);
+    return n;
+}
+
 static_assert(SEQLEN == 4, "SEQLEN must be 4");
 
 char *format_seq(int64_t seq) {
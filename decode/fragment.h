@@ -9,6 +9,55 @@
 #define FRAGHDRLEN (TEAMLEN + SEQLEN + OFFSETLEN)
 #define FRAGMENT_MAX_MESSAGES 99999
 
+/* Compact header, auto-detected alongside the full header above:
+ *
+ * | 0xf1 | team alias (2) | seq - alias base seq (LEB128 varint, 1-5) | offset (1) |
+ *
+ * Aliases are allocated per team by fragalias, and are only recognised when
+ * an alias directory has been set with fragment_set_alias_dir. Team ids are chosen by
+ * senders and may start with the marker too, so a header that reads as both is only
+ * taken as compact if its alias is registered and no team has the id it would otherwise
+ * give (fragalias does not allocate aliases that would shadow a team already known). */
+#define FRAGHDR_COMPACT_V1 0xf1
+#define ALIASLEN 2
+#define VARINTMAXLEN 5
+#define FRAGHDR_COMPACT_MINLEN (1 + ALIASLEN + 1 + OFFSETLEN)
+#define FRAGHDR_COMPACT_MAXLEN (1 + ALIASLEN + VARINTMAXLEN + OFFSETLEN)
+#define FRAGHDR_MAXLEN FRAGHDRLEN
+
+typedef struct fragment_header {
+    int compact;
+    uint16_t alias;
+    uint8_t teamid[TEAMLEN];
+    uint32_t base; /* alias base sequence number */
+    uint32_t seq;
+    uint8_t raw_offset;
+    long length; /* of header, in bytes */
+} fragment_header;
+
+/* 1 if a team with teamid is known, so a header giving it is that team's full header */
+typedef int (*fragment_team_known_fn)(const uint8_t *teamid);
+
+/* directory containing alias registry files, NULL to only accept full headers, and known
+ * (or NULL) to tell whether a header reading as both is a full one */
+void fragment_set_alias_dir(const char *dir, fragment_team_known_fn known);
+
+/* resolve alias to team id and base sequence number, returns 0 if not registered */
+int fragment_resolve_alias(uint16_t alias, uint8_t *teamid, uint32_t *base);
+
+/* length of header parsed from buf, 0 on error. compact headers are recognised
+ * if compact is set, and their team id and seq are left unresolved (seq holds the delta) */
+long fragment_parse_header(const uint8_t *buf, long len, int compact, fragment_header *hdr);
+
+/* 0 on success, negative on error */
+int fragment_file_read_header(FILE *fragment, fragment_header *hdr);
+
+/* length of header, negative on error */
+long fragment_file_header_length(FILE *fragment);
+
+/* write header to buf (at least FRAGHDR_MAXLEN long), returns length written */
+long fragment_format_header(uint8_t *buf, const fragment_header *hdr);
+
 /* NULL on error, should be free'd after use */
 char *fragment_file_read_teamid_hex(FILE *fragment);
 
@@ -21,6 +70,15 @@ int fragment_file_read_raw_offset(FILE *fragment);
 /* offset of first message start, 0 if no start of message, -1 on error */
 long fragment_file_first_message_offset(FILE *fragment);
 
+typedef struct seq_range {
+    uint32_t first;
+    uint32_t last;
+} seq_range;
+
+/* ranges of sequence numbers after ack with a fragment in new, partial or done
+ * under dir, lowest first. number of ranges (at most max), negative on error */
+int fragments_received_ranges(const char *dir, int64_t ack, seq_range *ranges, int max);
+
 /* NULL on error, should be free'd after use. Padded on left with 0s. */
 char *format_seq(int64_t seq);
 
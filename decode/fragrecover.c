@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <err.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fragment.h"
+#include "parity.h"
+#include "decode.h"
+
+static const char *fragment_dirs[] = {"new", "partial", "done"};
+
+static FILE *open_fragment(const char *seqstr) {
+    for (int i=0; i<sizeof(fragment_dirs)/sizeof(fragment_dirs[0]); i++) {
+        char path[strlen(fragment_dirs[i])+1+strlen(seqstr)+1];
+        sprintf(path, "%s/%s", fragment_dirs[i], seqstr);
+        FILE *fp = fopen(path, "r");
+        if (fp) return fp;
+        if (errno != ENOENT) err(1, "%s", path);
+    }
+    return NULL;
+}
+
+static FILE *open_parity(uint32_t start) {
+    char *seqstr = format_seq(start | PARITY_SEQ_FLAG);
+    if (!seqstr) exit(1);
+    char path[strlen("parity/")+strlen(seqstr)+1];
+    sprintf(path, "parity/%s", seqstr);
+    free(seqstr);
+    FILE *fp = fopen(path, "r");
+    if (!fp && errno != ENOENT) err(1, "%s", path);
+    return fp;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: fragrecover fragmentdir seq\n");
+        return 2;
+    }
+    char *dir = argv[1];
+    char *seqstr = argv[2];
+
+    if (chdir(dir) != 0) err(1, "%s: chdir", dir);
+
+    int64_t seq = parse_seq(seqstr);
+    if (seq < 0) errx(1, "%s: invalid sequence number", seqstr);
+
+    /* find the parity group containing seq */
+    FILE *parity = NULL;
+    uint32_t start = 0;
+    int k = 0;
+    if (seq_is_parity(seq)) {
+        start = seq & ~PARITY_SEQ_FLAG;
+        parity = open_parity(start);
+        if (!parity) return 0;
+        k = parity_group_size(parity);
+        if (k < 0) errx(1, "%s: invalid parity fragment", seqstr);
+    } else {
+        /* teams without parity have nothing to look for */
+        if (access("parity", F_OK) != 0) {
+            if (errno != ENOENT) err(1, "parity");
+            return 0;
+        }
+        /* groups are consecutive, so only the nearest parity fragment at or before seq
+         * can cover it, which is found within a group or two of probes */
+        for (int j=0; j<PARITY_MAX_GROUP && j<=seq; j++) {
+            parity = open_parity(seq-j);
+            if (!parity) continue;
+            k = parity_group_size(parity);
+            if (k > j) {
+                start = seq-j;
+                break;
+            }
+            fclose(parity);
+            parity = NULL;
+            break;
+        }
+        if (!parity) return 0;
+    }
+
+    FILE *fragments[PARITY_MAX_GROUP];
+    int missing = -1;
+    for (int i=0; i<k; i++) {
+        char *member = format_seq((int64_t) start + i);
+        if (!member) return 1;
+        fragments[i] = open_fragment(member);
+        free(member);
+        if (fragments[i]) continue;
+        if (missing >= 0) return 0; /* more than one missing, cannot recover yet */
+        missing = i;
+    }
+    if (missing < 0) return 0;
+
+    char *recovered = format_seq((int64_t) start + missing);
+    if (!recovered) return 1;
+
+    mkdir_or_die("new");
+
+    char tmp[strlen("new/.")+strlen(recovered)+strlen(".recover")+1];
+    sprintf(tmp, "new/.%s.recover", recovered);
+    char path[strlen("new/")+strlen(recovered)+1];
+    sprintf(path, "new/%s", recovered);
+
+    FILE *out = fopen(tmp, "w");
+    if (!out) err(1, "%s", tmp);
+    if (!parity_recover(out, parity, fragments, k, missing)) {
+        fclose(out);
+        unlink(tmp);
+        errx(1, "%s: could not recover fragment from parity group", recovered);
+    }
+    if (fclose(out) != 0) {
+        unlink(tmp);
+        err(1, "%s", tmp);
+    }
+    if (rename(tmp, path) != 0) err(1, "%s: move", path);
+
+    fprintf(stderr, "recovered fragment %s from parity group of %d\n", recovered, k);
+    puts(recovered);
+
+    return 0;
+}
@@ -1,27 +1,71 @@
 #include <stdio.h>
 #include <err.h>
+#include <errno.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
-#include <assert.h>
+#include <inttypes.h>
 #include "fragment.h"
 #include "message.h"
+#include "parity.h"
 
 static uint8_t msgbuf[MSG_MAXLEN+1];
 
+/* set when writing compact headers */
+static int compact = 0;
+static uint16_t alias;
+static uint32_t alias_base;
+
+static long header_length(uint32_t seq);
+static int read_raw_offset(FILE *fp, const char *seqstr);
 static void write_fragment_header(FILE *fp, uint8_t *teamid, uint32_t seq, uint8_t offset);
+static void write_parity(uint32_t start, int k);
+static int parity_size(uint32_t start);
+static uint32_t group_start(uint32_t seq, int group, int *closed);
 
 int main(int argc, char *argv[]) {
-    if (argc != 6) {
-        fprintf(stderr, "Usage: fragwrite dir teamid seqstart mtu msgfile\n");
+    int group = 0;
+    int flush = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "+k:fa:")) != -1) {
+        switch (opt) {
+            case 'a': {
+                unsigned int a;
+                int n;
+                if (sscanf(optarg, "%4x:%"SCNu32"%n", &a, &alias_base, &n) != 2 || optarg[n] != '\0') {
+                    errx(1, "%s: invalid alias, expected alias:baseseq", optarg);
+                }
+                alias = a;
+                compact = 1;
+                break;
+            }
+            case 'k': {
+                char *end = NULL;
+                group = strtol(optarg, &end, 10);
+                if (optarg[0] == '\0' || end[0] != '\0' || group < 1 || group > PARITY_MAX_GROUP) {
+                    errx(1, "%s: invalid parity group size", optarg);
+                }
+                break;
+            }
+            case 'f':
+                flush = 1;
+                break;
+            default:
+                argc = 0;
+        }
+    }
+    if (argc - optind != 5) {
+        fprintf(stderr, "Usage: fragwrite [-k groupsize [-f]] [-a alias:baseseq] dir teamid seqstart mtu msgfile\n");
         return 2;
     }
-    char *dir = argv[1];
-    char *team = argv[2];
-    char *seqstart = argv[3];
-    char *mtu_s = argv[4];
-    char *msgfilename = argv[5];
+    if (group && compact) errx(1, "parity fragments require full headers");
+    if (flush && !group) errx(1, "-f requires a parity group size");
+    char *dir = argv[optind];
+    char *team = argv[optind+1];
+    char *seqstart = argv[optind+2];
+    char *mtu_s = argv[optind+3];
+    char *msgfilename = argv[optind+4];
 
     FILE *msgfile = fopen(msgfilename, "r");
     if (!msgfile) err(1, "%s", msgfilename);
@@ -47,13 +91,21 @@ int main(int argc, char *argv[]) {
 
     int64_t seq = parse_seq(seqstart);
     if (seq < 0) errx(1, "%s: invalid sequence number", seqstart);
+    if (compact && seq < alias_base) errx(1, "%s: sequence number before alias base", seqstart);
 
     if (mtu_s[0] == '\0') errx(1, "empty mtu");
     char *end = NULL;
     long int mtu = strtol(mtu_s, &end, 10);
-    if (end[0] != '\0' || (mtu <= FRAGHDRLEN && mtu != -1) || mtu > UINT16_MAX) {
+    long maxhdrlen = compact ? FRAGHDR_COMPACT_MAXLEN : FRAGHDRLEN;
+    if (end[0] != '\0' || (mtu <= maxhdrlen && mtu != -1) || mtu > UINT16_MAX) {
         errx(1, "%s: invalid mtu or out of range", mtu_s);
     }
+    if (group && mtu != -1) {
+        /* leave room so that parity fragments also fit within the mtu */
+        if (mtu <= FRAGHDRLEN + PARITY_OVERHEAD) errx(1, "%s: mtu too small for parity", mtu_s);
+        mtu -= PARITY_OVERHEAD;
+    }
+    uint32_t maxseq = group ? PARITY_SEQ_FLAG-1 : UINT32_MAX;
 
     size_t payload = fread(msgbuf, 1, MSG_MAXLEN+1, msgfile);
     if (ferror(msgfile)) err(1, "%s", msgfilename);
@@ -83,37 +135,31 @@ int main(int argc, char *argv[]) {
     if (!fragment) err(1, "%s", seqstr);
     if (fseek(fragment, 0, SEEK_END) != 0) err(1, "%s", seqstr);
     long int len = ftell(fragment);
-    if (len >= FRAGHDRLEN) {
-        rawoffset = fragment_file_read_raw_offset(fragment);
-        if (rawoffset < 0) errx(1, "%s: could not read offset", seqstr);
-    } else {
-        rawoffset = -1;
-    }
+    rawoffset = read_raw_offset(fragment, seqstr);
 
-    while (rawoffset == 255 || (mtu != -1 && len >= mtu) || (mtu == -1 && len > 0)) {
+    /* fragments covered by parity are final, and are never appended to */
+    int closed = 0;
+    if (group) group_start(seq, group, &closed);
+    while (rawoffset == 255 || (mtu != -1 && len >= mtu) || (mtu == -1 && len > 0) || closed) {
         fclose(fragment);
         free(seqstr);
-        if (seq == UINT32_MAX) errx(1, "hit maximum sequence number");
+        if (seq == maxseq) errx(1, "hit maximum sequence number");
         seqstr = format_seq(++seq);
         if (!seqstr) return 1;
         fragment = fopen(seqstr, "a+");
         if (!fragment) err(1, "%s", seqstr);
         if (fseek(fragment, 0, SEEK_END) != 0) err(1, "%s", seqstr);
         len = ftell(fragment);
-        if (len >= FRAGHDRLEN) {
-            rawoffset = fragment_file_read_raw_offset(fragment);
-            if (rawoffset < 0) errx(1, "%s: could not read offset", seqstr);
-        } else {
-            rawoffset = -1;
-        }
+        rawoffset = read_raw_offset(fragment, seqstr);
+        if (group) group_start(seq, group, &closed);
     }
 
-    if (len > 0 && len <= FRAGHDRLEN) {
+    if (len > 0 && len <= header_length(seq)) {
         errx(1, "%s: existing fragment has invalid length", seqstr);
     }
 
     if (len == 0) {
-        len = FRAGHDRLEN;
+        len = header_length(seq);
         int offset = 0;
         fprintf(stderr, "info: writing header to %s (offset %d)\n", seqstr, offset);
         write_fragment_header(fragment, teamid, seq, offset);
@@ -131,19 +177,28 @@ int main(int argc, char *argv[]) {
         remaining -= towrite;
         available -= towrite;
 
+        /* a full fragment is final, and so is its group once it is the last one */
+        if (group && available == 0) {
+            uint32_t start = group_start(seq, group, &closed);
+            if (!closed && seq+1-start == group) {
+                if (fflush(fragment) != 0) err(1, "%s", seqstr);
+                write_parity(start, group);
+            }
+        }
+
         if (remaining == 0) break;
 
         if (available == 0) {
             fclose(fragment);
             free(seqstr);
-            if (seq == UINT32_MAX) errx(1, "hit maximum sequence number");
+            if (seq == maxseq) errx(1, "hit maximum sequence number");
             seqstr = format_seq(++seq);
             if (!seqstr) return 1;
             fragment = fopen(seqstr, "a+");
             if (!fragment) err(1, "%s", seqstr);
             if (fseek(fragment, 0, SEEK_END) != 0) err(1, "%s", seqstr);
             if (ftell(fragment) != 0) errx(1, "%s: unexpected file", seqstr);
-            available = mtu-FRAGHDRLEN;
+            available = mtu-header_length(seq);
             int offset = (remaining < available) ? remaining : available;
             if (offset > 255) offset = 255;
             fprintf(stderr, "info: writing header to %s (offset %d)\n", seqstr, offset);
@@ -151,18 +206,104 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    fclose(fragment);
+    if (fclose(fragment) != 0) err(1, "%s", seqstr);
+
+    /* close the group so far when asked to, after which its fragments are final and
+     * the next group starts with the next fragment */
+    if (group && flush) {
+        uint32_t start = group_start(seq, group, &closed);
+        if (!closed) write_parity(start, seq+1-start);
+    }
+}
+
+static long header_length(uint32_t seq) {
+    fragment_header hdr = {.compact = compact, .alias = alias, .base = alias_base, .seq = seq};
+    uint8_t buf[FRAGHDR_MAXLEN];
+    return fragment_format_header(buf, &hdr);
+}
+
+/* raw offset of existing fragment, -1 if it has no complete header yet */
+static int read_raw_offset(FILE *fp, const char *seqstr) {
+    uint8_t buf[FRAGHDR_MAXLEN];
+    if (fseek(fp, 0, SEEK_SET) != 0) err(1, "%s", seqstr);
+    size_t n = fread(buf, 1, sizeof(buf), fp);
+    if (ferror(fp)) err(1, "%s", seqstr);
+    if (fseek(fp, 0, SEEK_END) != 0) err(1, "%s", seqstr);
+    fragment_header hdr;
+    if (!fragment_parse_header(buf, n, compact, &hdr)) return -1;
+    if (hdr.compact != compact) errx(1, "%s: existing fragment has a different header format", seqstr);
+    return hdr.raw_offset;
 }
 
 static void write_fragment_header(FILE *fp, uint8_t *teamid, uint32_t seq, uint8_t offset) {
-    if (fwrite(teamid, 1, TEAMLEN, fp) != TEAMLEN) err(1, "fragment %d", seq);
-    static_assert(SEQLEN == 4, "SEQLEN must be 4");
-    uint8_t seqbytes[SEQLEN];
-    seqbytes[0] = (seq >> 24) & 0xff;
-    seqbytes[1] = (seq >> 16) & 0xff;
-    seqbytes[2] = (seq >> 8)  & 0xff;
-    seqbytes[3] = (seq >> 0)  & 0xff;
-    if (fwrite(seqbytes, 1, SEQLEN, fp) != SEQLEN) err(1, "fragment %d", seq);
-    static_assert(OFFSETLEN == 1, "OFFSETLEN must be 1");
-    if (fwrite(&offset, 1, OFFSETLEN, fp) != OFFSETLEN) err(1, "fragment %d", seq);
+    fragment_header hdr = {.compact = compact, .alias = alias, .base = alias_base,
+                           .seq = seq, .raw_offset = offset};
+    memcpy(hdr.teamid, teamid, TEAMLEN);
+    uint8_t buf[FRAGHDR_MAXLEN];
+    long len = fragment_format_header(buf, &hdr);
+    if (fwrite(buf, 1, len, fp) != len) err(1, "fragment %d", seq);
+}
+
+/* number of fragments covered by the parity for the group at start, 0 if it has none */
+static int parity_size(uint32_t start) {
+    char *seqstr = format_seq(start | PARITY_SEQ_FLAG);
+    if (!seqstr) exit(1);
+    FILE *fp = fopen(seqstr, "r");
+    if (!fp) {
+        if (errno != ENOENT) err(1, "%s", seqstr);
+        free(seqstr);
+        return 0;
+    }
+    int k = parity_group_size(fp);
+    if (k < 0) errx(1, "%s: invalid parity fragment", seqstr);
+    fclose(fp);
+    free(seqstr);
+    return k;
+}
+
+/* first fragment of the group containing seq, setting closed if it already has parity.
+ * Groups are consecutive, following on from the nearest parity fragment, which is
+ * within two groups of seq if there is one */
+static uint32_t group_start(uint32_t seq, int group, int *closed) {
+    uint32_t first = 0;
+    for (int j=0; j<2*group-1 && j<=seq; j++) {
+        int k = parity_size(seq-j);
+        if (!k) continue;
+        if (k > j) {
+            *closed = 1;
+            return seq-j;
+        }
+        first = seq-j+k;
+        break;
+    }
+    *closed = 0;
+    return seq - (seq-first) % group;
+}
+
+/* write parity for the k fragments from start, closing their group */
+static void write_parity(uint32_t start, int k) {
+
+    FILE *fragments[PARITY_MAX_GROUP];
+    for (int i=0; i<k; i++) {
+        char *seqstr = format_seq((int64_t) start + i);
+        if (!seqstr) exit(1);
+        fragments[i] = fopen(seqstr, "r");
+        if (!fragments[i]) {
+            warn("warning: %s: skipping parity for group starting %u", seqstr, start);
+            free(seqstr);
+            while (--i >= 0) fclose(fragments[i]);
+            return;
+        }
+        free(seqstr);
+    }
+
+    char *seqstr = format_seq(start | PARITY_SEQ_FLAG);
+    if (!seqstr) exit(1);
+    FILE *parity = fopen(seqstr, "w");
+    if (!parity) err(1, "%s", seqstr);
+    fprintf(stderr, "info: writing parity to %s (group of %d)\n", seqstr, k);
+    if (!parity_write(parity, fragments, k)) errx(1, "%s: could not write parity", seqstr);
+    if (fclose(parity) != 0) err(1, "%s", seqstr);
+    free(seqstr);
+    for (int i=0; i<k; i++) fclose(fragments[i]);
 }
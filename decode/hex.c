@@ -0,0 +1,86 @@
+#include <stdint.h>
+#include "hex.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static const char hexdigits[16] = u8"0123456789abcdef";
+
+/* value of each hex digit, -1 for anything else */
+static const int8_t hexvalues[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+/* table entries are offset by one so unlisted characters are 0 */
+#define HEXVALUE(c) (hexvalues[(uint8_t) (c)] - 1)
+
+#ifdef __SSE2__
+/* ascii digit for each nibble */
+static inline __m128i nibbles_to_hex(__m128i n) {
+    __m128i letters = _mm_cmpgt_epi8(n, _mm_set1_epi8(9));
+    __m128i digits = _mm_add_epi8(n, _mm_set1_epi8('0'));
+    return _mm_add_epi8(digits, _mm_and_si128(letters, _mm_set1_epi8('a'-'0'-10)));
+}
+
+/* value of each hex digit, sets *bad if any byte is not one */
+static inline __m128i hex_to_nibbles(__m128i c, int *bad) {
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0'-1)),
+                                  _mm_cmplt_epi8(c, _mm_set1_epi8('9'+1)));
+    __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a'-1)),
+                                   _mm_cmplt_epi8(lower, _mm_set1_epi8('f'+1)));
+    if (_mm_movemask_epi8(_mm_or_si128(digit, letter)) != 0xffff) *bad = 1;
+    return _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+                        _mm_and_si128(letter, _mm_sub_epi8(lower, _mm_set1_epi8('a'-10))));
+}
+
+/* each pair of nibbles (high first) to one byte in the low half of each 16 bit lane */
+static inline __m128i join_nibbles(__m128i n) {
+    __m128i high = _mm_slli_epi16(_mm_and_si128(n, _mm_set1_epi16(0x00ff)), 4);
+    return _mm_or_si128(high, _mm_srli_epi16(n, 8));
+}
+#endif
+
+void hex_encode(char *out, const uint8_t *in, size_t len) {
+    size_t i = 0;
+#ifdef __SSE2__
+    /* 16 bytes at a time */
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    for (; i+16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (in+i));
+        __m128i high = nibbles_to_hex(_mm_and_si128(_mm_srli_epi16(v, 4), mask));
+        __m128i low = nibbles_to_hex(_mm_and_si128(v, mask));
+        _mm_storeu_si128((__m128i *) (out+2*i), _mm_unpacklo_epi8(high, low));
+        _mm_storeu_si128((__m128i *) (out+2*i+16), _mm_unpackhi_epi8(high, low));
+    }
+#endif
+    for (; i<len; i++) {
+        out[2*i+0] = hexdigits[in[i] >> 4];
+        out[2*i+1] = hexdigits[in[i] & 0xf];
+    }
+    out[2*len] = '\0';
+}
+
+long hex_decode(uint8_t *out, const char *in, size_t len) {
+    if (len % 2 != 0) return -1;
+    size_t i = 0;
+#ifdef __SSE2__
+    /* 32 digits at a time */
+    int bad = 0;
+    for (; i+32 <= len && !bad; i += 32) {
+        __m128i a = hex_to_nibbles(_mm_loadu_si128((const __m128i *) (in+i)), &bad);
+        __m128i b = hex_to_nibbles(_mm_loadu_si128((const __m128i *) (in+i+16)), &bad);
+        _mm_storeu_si128((__m128i *) (out+i/2), _mm_packus_epi16(join_nibbles(a), join_nibbles(b)));
+    }
+    if (bad) return -1;
+#endif
+    for (; i<len; i += 2) {
+        int high = HEXVALUE(in[i]);
+        int low = HEXVALUE(in[i+1]);
+        if (high < 0 || low < 0) return -1;
+        out[i/2] = (high << 4) | low;
+    }
+    return len/2;
+}
@@ -0,0 +1,13 @@
+#ifndef HEX_H
+#define HEX_H
+#include <stddef.h>
+#include <stdint.h>
+
+/* write 2*len lowercase hex digits for in, and a terminating nul, to out */
+void hex_encode(char *out, const uint8_t *in, size_t len);
+
+/* decode len hex digits (either case) from in into len/2 bytes at out,
+ * returns the number of bytes, or -1 if len is odd or in has any other character */
+long hex_decode(uint8_t *out, const char *in, size_t len);
+
+#endif /* !HEX_H */
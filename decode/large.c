@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "large.h"
+
+typedef struct {
+    uint32_t offset;
+    uint32_t length;
+} range;
+
+static int compare_ranges(const void *a, const void *b) {
+    uint32_t x = ((const range *) a)->offset, y = ((const range *) b)->offset;
+    return (x > y) - (x < y);
+}
+
+static void large_path(char *path, size_t size, const char *dir, const struct message_large_chunk *chunk,
+                       const char *suffix) {
+    snprintf(path, size, "%s/%03u-%010u-%03d-%05u%s", dir, chunk->member, chunk->time, chunk->type,
+             chunk->upload, suffix);
+}
+
+/* append line to file at path, durable before returning, 0 on error */
+static int append_record(const char *path, int flags, const char *line) {
+    int fd = open(path, O_WRONLY|O_APPEND|O_CREAT|flags, 0666);
+    if (fd < 0) {
+        warn("%s", path);
+        return 0;
+    }
+    size_t len = strlen(line);
+    int okay = (write(fd, line, len) == len && fdatasync(fd) == 0);
+    if (!okay) warn("%s", path);
+    if (close(fd) != 0) okay = 0;
+    return okay;
+}
+
+/* returns 1 if the ranges listed in path cover all of total bytes, 0 if not, negative on error */
+static int ranges_complete(const char *path, uint32_t total) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        warn("%s", path);
+        return -1;
+    }
+    unsigned long recorded;
+    if (fscanf(fp, "total %lu\n", &recorded) != 1 || recorded != total) {
+        warnx("%s: total length does not match chunk", path);
+        fclose(fp);
+        return -1;
+    }
+
+    range *ranges = malloc(LARGE_MAX_CHUNKS * sizeof(range));
+    if (!ranges) {
+        warn("%s: could not allocate memory", __func__);
+        fclose(fp);
+        return -1;
+    }
+    int n = 0;
+    unsigned long offset, length;
+    while (fscanf(fp, "%lu %lu\n", &offset, &length) == 2) {
+        if (n == LARGE_MAX_CHUNKS) {
+            warnx("%s: too many chunks", path);
+            free(ranges);
+            fclose(fp);
+            return -1;
+        }
+        ranges[n].offset = offset;
+        ranges[n].length = length;
+        n++;
+    }
+    fclose(fp);
+
+    /* the same chunk may have been written more than once */
+    qsort(ranges, n, sizeof(range), compare_ranges);
+    uint32_t covered = 0;
+    for (int i=0; i<n && ranges[i].offset <= covered; i++) {
+        if (ranges[i].offset + ranges[i].length > covered) covered = ranges[i].offset + ranges[i].length;
+    }
+    free(ranges);
+    return covered >= total;
+}
+
+/* record that a message has been moved into place, so any chunk arriving later is
+ * dropped, and forget its ranges, 0 on error */
+static int mark_done(const char *donepath, const char *rangepath) {
+    int fd = open(donepath, O_WRONLY|O_CREAT, 0666);
+    if (fd < 0 || close(fd) != 0) {
+        warn("%s", donepath);
+        return 0;
+    }
+    if (unlink(rangepath) != 0 && errno != ENOENT) warn("%s", rangepath);
+    return 1;
+}
+
+int large_store_chunk(const char *dir, const struct message_large_chunk *chunk) {
+    char path[strlen(dir)+40];
+    char rangepath[strlen(dir)+40];
+    char donepath[strlen(dir)+40];
+    large_path(path, sizeof(path), dir, chunk, "");
+    large_path(rangepath, sizeof(rangepath), dir, chunk, ".ranges");
+    large_path(donepath, sizeof(donepath), dir, chunk, ".done");
+
+    /* a late copy of a chunk of a message already finished */
+    if (access(donepath, F_OK) == 0) return 0;
+
+    int fresh = 1;
+    int fd = open(path, O_RDWR|O_CREAT|O_EXCL, 0666);
+    if (fd >= 0 && access(rangepath, F_OK) == 0) {
+        /* ranges without contents are of a message moved into place just before a crash */
+        close(fd);
+        unlink(path);
+        return mark_done(donepath, rangepath) ? 0 : -1;
+    }
+    if (fd < 0 && errno == EEXIST) {
+        /* a crash may have come before anything was recorded */
+        fresh = (access(rangepath, F_OK) != 0);
+        fd = open(path, O_RDWR);
+    }
+    if (fd < 0) {
+        warn("%s", path);
+        return -1;
+    }
+    if (fresh) {
+        char header[32];
+        sprintf(header, "total %lu\n", (unsigned long) chunk->total);
+        if (ftruncate(fd, chunk->total) != 0 || !append_record(rangepath, O_TRUNC, header)) {
+            warn("%s", path);
+            close(fd);
+            unlink(rangepath);
+            unlink(path);
+            return -1;
+        }
+    }
+
+    /* the data must be safe before its range is recorded */
+    if (pwrite(fd, chunk->data, chunk->length, chunk->offset) != chunk->length || fdatasync(fd) != 0) {
+        warn("%s", path);
+        close(fd);
+        return -1;
+    }
+    if (close(fd) != 0) {
+        warn("%s", path);
+        return -1;
+    }
+
+    char record[32];
+    sprintf(record, "%lu %u\n", (unsigned long) chunk->offset, chunk->length);
+    if (!append_record(rangepath, 0, record)) return -1;
+
+    return ranges_complete(rangepath, chunk->total);
+}
+
+int large_finish(const char *dir, const struct message_large_chunk *chunk, const char *path) {
+    char datapath[strlen(dir)+40];
+    char rangepath[strlen(dir)+40];
+    char donepath[strlen(dir)+40];
+    large_path(datapath, sizeof(datapath), dir, chunk, "");
+    large_path(rangepath, sizeof(rangepath), dir, chunk, ".ranges");
+    large_path(donepath, sizeof(donepath), dir, chunk, ".done");
+
+    if (rename(datapath, path) != 0) {
+        warn("%s: move", path);
+        return 0;
+    }
+    return mark_done(donepath, rangepath);
+}
@@ -0,0 +1,22 @@
+#ifndef LARGE_H
+#define LARGE_H
+#include "message.h"
+
+/* most chunks accepted for one large message */
+#define LARGE_MAX_CHUNKS 4096
+
+/* Large messages are reassembled on disk as their chunks arrive, in a directory holding
+ * for each message its contents so far (member-time-type-upload) and the byte ranges
+ * written so far (member-time-type-upload.ranges), so only one chunk is ever held in
+ * memory. Once finished, only an empty member-time-type-upload.done is kept. */
+
+/* write chunk into its message under dir, returns 1 once every byte of the message
+ * has been written, 0 if chunks are still missing or the message was already
+ * finished, negative on error */
+int large_store_chunk(const char *dir, const struct message_large_chunk *chunk);
+
+/* move the complete message chunk belongs to from dir to path, marking it finished,
+ * 0 on error */
+int large_finish(const char *dir, const struct message_large_chunk *chunk, const char *path);
+
+#endif /* !LARGE_H */
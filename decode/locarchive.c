@@ -0,0 +1,513 @@
+#include <stdio.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "locarchive.h"
+
+/* block layout, big endian like the message formats:
+ * | member (1) | unused (1) | count (2) | first time (4) | last time (4) |
+ * | bytes of times (4) | of latitudes (4) | of longitudes (4) | of accuracies (4) | columns | */
+#define BLOCK_HDRLEN 28
+#define BLOCK_MAX_FIXES UINT16_MAX
+
+/* pending layout: | bytes of the archive complete (8) | fixes |, each fix
+ * | member (1) | unused (1) | accuracy (2) | time (4) | latitude (4) | longitude (4) | */
+#define PENDING_HDRLEN 8
+#define PENDING_RECLEN 16
+
+/* a column being written, bits used of its last byte (0 if all) */
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t size;
+    int bits;
+} column;
+
+/* a column being read, pos counted in bits */
+typedef struct {
+    const uint8_t *data;
+    size_t len;
+    size_t pos;
+    int error;
+} column_reader;
+
+typedef struct {
+    member_location *fixes;
+    long n;
+    long size;
+} fix_list;
+
+static void put_be(uint8_t *buf, uint64_t value, int len) {
+    for (int i=len-1; i>=0; i--) {
+        buf[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+static uint64_t get_be(const uint8_t *buf, int len) {
+    uint64_t value = 0;
+    for (int i=0; i<len; i++) value = (value << 8) | buf[i];
+    return value;
+}
+
+static int grow(column *c, size_t extra) {
+    if (c->len + extra <= c->size) return 1;
+    size_t size = c->size ? 2*c->size : 256;
+    while (size < c->len + extra) size *= 2;
+    uint8_t *data = realloc(c->data, size);
+    if (!data) {
+        warn("%s: could not allocate memory", __func__);
+        return 0;
+    }
+    c->data = data;
+    c->size = size;
+    return 1;
+}
+
+static int add_fix(fix_list *l, const member_location *fix) {
+    if (l->n == l->size) {
+        long size = l->size ? 2*l->size : 1024;
+        member_location *fixes = realloc(l->fixes, size * sizeof(member_location));
+        if (!fixes) {
+            warn("%s: could not allocate memory", __func__);
+            return 0;
+        }
+        l->fixes = fixes;
+        l->size = size;
+    }
+    l->fixes[l->n++] = *fix;
+    return 1;
+}
+
+static uint64_t zigzag(int64_t v) {
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v) {
+    return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+static int put_varint(column *c, uint64_t v) {
+    if (!grow(c, 10)) return 0;
+    do {
+        uint8_t b = v & 0x7f;
+        v >>= 7;
+        c->data[c->len++] = b | (v ? 0x80 : 0);
+    } while (v);
+    return 1;
+}
+
+static uint64_t get_varint(column_reader *r) {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64 && r->pos/8 < r->len; shift += 7) {
+        uint8_t b = r->data[r->pos/8];
+        r->pos += 8;
+        v |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) return v;
+    }
+    r->error = 1;
+    return 0;
+}
+
+/* append the n (up to 32) low bits of value, most significant first */
+static int put_bits(column *c, uint32_t value, int n) {
+    if (!grow(c, 5)) return 0;
+    while (n > 0) {
+        if (c->bits == 0) c->data[c->len++] = 0;
+        int take = 8 - c->bits < n ? 8 - c->bits : n;
+        uint8_t part = (value >> (n - take)) & ((1 << take) - 1);
+        c->data[c->len-1] |= part << (8 - c->bits - take);
+        c->bits = (c->bits + take) % 8;
+        n -= take;
+    }
+    return 1;
+}
+
+static uint32_t get_bits(column_reader *r, int n) {
+    if (r->pos + n > 8*r->len) {
+        r->error = 1;
+        return 0;
+    }
+    uint32_t v = 0;
+    while (n > 0) {
+        int bit = r->pos % 8;
+        int take = 8 - bit < n ? 8 - bit : n;
+        v = (v << take) | ((r->data[r->pos/8] >> (8 - bit - take)) & ((1 << take) - 1));
+        r->pos += take;
+        n -= take;
+    }
+    return v;
+}
+
+static uint32_t float_bits(float f) {
+    uint32_t v;
+    memcpy(&v, &f, sizeof(v));
+    return v;
+}
+
+static float bits_float(uint32_t v) {
+    float f;
+    memcpy(&f, &v, sizeof(f));
+    return f;
+}
+
+/* the XOR of value with the previous one, as 0 if the same, or 10 and the bits between the
+ * leading and trailing zeros of the previous XOR if they fit there, or else 11, the number of
+ * leading zeros (5 bits), the number of bits after them less one (5 bits) and those bits */
+static int put_xor(column *c, uint32_t value, uint32_t *prev, int *lead, int *len) {
+    uint32_t x = value ^ *prev;
+    *prev = value;
+    if (x == 0) return put_bits(c, 0, 1);
+    int l = __builtin_clz(x), t = __builtin_ctz(x);
+    if (*len > 0 && l >= *lead && t >= 32 - *lead - *len) {
+        return put_bits(c, 2, 2) && put_bits(c, x >> (32 - *lead - *len), *len);
+    }
+    *lead = l;
+    *len = 32 - l - t;
+    return put_bits(c, 3, 2) && put_bits(c, *lead, 5) && put_bits(c, *len - 1, 5) && put_bits(c, x >> t, *len);
+}
+
+static uint32_t get_xor(column_reader *r, uint32_t *prev, int *lead, int *len) {
+    if (!get_bits(r, 1)) return *prev;
+    if (get_bits(r, 1)) {
+        *lead = get_bits(r, 5);
+        *len = get_bits(r, 5) + 1;
+    }
+    if (*len == 0 || *lead + *len > 32) {
+        r->error = 1;
+        return 0;
+    }
+    *prev ^= get_bits(r, *len) << (32 - *lead - *len);
+    return *prev;
+}
+
+/* append a block of n fixes of one member, in time order, to out */
+static int write_block(column *out, const member_location *fixes, long n) {
+    column cols[4] = {{NULL}}; /* times, latitudes, longitudes, accuracies */
+    uint32_t latprev = 0, lngprev = 0;
+    int latlead = 0, latlen = 0, lnglead = 0, lnglen = 0;
+    int64_t prevdelta = 0;
+    int prevacc = 0;
+    int okay = 1;
+    for (long i=0; okay && i<n; i++) {
+        int64_t delta = i ? (int64_t) fixes[i].time - fixes[i-1].time : 0;
+        okay = (i == 0 || put_varint(&cols[0], zigzag(delta - prevdelta)))
+            && put_xor(&cols[1], float_bits(fixes[i].lat), &latprev, &latlead, &latlen)
+            && put_xor(&cols[2], float_bits(fixes[i].lng), &lngprev, &lnglead, &lnglen)
+            && put_varint(&cols[3], zigzag(fixes[i].acc - prevacc));
+        prevdelta = delta;
+        prevacc = fixes[i].acc;
+    }
+
+    size_t len = BLOCK_HDRLEN;
+    for (int i=0; i<4; i++) len += cols[i].len;
+    if (okay && grow(out, len)) {
+        uint8_t *hdr = out->data + out->len;
+        hdr[0] = fixes[0].member;
+        hdr[1] = 0;
+        put_be(hdr+2, n, 2);
+        put_be(hdr+4, fixes[0].time, 4);
+        put_be(hdr+8, fixes[n-1].time, 4);
+        out->len += BLOCK_HDRLEN;
+        for (int i=0; i<4; i++) {
+            put_be(hdr+12+4*i, cols[i].len, 4);
+            if (cols[i].len) memcpy(out->data + out->len, cols[i].data, cols[i].len);
+            out->len += cols[i].len;
+        }
+    } else {
+        okay = 0;
+    }
+    for (int i=0; i<4; i++) free(cols[i].data);
+    return okay;
+}
+
+/* add fixes of block (len bytes in all) with times from after to before to found, 0 if invalid */
+static int read_block(const uint8_t *block, size_t len, rel_epoch after, rel_epoch before, fix_list *found) {
+    if (len < BLOCK_HDRLEN) return 0;
+    long n = get_be(block+2, 2);
+    column_reader cols[4];
+    size_t off = BLOCK_HDRLEN;
+    for (int i=0; i<4; i++) {
+        cols[i] = (column_reader) {.data = block + off, .len = get_be(block+12+4*i, 4)};
+        /* the columns must fill the block exactly */
+        if (cols[i].len > len - off) return 0;
+        off += cols[i].len;
+    }
+    if (off != len) return 0;
+    uint32_t latprev = 0, lngprev = 0;
+    int latlead = 0, latlen = 0, lnglead = 0, lnglen = 0;
+    int64_t time = get_be(block+4, 4), delta = 0;
+    int acc = 0;
+    for (long i=0; i<n; i++) {
+        if (i) {
+            delta += unzigzag(get_varint(&cols[0]));
+            time += delta;
+        }
+        member_location fix = {.member = block[0], .time = time};
+        fix.lat = bits_float(get_xor(&cols[1], &latprev, &latlead, &latlen));
+        fix.lng = bits_float(get_xor(&cols[2], &lngprev, &lnglead, &lnglen));
+        acc += unzigzag(get_varint(&cols[3]));
+        fix.acc = acc;
+        if (cols[0].error || cols[1].error || cols[2].error || cols[3].error || time < 0 || time > REL_EPOCH_MAX) {
+            return 0;
+        }
+        /* in time order, so nothing after this is wanted */
+        if (time > before) break;
+        if (time >= after && !add_fix(found, &fix)) return 0;
+    }
+    return 1;
+}
+
+static void pack_fix(uint8_t *rec, const member_location *fix) {
+    rec[0] = fix->member;
+    rec[1] = 0;
+    put_be(rec+2, (uint16_t) fix->acc, 2);
+    put_be(rec+4, fix->time, 4);
+    put_be(rec+8, float_bits(fix->lat), 4);
+    put_be(rec+12, float_bits(fix->lng), 4);
+}
+
+static void unpack_fix(member_location *fix, const uint8_t *rec) {
+    fix->member = rec[0];
+    fix->acc = (int16_t) get_be(rec+2, 2);
+    fix->time = get_be(rec+4, 4);
+    fix->lat = bits_float(get_be(rec+8, 4));
+    fix->lng = bits_float(get_be(rec+12, 4));
+}
+
+/* complete length of the archive and fixes pending in fd, 0 on error */
+static int read_pending(int fd, const char *path, uint64_t *archived, fix_list *pending) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        warn("%s", path);
+        return 0;
+    }
+    uint8_t *buf = malloc(st.st_size ? st.st_size : 1);
+    if (!buf) {
+        warn("%s: could not allocate memory", __func__);
+        return 0;
+    }
+    int okay = (pread(fd, buf, st.st_size, 0) == st.st_size && st.st_size >= PENDING_HDRLEN);
+    if (!okay) warnx("%s: could not read", path);
+    if (okay) *archived = get_be(buf, PENDING_HDRLEN);
+    /* a fix cut short was never added */
+    for (off_t off = PENDING_HDRLEN; okay && off + PENDING_RECLEN <= st.st_size; off += PENDING_RECLEN) {
+        member_location fix;
+        unpack_fix(&fix, buf+off);
+        okay = add_fix(pending, &fix);
+    }
+    free(buf);
+    return okay;
+}
+
+/* replace the pending fixes at path with none, the archive being complete to archived */
+static int write_pending(const char *path, uint64_t archived) {
+    char tmp[strlen(path)+strlen(".tmp")+1];
+    sprintf(tmp, "%s.tmp", path);
+    uint8_t hdr[PENDING_HDRLEN];
+    put_be(hdr, archived, PENDING_HDRLEN);
+    int fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if (fd < 0 || write(fd, hdr, sizeof(hdr)) != sizeof(hdr) || fsync(fd) != 0) {
+        warn("%s", tmp);
+        if (fd >= 0) close(fd);
+        unlink(tmp);
+        return 0;
+    }
+    close(fd);
+    /* until replaced the old fixes are still pending, and any blocks made of them ignored */
+    if (rename(tmp, path) != 0) {
+        warn("%s", path);
+        unlink(tmp);
+        return 0;
+    }
+
+    /* and the replacement is only durable once the directory is synced */
+    char *copy = strdup(path);
+    int dirfd = copy ? open(dirname(copy), O_RDONLY|O_DIRECTORY) : -1;
+    free(copy);
+    if (dirfd < 0 || fsync(dirfd) != 0) {
+        warn("%s: fsync directory", path);
+        if (dirfd >= 0) close(dirfd);
+        return 0;
+    }
+    close(dirfd);
+    return 1;
+}
+
+static int compare_member_time(const void *a, const void *b) {
+    const member_location *x = a, *y = b;
+    if (x->member != y->member) return (x->member > y->member) - (x->member < y->member);
+    return (x->time > y->time) - (x->time < y->time);
+}
+
+static int compare_time_member(const void *a, const void *b) {
+    const member_location *x = a, *y = b;
+    if (x->time != y->time) return (x->time > y->time) - (x->time < y->time);
+    return (x->member > y->member) - (x->member < y->member);
+}
+
+/* compress fixes (sorted by member then time) into blocks appended to the archive fd at
+ * archived, returning its new length or 0 on error */
+static uint64_t write_blocks(int fd, const char *path, uint64_t archived, const member_location *fixes, long n) {
+    column out = {NULL};
+    int okay = 1;
+    for (long start = 0, end; okay && start < n; start = end) {
+        for (end = start+1; end < n && end-start < BLOCK_MAX_FIXES && fixes[end].member == fixes[start].member; end++);
+        okay = write_block(&out, fixes+start, end-start);
+    }
+    /* anything after the complete archive is from a flush that did not finish */
+    if (okay && (ftruncate(fd, archived) != 0 || pwrite(fd, out.data, out.len, archived) != out.len
+            || fdatasync(fd) != 0)) {
+        warn("%s", path);
+        okay = 0;
+    }
+    free(out.data);
+    return okay ? archived + out.len : 0;
+}
+
+int locarchive_append(const char *teamdir, const member_location *fixes, long n) {
+    char path[strlen(teamdir)+1+strlen(LOCARCHIVE_FILE)+1];
+    sprintf(path, "%s/%s", teamdir, LOCARCHIVE_FILE);
+    char pendpath[strlen(teamdir)+1+strlen(LOCARCHIVE_PENDING)+1];
+    sprintf(pendpath, "%s/%s", teamdir, LOCARCHIVE_PENDING);
+
+    int archive = open(path, O_RDWR|O_CREAT, 0666);
+    if (archive < 0) {
+        warn("%s", path);
+        return 0;
+    }
+    int pendfd = -1;
+    int okay = 0;
+    fix_list pending = {NULL};
+    /* the pending file is replaced, so the archive is locked instead */
+    if (flock(archive, LOCK_EX) != 0) {
+        warn("%s: flock", path);
+        goto append_done;
+    }
+
+    pendfd = open(pendpath, O_RDWR);
+    if (pendfd < 0 && errno == ENOENT) {
+        /* nothing pending yet, so the archive is complete as it is */
+        struct stat st;
+        if (fstat(archive, &st) != 0 || !write_pending(pendpath, st.st_size)) goto append_done;
+        pendfd = open(pendpath, O_RDWR);
+    }
+    uint64_t archived;
+    if (pendfd < 0) {
+        warn("%s", pendpath);
+        goto append_done;
+    }
+    if (!read_pending(pendfd, pendpath, &archived, &pending)) goto append_done;
+
+    if (pending.n + n < LOCARCHIVE_FLUSH) {
+        uint8_t *buf = malloc(n * PENDING_RECLEN);
+        if (!buf) {
+            warn("%s: could not allocate memory", __func__);
+            goto append_done;
+        }
+        for (long i=0; i<n; i++) pack_fix(buf + i*PENDING_RECLEN, &fixes[i]);
+        okay = (pwrite(pendfd, buf, n * PENDING_RECLEN, PENDING_HDRLEN + pending.n * PENDING_RECLEN) == n * PENDING_RECLEN
+                && fdatasync(pendfd) == 0);
+        if (!okay) warn("%s", pendpath);
+        free(buf);
+        goto append_done;
+    }
+
+    for (long i=0; i<n; i++) {
+        if (!add_fix(&pending, &fixes[i])) goto append_done;
+    }
+    qsort(pending.fixes, pending.n, sizeof(member_location), compare_member_time);
+    archived = write_blocks(archive, path, archived, pending.fixes, pending.n);
+    okay = archived && write_pending(pendpath, archived);
+
+append_done:
+    free(pending.fixes);
+    if (pendfd >= 0) close(pendfd);
+    close(archive);
+    return okay;
+}
+
+long locarchive_read(const char *teamdir, int member, rel_epoch after, rel_epoch before,
+                     member_location **fixes) {
+    *fixes = NULL;
+    char path[strlen(teamdir)+1+strlen(LOCARCHIVE_FILE)+1];
+    sprintf(path, "%s/%s", teamdir, LOCARCHIVE_FILE);
+    char pendpath[strlen(teamdir)+1+strlen(LOCARCHIVE_PENDING)+1];
+    sprintf(pendpath, "%s/%s", teamdir, LOCARCHIVE_PENDING);
+
+    /* read before the archive, which is only ever added to beyond what this says is complete */
+    int pendfd = open(pendpath, O_RDONLY);
+    if (pendfd < 0) {
+        if (errno == ENOENT) return 0;
+        warn("%s", pendpath);
+        return -1;
+    }
+    uint64_t archived = 0;
+    fix_list pending = {NULL}, found = {NULL};
+    int okay = read_pending(pendfd, pendpath, &archived, &pending);
+    close(pendfd);
+
+    const uint8_t *map = NULL;
+    if (okay && archived > 0) {
+        int fd = open(path, O_RDONLY);
+        map = (fd < 0) ? MAP_FAILED : mmap(NULL, archived, PROT_READ, MAP_SHARED, fd, 0);
+        if (fd >= 0) close(fd);
+        if (map == MAP_FAILED) {
+            warn("%s", path);
+            map = NULL;
+            okay = 0;
+        }
+    }
+    /* blocks of other members or times are skipped over by their headers alone */
+    for (uint64_t off = 0; okay && off < archived; ) {
+        const uint8_t *block = map + off;
+        uint64_t len = BLOCK_HDRLEN;
+        if (off + len <= archived) {
+            for (int i=0; i<4; i++) len += get_be(block+12+4*i, 4);
+        }
+        if (off + len > archived) {
+            warnx("%s: block at %llu is cut short", path, (unsigned long long) off);
+            okay = 0;
+            break;
+        }
+        if ((member < 0 || block[0] == member) && get_be(block+8, 4) >= after && get_be(block+4, 4) <= before
+                && !read_block(block, len, after, before, &found)) {
+            warnx("%s: block at %llu is invalid", path, (unsigned long long) off);
+            okay = 0;
+        }
+        off += len;
+    }
+    if (map) munmap((void *) map, archived);
+
+    for (long i=0; okay && i<pending.n; i++) {
+        const member_location *fix = &pending.fixes[i];
+        if ((member < 0 || fix->member == member) && fix->time >= after && fix->time <= before) {
+            okay = add_fix(&found, fix);
+        }
+    }
+    free(pending.fixes);
+    if (!okay) {
+        free(found.fixes);
+        return -1;
+    }
+
+    /* the same fix is archived again when decoding its message is retried */
+    qsort(found.fixes, found.n, sizeof(member_location), compare_time_member);
+    long n = 0;
+    for (long i=0; i<found.n; i++) {
+        if (n > 0 && found.fixes[n-1].time == found.fixes[i].time && found.fixes[n-1].member == found.fixes[i].member) {
+            continue;
+        }
+        found.fixes[n++] = found.fixes[i];
+    }
+    *fixes = found.fixes;
+    return n;
+}
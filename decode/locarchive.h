@@ -0,0 +1,23 @@
+#ifndef LOCARCHIVE_H
+#define LOCARCHIVE_H
+#include "message.h"
+
+/* Location fixes of each team's members are kept compressed in <team>/messages/locations,
+ * as blocks of one member's fixes in time order, each column compressed on its own:
+ * times as deltas of deltas, coordinates by XOR with the previous (as floats), accuracy
+ * as deltas. Fixes are held uncompressed in <team>/messages/locations.pending until
+ * LOCARCHIVE_FLUSH have built up, which also records how much of the archive is complete. */
+#define LOCARCHIVE_FILE "messages/locations"
+#define LOCARCHIVE_PENDING "messages/locations.pending"
+#define LOCARCHIVE_FLUSH 256
+
+/* add n fixes to the archive of teamdir, durable before returning, 0 on error */
+int locarchive_append(const char *teamdir, const member_location *fixes, long n);
+
+/* fixes archived for teamdir from member (any if negative) with times from after to before,
+ * in time order (fixes archived more than once only given once), as a malloc'd array in
+ * *fixes, number found or negative on error */
+long locarchive_read(const char *teamdir, int member, rel_epoch after, rel_epoch before,
+                     member_location **fixes);
+
+#endif /* !LOCARCHIVE_H */
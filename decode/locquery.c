@@ -0,0 +1,54 @@
+#include <stdio.h>
+#include <err.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "message.h"
+#include "locarchive.h"
+
+/* parse reltime as in JSON (100 per unit of rel_epoch) */
+static rel_epoch parse_reltime(const char *arg) {
+    char *end;
+    double t = strtod(arg, &end);
+    if (arg[0] == '\0' || *end != '\0' || t < 0 || t/100 > REL_EPOCH_MAX) errx(2, "%s: invalid reltime", arg);
+    return t/100;
+}
+
+int main(int argc, char *argv[]) {
+    int member = -1;
+    rel_epoch after = 0, before = REL_EPOCH_MAX;
+    int opt;
+    while ((opt = getopt(argc, argv, "a:b:m:")) != -1) {
+        switch (opt) {
+            case 'a':
+                after = parse_reltime(optarg);
+                break;
+            case 'b':
+                before = parse_reltime(optarg);
+                break;
+            case 'm':
+                member = atoi(optarg);
+                if (member < 0 || member > UINT8_MAX) errx(2, "%s: invalid member", optarg);
+                break;
+            default:
+                argc = 0;
+        }
+    }
+    if (argc - optind != 1) {
+        fprintf(stderr, "Usage: locquery [-m member] [-a reltime] [-b reltime] teamdir\n");
+        fprintf(stderr, "Lists location fixes archived for the team in teamdir (from member, and from reltime\n");
+        fprintf(stderr, "after up to before) in time order, as JSON\n");
+        return 2;
+    }
+    char *teamdir = argv[optind];
+
+    member_location *fixes;
+    long n = locarchive_read(teamdir, member, after, before, &fixes);
+    if (n < 0) errx(1, "%s: could not read location archive", teamdir);
+    for (long i=0; i<n; i++) {
+        /* members as in the decoder's JSON, floats to the precision they were sent with */
+        printf("{\"member\":%u,\"reltime\":%.0f,\"lat\":%.9g,\"lng\":%.9g,\"acc\":%d}\n",
+               fixes[i].member, 100.0*fixes[i].time, fixes[i].lat, fixes[i].lng, fixes[i].acc);
+    }
+    free(fixes);
+    return (fflush(stdout) == 0) ? 0 : 1;
+}
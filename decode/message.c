@@ -1,12 +1,16 @@
 #include <stdio.h>
 #include <err.h>
 #include <assert.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include "message.h"
 #include "fragment.h"
 #include "utf8.h"
+#include "cbor.h"
+#include "hex.h"
 #include "ccan/json/json.h"
 
 static_assert(MSG_TYPELEN == 1, "MSG_TYPELEN must be 1");
@@ -79,7 +83,89 @@ long fragment_file_offset_nth_message(FILE *fragment, int n) {
     return off;
 }
 
+/* where to look for fragments, either directories by name, already open, or opened by a callback */
+typedef struct {
+    const char * const *dirs;
+    const int *dirfds;
+    fragment_open_fn open;
+    void *arg;
+} fragment_search;
+
+static FILE *open_fragment(fragment_search search, const char *seqstr) {
+    if (search.open) return search.open(search.arg, seqstr);
+    if (search.dirfds) {
+        for (const int *d = search.dirfds; *d >= 0; d++) {
+            int fd = openat(*d, seqstr, O_RDONLY);
+            if (fd < 0) continue;
+            FILE *fp = fdopen(fd, "r");
+            if (!fp) close(fd);
+            return fp;
+        }
+        return NULL;
+    }
+    if (!search.dirs) return fopen(seqstr, "r");
+    FILE *fp = NULL;
+    for (const char * const *d = search.dirs; *d && !fp; d++) {
+        char path[strlen(*d)+1+strlen(seqstr)+1];
+        sprintf(path, "%s/%s", *d, seqstr);
+        fp = fopen(path, "r");
+    }
+    return fp;
+}
+
+static long walk_message(fragment_search search, uint32_t seq, int n, uint8_t *message_header,
+                         message_piece_fn fn, void *arg, int *span);
+
 long fragments_extract_message(uint32_t seq, int n, uint8_t *buf, int *span) {
+    return fragments_extract_message_in(NULL, seq, n, buf, span);
+}
+
+static int read_piece(void *arg, FILE *fragment, long off, long pos, long len) {
+    uint8_t *buf = arg;
+    if (fseek(fragment, off, SEEK_SET) != 0 || fread(buf+pos, 1, len, fragment) != len) {
+        warn("%s: could not read message", __func__);
+        return 0;
+    }
+    return 1;
+}
+
+long fragments_extract_message_in(const char * const *dirs, uint32_t seq, int n, uint8_t *buf, int *span) {
+    uint8_t header[MSG_HDRLEN];
+    long total_len = fragments_walk_message_in(dirs, seq, n, header, buf ? read_piece : NULL, buf, span);
+    if (total_len && buf) memcpy(buf, header, MSG_HDRLEN);
+    return total_len;
+}
+
+long fragments_extract_message_at(const int *dirfds, uint32_t seq, int n, uint8_t *buf, int *span) {
+    uint8_t header[MSG_HDRLEN];
+    fragment_search search = {.dirfds = dirfds};
+    long total_len = walk_message(search, seq, n, header, buf ? read_piece : NULL, buf, span);
+    if (total_len && buf) memcpy(buf, header, MSG_HDRLEN);
+    return total_len;
+}
+
+long fragments_extract_message_with(fragment_open_fn open, void *openarg, uint32_t seq, int n, uint8_t *buf, int *span) {
+    uint8_t header[MSG_HDRLEN];
+    fragment_search search = {.open = open, .arg = openarg};
+    long total_len = walk_message(search, seq, n, header, buf ? read_piece : NULL, buf, span);
+    if (total_len && buf) memcpy(buf, header, MSG_HDRLEN);
+    return total_len;
+}
+
+long fragments_walk_message_in(const char * const *dirs, uint32_t seq, int n, uint8_t *message_header,
+                               message_piece_fn fn, void *arg, int *span) {
+    fragment_search search = {.dirs = dirs};
+    return walk_message(search, seq, n, message_header, fn, arg, span);
+}
+
+long fragments_walk_message_at(const int *dirfds, uint32_t seq, int n, uint8_t *message_header,
+                               message_piece_fn fn, void *arg, int *span) {
+    fragment_search search = {.dirfds = dirfds};
+    return walk_message(search, seq, n, message_header, fn, arg, span);
+}
+
+static long walk_message(fragment_search search, uint32_t seq, int n, uint8_t *message_header,
+                         message_piece_fn fn, void *arg, int *span) {
     char *seqstr = NULL;
     FILE *fragment = NULL;
 
@@ -87,19 +173,19 @@ long fragments_extract_message(uint32_t seq, int n, uint8_t *buf, int *span) {
 
     seqstr = format_seq(seq);
     if (!seqstr) goto extract_error;
-    fragment = fopen(seqstr, "r");
+    fragment = open_fragment(search, seqstr);
     if (!fragment) {
         warn("%s", seqstr);
         goto extract_error;
     }
     if (span) (*span)++;
     long firstoff = 0;
+    long hdrlen = -1;
     long off = fragment_file_offset_nth_message(fragment, n);
     if (off < 0) {
         warnx("%s: could not get offset of message %d (%s)", seqstr, n, __func__);
         goto extract_error;
     }
-    uint8_t message_header[MSG_HDRLEN];
     long total_read = 0;
     while (1) {
         if (fseek(fragment, off, SEEK_SET) != 0) {
@@ -129,13 +215,17 @@ long fragments_extract_message(uint32_t seq, int n, uint8_t *buf, int *span) {
         seqstr = format_seq(++seq);
         if (!seqstr) goto extract_error;
         fclose(fragment);
-        fragment = fopen(seqstr, "r");
+        fragment = open_fragment(search, seqstr);
         if (!fragment) {
             warn("%s", seqstr);
             goto extract_error;
         }
         if (span) (*span)++;
-        off = FRAGHDRLEN;
+        off = hdrlen = fragment_file_header_length(fragment);
+        if (off < 0) {
+            warnx("%s: could not read header", seqstr);
+            goto extract_error;
+        }
         firstoff = fragment_file_first_message_offset(fragment);
         if (firstoff < 0) {
             warnx("%s: could not read offset", seqstr);
@@ -149,8 +239,6 @@ long fragments_extract_message(uint32_t seq, int n, uint8_t *buf, int *span) {
     long msg_len = ((unsigned long) message_header[1] << 8) + message_header[2];
     long total_len = MSG_HDRLEN + msg_len;
 
-    if (buf) memcpy(buf+0, message_header, total_read);
-
     while ((msg_len > 0) && 1) {
 
         if (firstoff > 0 && off+(total_len-total_read) > firstoff) {
@@ -158,26 +246,17 @@ long fragments_extract_message(uint32_t seq, int n, uint8_t *buf, int *span) {
             goto extract_error;
         }
 
-        size_t more;
-        if (buf) {
-            more = fread(buf+total_read, 1, total_len - total_read, fragment);
-            if (ferror(fragment)) {
-                warn("%s", seqstr);
-                goto extract_error;
-            }
-        } else {
-            /* simulate read */
-            if (fseek(fragment, 0, SEEK_END) != 0) {
-                warn("%s: could not seek in file", seqstr);
-                goto extract_error;
-            }
-            long remaining = ftell(fragment) - off;
-            more = (remaining < total_len - total_read) ? remaining : total_len - total_read;
+        if (fseek(fragment, 0, SEEK_END) != 0) {
+            warn("%s: could not seek in file", seqstr);
+            goto extract_error;
         }
-        if (more == 0 && off == FRAGHDRLEN) {
+        long remaining = ftell(fragment) - off;
+        long more = (remaining < total_len - total_read) ? remaining : total_len - total_read;
+        if (more == 0 && off == hdrlen) {
             warnx("%s: fragment with no data", seqstr);
             goto extract_error;
         }
+        if (more > 0 && fn && !fn(arg, fragment, off, total_read, more)) goto extract_error;
 
         total_read += more;
         off += more;
@@ -193,7 +272,7 @@ long fragments_extract_message(uint32_t seq, int n, uint8_t *buf, int *span) {
         seqstr = format_seq(++seq);
         if (!seqstr) goto extract_error;
         fclose(fragment);
-        fragment = fopen(seqstr, "r");
+        fragment = open_fragment(search, seqstr);
         if (!fragment) {
             warn("%s", seqstr);
             goto extract_error;
@@ -204,7 +283,11 @@ long fragments_extract_message(uint32_t seq, int n, uint8_t *buf, int *span) {
             warnx("%s: could not read offset", seqstr);
             goto extract_error;
         }
-        off = FRAGHDRLEN;
+        off = hdrlen = fragment_file_header_length(fragment);
+        if (off < 0) {
+            warnx("%s: could not read header", seqstr);
+            goto extract_error;
+        }
         if (fseek(fragment, off, SEEK_SET) != 0) {
             warn("%s: could not seek in file", seqstr);
             goto extract_error;
@@ -372,6 +455,44 @@ static int parse_magpi_form(struct message_magpi_form *msg, uint8_t *payload, un
     return 1;
 }
 
+static int parse_large_chunk(struct message_large_chunk *msg, uint8_t *payload, unsigned int len) {
+    if (len <= LARGE_CHUNK_HDRLEN) return 0;
+    msg->member = payload[0];
+    msg->time = payload[1];
+    for (int i=1; i<4; i++) {
+        msg->time = (msg->time << 8) + payload[1+i];
+    }
+    msg->type = payload[5];
+    msg->upload = (payload[6] << 8) + payload[7];
+    msg->total = 0;
+    msg->offset = 0;
+    for (int i=0; i<4; i++) {
+        msg->total = (msg->total << 8) + payload[8+i];
+        msg->offset = (msg->offset << 8) + payload[12+i];
+    }
+    msg->length = len-LARGE_CHUNK_HDRLEN;
+    if (msg->type != MAGPI_FORM) return 0;
+    if (msg->total > LARGE_MAX_LENGTH || msg->offset >= msg->total
+            || msg->length > msg->total - msg->offset) return 0;
+    msg->data = malloc(msg->length);
+    if (!msg->data) {
+        warn("%s", __func__);
+        return 0;
+    }
+    memcpy(msg->data, payload+LARGE_CHUNK_HDRLEN, msg->length);
+    return 1;
+}
+
+static int parse_team_alias(struct message_team_alias *msg, uint8_t *payload, unsigned int len) {
+    if (len != 6) return 0;
+    msg->alias = ((uint16_t) payload[0] << 8) | payload[1];
+    msg->base = payload[2];
+    for (int i=1; i<4; i++) {
+        msg->base = (msg->base << 8) + payload[2+i];
+    }
+    return 1;
+}
+
 message_t parse_message(uint8_t *buf, unsigned int len) {
     message_t msg;
     msg.info.type = MSG_TYPE_ERROR;
@@ -396,6 +517,8 @@ message_t parse_message(uint8_t *buf, unsigned int len) {
         case LOCATION: okay = parse_location(&msg.data.location, payload, payload_len); break;
         case CHAT: okay = parse_chat(&msg.data.chat, payload, payload_len); break;
         case MAGPI_FORM: okay = parse_magpi_form(&msg.data.magpi_form, payload, payload_len); break;
+        case TEAM_ALIAS: okay = parse_team_alias(&msg.data.team_alias, payload, payload_len); break;
+        case LARGE_CHUNK: okay = parse_large_chunk(&msg.data.large_chunk, payload, payload_len); break;
         default:
             warnx("%s: unknown message type (%d)", __func__, type);
             return msg;
@@ -434,6 +557,43 @@ message_t new_chat_message(member_pos sender, rel_epoch epoch, char *message) {
     return msg;
 }
 
+message_t new_team_alias_message(uint16_t alias, uint32_t base) {
+    message_t msg;
+    msg.info.type = TEAM_ALIAS;
+    msg.info.length = 6;
+    msg.data.team_alias.alias = alias;
+    msg.data.team_alias.base = base;
+    return msg;
+}
+
+message_t new_large_chunk_message(member_pos sender, rel_epoch epoch, enum msg_type type, uint16_t upload,
+                                  uint32_t total, uint32_t offset, const uint8_t *data, unsigned int len) {
+    message_t msg;
+    msg.info.type = MSG_TYPE_ERROR;
+    if (type != MAGPI_FORM || len == 0 || len > LARGE_CHUNK_MAXDATA || total > LARGE_MAX_LENGTH
+            || offset >= total || len > total - offset) {
+        warnx("%s: invalid chunk", __func__);
+        return msg;
+    }
+    uint8_t *copy = malloc(len);
+    if (!copy) {
+        warn("%s", __func__);
+        return msg;
+    }
+    memcpy(copy, data, len);
+    msg.info.type = LARGE_CHUNK;
+    msg.info.length = LARGE_CHUNK_HDRLEN+len;
+    msg.data.large_chunk.member = sender;
+    msg.data.large_chunk.time = epoch;
+    msg.data.large_chunk.type = type;
+    msg.data.large_chunk.upload = upload;
+    msg.data.large_chunk.total = total;
+    msg.data.large_chunk.offset = offset;
+    msg.data.large_chunk.length = len;
+    msg.data.large_chunk.data = copy;
+    return msg;
+}
+
 int write_message(FILE *out, message_t msg) {
     // check msg validity
     if (!out) return 0;
@@ -448,6 +608,18 @@ int write_message(FILE *out, message_t msg) {
                 return 0;
             }
             break;
+        case TEAM_ALIAS:
+            if (msg.info.length != 6) {
+                warnx("%s: team alias message has wrong length", __func__);
+                return 0;
+            }
+            break;
+        case LARGE_CHUNK:
+            if (msg.data.large_chunk.length+LARGE_CHUNK_HDRLEN != msg.info.length) {
+                warnx("%s: chunk length does not match data", __func__);
+                return 0;
+            }
+            break;
         default:
             warnx("%s: unimplemented for message type (%d)", __func__, msg.info.type);
             return 0;
@@ -476,6 +648,28 @@ int write_message(FILE *out, message_t msg) {
             buf[offset+4] = (msg.data.chat.time >>  0) & 0xff;
             memcpy(buf+offset+5, msg.data.chat.message, msg.info.length-5);
             break;
+        case TEAM_ALIAS:
+            buf[offset+0] = (msg.data.team_alias.alias >> 8) & 0xff;
+            buf[offset+1] = (msg.data.team_alias.alias >> 0) & 0xff;
+            buf[offset+2] = (msg.data.team_alias.base >> 24) & 0xff;
+            buf[offset+3] = (msg.data.team_alias.base >> 16) & 0xff;
+            buf[offset+4] = (msg.data.team_alias.base >>  8) & 0xff;
+            buf[offset+5] = (msg.data.team_alias.base >>  0) & 0xff;
+            break;
+        case LARGE_CHUNK: {
+            struct message_large_chunk *chunk = &msg.data.large_chunk;
+            buf[offset+0] = chunk->member;
+            for (int i=0; i<4; i++) {
+                buf[offset+1+i] = (chunk->time >> (24-8*i)) & 0xff;
+                buf[offset+8+i] = (chunk->total >> (24-8*i)) & 0xff;
+                buf[offset+12+i] = (chunk->offset >> (24-8*i)) & 0xff;
+            }
+            buf[offset+5] = chunk->type;
+            buf[offset+6] = (chunk->upload >> 8) & 0xff;
+            buf[offset+7] = (chunk->upload >> 0) & 0xff;
+            memcpy(buf+offset+LARGE_CHUNK_HDRLEN, chunk->data, chunk->length);
+            break;
+        }
         default:
             free(buf);
             return 0;
@@ -534,12 +728,16 @@ void free_message(message_t msg) {
         case MAGPI_FORM:
             free(msg.data.magpi_form.data);
             break;
+        case LARGE_CHUNK:
+            free(msg.data.large_chunk.data);
+            break;
+        case TEAM_ALIAS:
+            break;
         default:
             break;
     }
 }
 
-static const char utf8hex[16] = u8"0123456789abcdef";
 int message_to_json(const char *teamid, message_t msg, JsonNode *root){
     json_append_member(root, u8"team", json_mkstring(teamid));
 
@@ -590,20 +788,165 @@ int message_to_json(const char *teamid, message_t msg, JsonNode *root){
             json_append_member(root, u8"type", json_mkstring(u8"magpi-form"));
             json_append_member(root, u8"member", json_mknumber(msg.data.magpi_form.member));
             json_append_member(root, u8"reltime", json_mknumber(100.0*msg.data.magpi_form.time));
+            if (!msg.data.magpi_form.data) {
+                json_append_member(root, u8"length", json_mknumber(msg.data.magpi_form.length));
+                break;
+            }
             char *hexdata = malloc(2*msg.data.magpi_form.length+1);
             if (!hexdata) err(1, "malloc");
-            for (int i=0; i<msg.data.magpi_form.length; i++) {
-                uint8_t byte = msg.data.magpi_form.data[i];
-                hexdata[2*i+0] = utf8hex[byte >> 4];
-                hexdata[2*i+1] = utf8hex[byte & 0xf];
-            }
-            hexdata[2*msg.data.magpi_form.length] = '\0';
+            hex_encode(hexdata, msg.data.magpi_form.data, msg.data.magpi_form.length);
             json_append_member(root, u8"hexdata", json_mkstring(hexdata));
             free(hexdata);
             break;
+        case TEAM_ALIAS:
+            json_append_member(root, u8"type", json_mkstring(u8"alias"));
+            json_append_member(root, u8"alias", json_mknumber(msg.data.team_alias.alias));
+            json_append_member(root, u8"base", json_mknumber(msg.data.team_alias.base));
+            break;
+        case LARGE_CHUNK:
+            /* only reported once reassembled */
+            return 1;
         default:
             warnx("%s: unknown message type (%d)", __func__, msg.info.type);
             return 1;
     }
     return 0;
 }
+
+/* key and text value */
+static void cbor_put_member(cbor_buf *out, const char *key, const char *value) {
+    cbor_put_text(out, key);
+    cbor_put_text(out, value);
+}
+
+int message_to_cbor(const char *teamid, message_t msg, cbor_buf *out){
+    switch (msg.info.type) {
+        case TEAM_START:
+            cbor_put_map(out, 4);
+            cbor_put_member(out, u8"team", teamid);
+            cbor_put_member(out, u8"type", u8"start");
+            cbor_put_text(out, u8"time");
+            cbor_put_uint(out, msg.data.team_start.time);
+            cbor_put_member(out, u8"name", msg.data.team_start.name);
+            break;
+        case TEAM_END:
+            cbor_put_map(out, 3);
+            cbor_put_member(out, u8"team", teamid);
+            cbor_put_member(out, u8"type", u8"end");
+            cbor_put_text(out, u8"time");
+            cbor_put_uint(out, msg.data.team_end.time);
+            break;
+        case MEMBER_JOIN:
+            cbor_put_map(out, 6);
+            cbor_put_member(out, u8"team", teamid);
+            cbor_put_member(out, u8"type", u8"join");
+            cbor_put_text(out, u8"member");
+            cbor_put_uint(out, msg.data.member_join.member);
+            cbor_put_text(out, u8"reltime");
+            cbor_put_uint(out, 100ull*msg.data.member_join.time);
+            cbor_put_member(out, u8"name", msg.data.member_join.name);
+            cbor_put_member(out, u8"id", msg.data.member_join.id);
+            break;
+        case MEMBER_PART:
+            cbor_put_map(out, 4);
+            cbor_put_member(out, u8"team", teamid);
+            cbor_put_member(out, u8"type", u8"part");
+            cbor_put_text(out, u8"member");
+            cbor_put_uint(out, msg.data.member_part.member);
+            cbor_put_text(out, u8"reltime");
+            cbor_put_uint(out, 100ull*msg.data.member_part.time);
+            break;
+        case LOCATION:
+            cbor_put_map(out, 3);
+            cbor_put_member(out, u8"team", teamid);
+            cbor_put_member(out, u8"type", u8"location");
+            cbor_put_text(out, u8"locations");
+            cbor_put_array(out, msg.data.location.length);
+            for (int i=0; i < msg.data.location.length; i++) {
+                member_location location = msg.data.location.locations[i];
+                cbor_put_map(out, 5);
+                cbor_put_text(out, u8"member");
+                cbor_put_uint(out, location.member);
+                cbor_put_text(out, u8"reltime");
+                cbor_put_uint(out, 100ull*location.time);
+                cbor_put_text(out, u8"lat");
+                cbor_put_float(out, location.lat);
+                cbor_put_text(out, u8"lng");
+                cbor_put_float(out, location.lng);
+                cbor_put_text(out, u8"acc");
+                cbor_put_int(out, location.acc);
+            }
+            break;
+        case CHAT:
+            cbor_put_map(out, 5);
+            cbor_put_member(out, u8"team", teamid);
+            cbor_put_member(out, u8"type", u8"chat");
+            cbor_put_text(out, u8"member");
+            cbor_put_uint(out, msg.data.chat.member);
+            cbor_put_text(out, u8"reltime");
+            cbor_put_uint(out, 100ull*msg.data.chat.time);
+            cbor_put_member(out, u8"message", msg.data.chat.message);
+            break;
+        case MAGPI_FORM:
+            cbor_put_map(out, 5);
+            cbor_put_member(out, u8"team", teamid);
+            cbor_put_member(out, u8"type", u8"magpi-form");
+            cbor_put_text(out, u8"member");
+            cbor_put_uint(out, msg.data.magpi_form.member);
+            cbor_put_text(out, u8"reltime");
+            cbor_put_uint(out, 100ull*msg.data.magpi_form.time);
+            if (!msg.data.magpi_form.data) {
+                cbor_put_text(out, u8"length");
+                cbor_put_uint(out, msg.data.magpi_form.length);
+                break;
+            }
+            cbor_put_text(out, u8"data");
+            cbor_put_bytes(out, msg.data.magpi_form.data, msg.data.magpi_form.length);
+            break;
+        case TEAM_ALIAS:
+            cbor_put_map(out, 4);
+            cbor_put_member(out, u8"team", teamid);
+            cbor_put_member(out, u8"type", u8"alias");
+            cbor_put_text(out, u8"alias");
+            cbor_put_uint(out, msg.data.team_alias.alias);
+            cbor_put_text(out, u8"base");
+            cbor_put_uint(out, msg.data.team_alias.base);
+            break;
+        case LARGE_CHUNK:
+            return 1;
+        default:
+            warnx("%s: unknown message type (%d)", __func__, msg.info.type);
+            return 1;
+    }
+    return out->error ? -1 : 0;
+}
+
+int large_message_to_json(const char *teamid, const struct message_large_chunk *chunk, JsonNode *root){
+    if (chunk->type != MAGPI_FORM) {
+        warnx("%s: unknown message type (%d)", __func__, chunk->type);
+        return 1;
+    }
+    json_append_member(root, u8"team", json_mkstring(teamid));
+    json_append_member(root, u8"type", json_mkstring(u8"magpi-form"));
+    json_append_member(root, u8"member", json_mknumber(chunk->member));
+    json_append_member(root, u8"reltime", json_mknumber(100.0*chunk->time));
+    json_append_member(root, u8"length", json_mknumber(chunk->total));
+    return 0;
+}
+
+int large_message_to_cbor(const char *teamid, const struct message_large_chunk *chunk, cbor_buf *out){
+    if (chunk->type != MAGPI_FORM) {
+        warnx("%s: unknown message type (%d)", __func__, chunk->type);
+        return 1;
+    }
+    cbor_put_map(out, 5);
+    cbor_put_member(out, u8"team", teamid);
+    cbor_put_member(out, u8"type", u8"magpi-form");
+    cbor_put_text(out, u8"member");
+    cbor_put_uint(out, chunk->member);
+    cbor_put_text(out, u8"reltime");
+    cbor_put_uint(out, 100ull*chunk->time);
+    cbor_put_text(out, u8"length");
+    cbor_put_uint(out, chunk->total);
+    return out->error ? -1 : 0;
+}
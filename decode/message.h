@@ -10,6 +10,13 @@
 
 #define REL_EPOCH_MAX UINT32_MAX
 
+/* large messages are sent as chunks of up to LARGE_CHUNK_MAXDATA bytes, each carrying
+ * | member (1) | time (4) | type (1) | upload (2) | total length (4) | offset (4) | data |
+ * where upload is chosen by the sender to tell apart messages sent by a member at once */
+#define LARGE_CHUNK_HDRLEN 16
+#define LARGE_CHUNK_MAXDATA (MSG_MAX_PAYLOAD - LARGE_CHUNK_HDRLEN)
+#define LARGE_MAX_LENGTH (16*1024*1024)
+
 enum msg_type {
     TEAM_START = 0,
     TEAM_END = 1,
@@ -18,6 +25,8 @@ enum msg_type {
     LOCATION = 4,
     CHAT = 5,
     MAGPI_FORM = 6,
+    TEAM_ALIAS = 7,
+    LARGE_CHUNK = 8,
     MSG_TYPE_MAX = 255,
     MSG_TYPE_ERROR = -1
 };
@@ -78,6 +87,24 @@ struct message_magpi_form {
     uint8_t *data;
 };
 
+struct message_team_alias {
+    uint16_t alias;
+    uint32_t base;
+};
+
+/* part of a message of type (only MAGPI_FORM so far) too long for a single message,
+ * identified by member, time and type */
+struct message_large_chunk {
+    member_pos member;
+    rel_epoch time;
+    enum msg_type type;
+    uint16_t upload;
+    uint32_t total;
+    uint32_t offset;
+    unsigned int length;
+    uint8_t *data;
+};
+
 typedef struct message {
     msg_info info;
     union {
@@ -88,6 +115,8 @@ typedef struct message {
         struct message_location    location;
         struct message_chat        chat;
         struct message_magpi_form  magpi_form;
+        struct message_team_alias  team_alias;
+        struct message_large_chunk large_chunk;
     } data;
 } message_t;
 
@@ -103,22 +132,66 @@ long fragment_file_offset_nth_message(FILE *fragment, int n);
 /* returns size of message including header, or 0 if error */
 long fragments_extract_message(uint32_t seq, int n, uint8_t *buf, int *span);
 
+/* as above, looking for fragments in each of the NULL-terminated dirs in turn (current directory if NULL) */
+long fragments_extract_message_in(const char * const *dirs, uint32_t seq, int n, uint8_t *buf, int *span);
+
+/* as above, looking in each of the open directories dirfds (terminated by -1) in turn */
+long fragments_extract_message_at(const int *dirfds, uint32_t seq, int n, uint8_t *buf, int *span);
+
+/* opens fragment seqstr for reading, NULL if there is no such fragment */
+typedef FILE *(*fragment_open_fn)(void *arg, const char *seqstr);
+
+/* as above, getting each fragment from open (for example, from fragments already in memory) */
+long fragments_extract_message_with(fragment_open_fn open, void *openarg, uint32_t seq, int n, uint8_t *buf, int *span);
+
+/* called with each piece of a message after its header: len bytes at off in fragment,
+ * which are bytes pos onwards of the message, returns 0 to give up */
+typedef int (*message_piece_fn)(void *arg, FILE *fragment, long off, long pos, long len);
+
+/* as fragments_extract_message_in, but only reading the header (MSG_HDRLEN bytes) and
+ * passing where the rest of the message lies to fn (if not NULL) */
+long fragments_walk_message_in(const char * const *dirs, uint32_t seq, int n, uint8_t *header,
+                               message_piece_fn fn, void *arg, int *span);
+
+/* as fragments_walk_message_in, looking in open directories as fragments_extract_message_at */
+long fragments_walk_message_at(const int *dirfds, uint32_t seq, int n, uint8_t *header,
+                               message_piece_fn fn, void *arg, int *span);
+
 /* (result).info.type negative on error */
 message_t parse_message(uint8_t *buf, unsigned int len);
 
 /* (result).info.type negative on error */
 message_t new_chat_message(member_pos sender, rel_epoch epoch, char *message);
 
+/* (result).info.type negative on error */
+message_t new_team_alias_message(uint16_t alias, uint32_t base);
+
+/* (result).info.type negative on error, data is copied */
+message_t new_large_chunk_message(member_pos sender, rel_epoch epoch, enum msg_type type, uint16_t upload,
+                                  uint32_t total, uint32_t offset, const uint8_t *data, unsigned int len);
+
 /* returns full length of message written, or 0 if error */
 int write_message(FILE *out, message_t msg);
 
 /* returns full length of message written, or 0 if error */
 int write_message_raw(FILE *out, enum msg_type type, uint8_t *buf, unsigned int len);
 
-/* convert message contents to json */
+/* convert message contents to json, magpi forms without data (left in the fragments) only give their length */
 typedef struct JsonNode JsonNode;
 int message_to_json(const char *teamid, message_t msg, JsonNode *root);
 
+/* describe the reassembled message the final chunk completes, without its contents */
+int large_message_to_json(const char *teamid, const struct message_large_chunk *chunk, JsonNode *root);
+
+/* append message contents to out as a CBOR map with the same members as the json,
+ * except magpi forms as raw bytes (data) and coordinates as single precision floats,
+ * 0 on success */
+typedef struct cbor_buf cbor_buf;
+int message_to_cbor(const char *teamid, message_t msg, cbor_buf *out);
+
+/* as large_message_to_json, in CBOR */
+int large_message_to_cbor(const char *teamid, const struct message_large_chunk *chunk, cbor_buf *out);
+
 /* free any memory associated with msg */
 void free_message(message_t msg);
 
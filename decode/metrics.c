@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "message.h"
+#include "metrics.h"
+
+/* upper bounds of histogram buckets are 1us * 4^i, up to about 3 days */
+#define METRICS_BUCKETS 20
+/* message types with their own parse histogram, others share the last */
+#define METRICS_TYPES (LARGE_CHUNK+2)
+/* stages of a message's latency: waiting for its last fragment, decoding it, and both */
+#define METRICS_STAGES 3
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t buckets[METRICS_BUCKETS+1]; /* the last for anything slower */
+} histogram;
+
+/* layout of the shared file, which any change must keep or make a different size */
+typedef struct {
+    uint64_t counters[METRIC_COUNTERS];
+    histogram histograms[METRIC_HISTOGRAMS];
+    histogram parse[METRICS_TYPES];
+    histogram received[METRIC_CHANNELS];
+    histogram latency[METRIC_CHANNELS][METRICS_STAGES];
+} metrics_data;
+
+static metrics_data *shared;
+static char *trace_path;
+
+static const struct {
+    const char *name;
+    const char *labels;
+    const char *help;
+} counter_info[METRIC_COUNTERS] = {
+    {"succinct_fragments_total", "status=\"placed\"", "Fragments received for placement, by outcome."},
+    {"succinct_fragments_total", "status=\"duplicate\"", NULL},
+    {"succinct_fragments_total", "status=\"mismatch\"", NULL},
+    {"succinct_fragments_total", "status=\"error\"", NULL},
+    {"succinct_messages_incomplete_total", "", "Messages not yet extractable, waiting for more fragments."},
+    {"succinct_messages_malformed_total", "", "Messages extracted but not parseable."},
+    {"succinct_output_files_total", "", "Output files committed."},
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+} histogram_info[METRIC_HISTOGRAMS] = {
+    {"succinct_placement_seconds", "Time to place a fragment into its team directory."},
+    {"succinct_header_parse_seconds", "Time to read a fragment header during placement."},
+    {"succinct_reassembly_wait_seconds", "Time from a message's first fragment being placed to its extraction."},
+    {"succinct_json_encode_seconds", "Time to encode a message as JSON or CBOR."},
+    {"succinct_output_commit_seconds", "Time to sync and link a group of output files."},
+};
+
+static const char *type_names[METRICS_TYPES] = {
+    "team_start", "team_end", "member_join", "member_part", "location",
+    "chat", "magpi_form", "team_alias", "large_chunk", "other"
+};
+
+static const char *channel_names[METRIC_CHANNELS] = {"rock7", "textmagic", "api", "other"};
+
+static const char *stage_names[METRICS_STAGES] = {"reassembly", "decode", "total"};
+
+/* open path, and if this makes it, give it METRICS_MODE, -1 on error */
+static int open_shared(const char *path, int flags) {
+    int fd = open(path, flags|O_CREAT|O_EXCL, METRICS_MODE);
+    if (fd < 0 && errno == EEXIST) return open(path, flags);
+    if (fd >= 0 && fchmod(fd, METRICS_MODE) != 0) warn("%s: chmod", path);
+    return fd;
+}
+
+int metrics_open(const char *spool) {
+    if (!spool) spool = ".";
+    char dir[strlen(spool)+1+strlen(METRICS_DIR)+1];
+    sprintf(dir, "%s/%s", spool, METRICS_DIR);
+    struct stat st;
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) return 0;
+    char path[strlen(spool)+1+strlen(METRICS_FILE)+1];
+    sprintf(path, "%s/%s", spool, METRICS_FILE);
+    return metrics_open_file(path);
+}
+
+int metrics_open_file(const char *path) {
+    if (shared) return 1;
+    int fd = open_shared(path, O_RDWR);
+    if (fd < 0) {
+        warn("%s", path);
+        return 0;
+    }
+    /* new files start zeroed, however many processes create one at once */
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (st.st_size == 0 && ftruncate(fd, sizeof(metrics_data)) != 0)) {
+        warn("%s", path);
+        close(fd);
+        return 0;
+    }
+    if (st.st_size != 0 && st.st_size != sizeof(metrics_data)) {
+        warnx("%s: written by a different version, remove it to start again", path);
+        close(fd);
+        return 0;
+    }
+    void *map = mmap(NULL, sizeof(metrics_data), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        warn("%s: mmap", path);
+        return 0;
+    }
+    shared = map;
+    trace_path = malloc(strlen(path)+strlen(METRICS_TRACE_SUFFIX)+1);
+    if (trace_path) sprintf(trace_path, "%s%s", path, METRICS_TRACE_SUFFIX);
+    return 1;
+}
+
+int metrics_enabled(void) {
+    return shared != NULL;
+}
+
+double metrics_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void metrics_count(enum metric_counter c, long n) {
+    if (!shared) return;
+    __atomic_fetch_add(&shared->counters[c], n, __ATOMIC_RELAXED);
+}
+
+static void observe(histogram *h, double seconds) {
+    if (seconds < 0) seconds = 0;
+    int i = 0;
+    for (double bound = 1e-6; i < METRICS_BUCKETS && seconds > bound; bound *= 4) i++;
+    __atomic_fetch_add(&h->buckets[i], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_ns, (uint64_t) (seconds * 1e9), __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+void metrics_observe(enum metric_histogram h, double seconds) {
+    if (!shared) return;
+    observe(&shared->histograms[h], seconds);
+}
+
+void metrics_parsed(int type, double seconds) {
+    if (!shared) return;
+    if (type < 0 || type >= METRICS_TYPES) type = METRICS_TYPES-1;
+    observe(&shared->parse[type], seconds);
+}
+
+enum metric_channel metrics_channel(const char *name) {
+    for (int i=0; i<METRIC_CHANNELS-1; i++) {
+        if (strcmp(name, channel_names[i]) == 0) return i;
+    }
+    return METRIC_CHANNEL_OTHER;
+}
+
+void metrics_received(enum metric_channel channel, double seconds) {
+    if (!shared) return;
+    observe(&shared->received[channel], seconds);
+}
+
+void metrics_traced(const char *team, const char *seqstr, int n, enum metric_channel channel,
+                    double first, double last, double decoded) {
+    if (!shared) return;
+    observe(&shared->latency[channel][0], last - first);
+    observe(&shared->latency[channel][1], decoded - last);
+    observe(&shared->latency[channel][2], decoded - first);
+    if (!trace_path) return;
+
+    /* one write, so lines from processes tracing at once are never mixed */
+    char line[256];
+    int len = snprintf(line, sizeof(line),
+                       "{\"team\":\"%s\",\"seq\":\"%s\",\"msg\":%d,\"channel\":\"%s\","
+                       "\"first\":%.6f,\"last\":%.6f,\"decoded\":%.6f}\n",
+                       team, seqstr, n, channel_names[channel], first, last, decoded);
+    if (len <= 0 || len >= sizeof(line)) return;
+    int fd = open_shared(trace_path, O_WRONLY|O_APPEND);
+    if (fd < 0 || write(fd, line, len) != len) warn("%s", trace_path);
+    if (fd < 0) return;
+
+    /* rotated by whoever fills it, unless another process already has */
+    struct stat st, current;
+    if (fstat(fd, &st) == 0 && st.st_size >= METRICS_TRACE_MAX
+            && stat(trace_path, &current) == 0 && current.st_ino == st.st_ino) {
+        char old[strlen(trace_path)+strlen(".1")+1];
+        sprintf(old, "%s.1", trace_path);
+        if (rename(trace_path, old) != 0) warn("%s: rename", trace_path);
+    }
+    close(fd);
+}
+
+static void write_histogram(FILE *out, const char *name, const char *labels, const histogram *h) {
+    const char *sep = labels[0] ? "," : "";
+    uint64_t cumulative = 0;
+    double bound = 1e-6;
+    for (int i=0; i<METRICS_BUCKETS; i++, bound *= 4) {
+        cumulative += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        fprintf(out, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, sep, bound, (unsigned long long) cumulative);
+    }
+    cumulative += __atomic_load_n(&h->buckets[METRICS_BUCKETS], __ATOMIC_RELAXED);
+    fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep, (unsigned long long) cumulative);
+    fprintf(out, "%s_sum%s%s%s %.9f\n", name, labels[0] ? "{" : "", labels, labels[0] ? "}" : "",
+            __atomic_load_n(&h->sum_ns, __ATOMIC_RELAXED) / 1e9);
+    fprintf(out, "%s_count%s%s%s %llu\n", name, labels[0] ? "{" : "", labels, labels[0] ? "}" : "",
+            (unsigned long long) cumulative);
+}
+
+int metrics_write(FILE *out) {
+    if (!shared) return 0;
+    for (int i=0; i<METRIC_COUNTERS; i++) {
+        if (counter_info[i].help) {
+            fprintf(out, "# HELP %s %s\n", counter_info[i].name, counter_info[i].help);
+            fprintf(out, "# TYPE %s counter\n", counter_info[i].name);
+        }
+        const char *labels = counter_info[i].labels;
+        fprintf(out, "%s%s%s%s %llu\n", counter_info[i].name, labels[0] ? "{" : "", labels, labels[0] ? "}" : "",
+                (unsigned long long) __atomic_load_n(&shared->counters[i], __ATOMIC_RELAXED));
+    }
+    for (int i=0; i<METRIC_HISTOGRAMS; i++) {
+        fprintf(out, "# HELP %s %s\n", histogram_info[i].name, histogram_info[i].help);
+        fprintf(out, "# TYPE %s histogram\n", histogram_info[i].name);
+        write_histogram(out, histogram_info[i].name, "", &shared->histograms[i]);
+    }
+    fprintf(out, "# HELP succinct_parse_message_seconds Time to parse a decoded message, by type.\n");
+    fprintf(out, "# TYPE succinct_parse_message_seconds histogram\n");
+    for (int i=0; i<METRICS_TYPES; i++) {
+        char labels[32];
+        snprintf(labels, sizeof(labels), "type=\"%s\"", type_names[i]);
+        write_histogram(out, "succinct_parse_message_seconds", labels, &shared->parse[i]);
+    }
+    fprintf(out, "# HELP succinct_fragment_received_seconds Time from a fragment arriving to it being placed, by channel.\n");
+    fprintf(out, "# TYPE succinct_fragment_received_seconds histogram\n");
+    for (int i=0; i<METRIC_CHANNELS; i++) {
+        char labels[32];
+        snprintf(labels, sizeof(labels), "channel=\"%s\"", channel_names[i]);
+        write_histogram(out, "succinct_fragment_received_seconds", labels, &shared->received[i]);
+    }
+    fprintf(out, "# HELP succinct_message_latency_seconds Time from a message's first fragment arriving until its last"
+            " (reassembly), from its last until it was decoded (decode), and in all (total), by channel of its last fragment.\n");
+    fprintf(out, "# TYPE succinct_message_latency_seconds histogram\n");
+    for (int i=0; i<METRIC_CHANNELS; i++) {
+        for (int j=0; j<METRICS_STAGES; j++) {
+            char labels[48];
+            snprintf(labels, sizeof(labels), "channel=\"%s\",stage=\"%s\"", channel_names[i], stage_names[j]);
+            write_histogram(out, "succinct_message_latency_seconds", labels, &shared->latency[i][j]);
+        }
+    }
+    return !ferror(out);
+}
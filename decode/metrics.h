@@ -0,0 +1,87 @@
+#ifndef METRICS_H
+#define METRICS_H
+#include <stdio.h>
+
+/* Counters and latency histograms shared by every decode process using the same spool,
+ * kept in <spool>/metrics/decode (mapped into each process and updated atomically) once
+ * <spool>/metrics exists. Until metrics_open succeeds, updates do nothing.
+ * Files there are made group writable whatever the umask, as processes run as different
+ * users (the web server's for process_fragment, succinct for place_fragment): the directory
+ * should belong to a group all of them are in, and be setgid so its files do too. */
+#define METRICS_DIR "metrics"
+#define METRICS_FILE METRICS_DIR "/decode"
+#define METRICS_MODE 0664
+/* each message's trace is appended to the metrics file's path with this added, which once
+ * it reaches METRICS_TRACE_MAX bytes is renamed with ".1" added (replacing the last one) */
+#define METRICS_TRACE_SUFFIX ".trace"
+#define METRICS_TRACE_MAX (16*1024*1024)
+
+/* extended attribute placement gives each fragment, naming the channel it arrived over,
+ * whose modification time is set to when it was received */
+#define METRICS_CHANNEL_XATTR "user.succinct.channel"
+
+enum metric_counter {
+    METRIC_FRAGMENTS_PLACED,
+    METRIC_FRAGMENTS_DUPLICATE,
+    METRIC_FRAGMENTS_MISMATCH,
+    METRIC_FRAGMENTS_REJECTED,
+    METRIC_MESSAGES_INCOMPLETE,
+    METRIC_MESSAGES_MALFORMED,
+    METRIC_OUTPUT_FILES,
+    METRIC_COUNTERS
+};
+
+enum metric_histogram {
+    METRIC_PLACEMENT,       /* placing a fragment, from opening it to moving it into place */
+    METRIC_HEADER_PARSE,    /* reading a fragment's header during placement */
+    METRIC_REASSEMBLY_WAIT, /* from a message's first fragment being placed to it being extracted */
+    METRIC_JSON_ENCODE,     /* converting a message to JSON or CBOR */
+    METRIC_OUTPUT_COMMIT,   /* syncing and linking a group of output files */
+    METRIC_HISTOGRAMS
+};
+
+/* channels fragments are received over, each with its own latency histograms */
+enum metric_channel {
+    METRIC_CHANNEL_ROCK7,
+    METRIC_CHANNEL_TEXTMAGIC,
+    METRIC_CHANNEL_API,
+    METRIC_CHANNEL_OTHER,
+    METRIC_CHANNELS
+};
+
+/* use metrics in spool (the current directory if NULL), 1 if enabled there, 0 if not
+ * or on error */
+int metrics_open(const char *spool);
+
+/* use the metrics file at path, creating it if needed, 0 on error */
+int metrics_open_file(const char *path);
+
+/* 1 if metrics are open */
+int metrics_enabled(void);
+
+/* monotonic time in seconds, for measuring durations */
+double metrics_now(void);
+
+void metrics_count(enum metric_counter c, long n);
+
+void metrics_observe(enum metric_histogram h, double seconds);
+
+/* time taken to parse a message of type (as parse_message), counted as decoded */
+void metrics_parsed(int type, double seconds);
+
+/* channel named name (as given to placement), METRIC_CHANNEL_OTHER if not known */
+enum metric_channel metrics_channel(const char *name);
+
+/* time from a fragment arriving over channel until it was placed */
+void metrics_received(enum metric_channel channel, double seconds);
+
+/* message n starting in fragment seqstr of team, decoded at decoded having been held
+ * in fragments received first at first and last at last (the last over channel), all
+ * seconds since the epoch. Appended to the trace log as well as counted */
+void metrics_traced(const char *team, const char *seqstr, int n, enum metric_channel channel,
+                    double first, double last, double decoded);
+
+/* write every metric in the Prometheus text format, 0 if metrics are not open */
+int metrics_write(FILE *out);
+
+#endif /* !METRICS_H */
@@ -0,0 +1,354 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "msgindex.h"
+
+/* record layout, big endian like the message formats:
+ * | seq (4) | msgnum (4) | type (1) | flags (1) | member (1) | unused (1) | reltime (4) |
+ * | offset (8) | length (4) | unused (4) | */
+
+/* block summary layout, one for each MSGINDEX_BLOCK records in turn:
+ * | records summarised (4) | earliest reltime (4) | latest reltime (4) | unused (4) | */
+#define BLOCK_SUMMARYLEN 16
+
+typedef struct {
+    uint32_t count;
+    rel_epoch earliest, latest; /* latest < earliest if none have a reltime */
+} block_summary;
+
+static const char *type_names[] = {
+    "start", "end", "join", "part", "location", "chat", "magpi-form", "alias", "large-chunk"
+};
+#define NUM_TYPE_NAMES (sizeof(type_names)/sizeof(type_names[0]))
+
+static void put_be(uint8_t *buf, uint64_t value, int len) {
+    for (int i=len-1; i>=0; i--) {
+        buf[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+static uint64_t get_be(const uint8_t *buf, int len) {
+    uint64_t value = 0;
+    for (int i=0; i<len; i++) value = (value << 8) | buf[i];
+    return value;
+}
+
+static void pack_entry(uint8_t *rec, const msgindex_entry *e) {
+    memset(rec, 0, MSGINDEX_RECLEN);
+    put_be(rec, e->seq, 4);
+    put_be(rec+4, e->msgnum, 4);
+    rec[8] = e->type;
+    rec[9] = e->flags;
+    rec[10] = e->member;
+    put_be(rec+12, e->reltime, 4);
+    put_be(rec+16, e->offset, 8);
+    put_be(rec+24, e->length, 4);
+}
+
+static void unpack_entry(msgindex_entry *e, const uint8_t *rec) {
+    e->seq = get_be(rec, 4);
+    e->msgnum = get_be(rec+4, 4);
+    e->type = rec[8];
+    e->flags = rec[9];
+    e->member = rec[10];
+    e->reltime = get_be(rec+12, 4);
+    e->offset = get_be(rec+16, 8);
+    e->length = get_be(rec+24, 4);
+}
+
+static void pack_summary(uint8_t *rec, const block_summary *b) {
+    memset(rec, 0, BLOCK_SUMMARYLEN);
+    put_be(rec, b->count, 4);
+    put_be(rec+4, b->earliest, 4);
+    put_be(rec+8, b->latest, 4);
+}
+
+static void unpack_summary(block_summary *b, const uint8_t *rec) {
+    b->count = get_be(rec, 4);
+    b->earliest = get_be(rec+4, 4);
+    b->latest = get_be(rec+8, 4);
+}
+
+/* add e, record number recno of the index, to the summary of its block. not synced, as a
+ * summary left behind its block (by a crash) is never brought up to date again, and so the
+ * block is always read */
+static void summarise(const char *teamdir, long recno, const msgindex_entry *e) {
+    char path[strlen(teamdir)+1+strlen(MSGINDEX_BLOCKS)+1];
+    sprintf(path, "%s/%s", teamdir, MSGINDEX_BLOCKS);
+    int fd = open(path, O_RDWR|O_CREAT, 0666);
+    if (fd < 0) {
+        warn("%s", path);
+        return;
+    }
+    off_t off = recno / MSGINDEX_BLOCK * BLOCK_SUMMARYLEN;
+    uint8_t rec[BLOCK_SUMMARYLEN];
+    block_summary b = {.count = 0, .earliest = REL_EPOCH_MAX, .latest = 0};
+    if (recno % MSGINDEX_BLOCK != 0) {
+        if (pread(fd, rec, sizeof(rec), off) == sizeof(rec)) unpack_summary(&b, rec);
+        if (b.count != recno % MSGINDEX_BLOCK) {
+            close(fd);
+            return;
+        }
+    }
+    b.count++;
+    if (e->flags & MSGINDEX_RELTIME) {
+        if (e->reltime < b.earliest) b.earliest = e->reltime;
+        if (e->reltime > b.latest) b.latest = e->reltime;
+    }
+    pack_summary(rec, &b);
+    if (pwrite(fd, rec, sizeof(rec), off) != sizeof(rec)) warn("%s", path);
+    close(fd);
+}
+
+static void set_member(msgindex_entry *e, member_pos member, rel_epoch time) {
+    e->flags = MSGINDEX_MEMBER|MSGINDEX_RELTIME;
+    e->member = member;
+    e->reltime = time;
+}
+
+void msgindex_describe(msgindex_entry *e, const message_t *msg) {
+    e->type = msg->info.type;
+    e->flags = 0;
+    e->member = 0;
+    e->reltime = 0;
+    switch (msg->info.type) {
+        case MEMBER_JOIN:
+            set_member(e, msg->data.member_join.member, msg->data.member_join.time);
+            break;
+        case MEMBER_PART:
+            set_member(e, msg->data.member_part.member, msg->data.member_part.time);
+            break;
+        case CHAT:
+            set_member(e, msg->data.chat.member, msg->data.chat.time);
+            break;
+        case MAGPI_FORM:
+            set_member(e, msg->data.magpi_form.member, msg->data.magpi_form.time);
+            break;
+        case LARGE_CHUNK:
+            set_member(e, msg->data.large_chunk.member, msg->data.large_chunk.time);
+            break;
+        case LOCATION:
+            /* fixes of several members are indexed by time alone */
+            for (unsigned int i=0; i<msg->data.location.length; i++) {
+                const member_location *l = &msg->data.location.locations[i];
+                if (i == 0) {
+                    set_member(e, l->member, l->time);
+                    continue;
+                }
+                if (l->member != e->member) e->flags &= ~MSGINDEX_MEMBER;
+                if (l->time < e->reltime) e->reltime = l->time;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/* copy len bytes from the start of infd to outfd at off */
+static int copy_message(int infd, int outfd, off_t off, size_t len) {
+    off_t inoff = 0;
+    while (len > 0) {
+        ssize_t n = copy_file_range(infd, &inoff, outfd, &off, len, 0);
+        if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) break;
+        if (n <= 0) return 0;
+        len -= n;
+    }
+    uint8_t buf[8192];
+    while (len > 0) {
+        ssize_t n = pread(infd, buf, len < sizeof(buf) ? len : sizeof(buf), inoff);
+        if (n <= 0 || pwrite(outfd, buf, n, off) != n) return 0;
+        inoff += n;
+        off += n;
+        len -= n;
+    }
+    return 1;
+}
+
+int msgindex_append(const char *teamdir, msgindex_entry *e, int fd) {
+    char path[strlen(teamdir)+1+strlen(MSGINDEX_FILE)+1];
+    sprintf(path, "%s/%s", teamdir, MSGINDEX_FILE);
+    char storepath[strlen(teamdir)+1+strlen(MSGINDEX_STORE)+1];
+    sprintf(storepath, "%s/%s", teamdir, MSGINDEX_STORE);
+
+    int index = open(path, O_RDWR|O_APPEND|O_CREAT, 0666);
+    if (index < 0) {
+        warn("%s", path);
+        return 0;
+    }
+    int store = -1;
+    int okay = 0;
+    /* messages of a team may be decoded by more than one process at once */
+    if (flock(index, LOCK_EX) != 0) {
+        warn("%s: flock", path);
+        goto append_done;
+    }
+
+    struct stat st, msgst;
+    store = open(storepath, O_RDWR|O_CREAT, 0666);
+    if (store < 0 || fstat(store, &st) != 0) {
+        warn("%s", storepath);
+        goto append_done;
+    }
+    if (fstat(fd, &msgst) != 0) {
+        warn("%s: fstat", __func__);
+        goto append_done;
+    }
+    /* anything after the last message indexed was left by a crash, and is skipped over */
+    e->offset = st.st_size;
+    e->length = msgst.st_size;
+    if (!copy_message(fd, store, e->offset, e->length) || fdatasync(store) != 0) {
+        warn("%s", storepath);
+        goto append_done;
+    }
+
+    /* as is a record cut short */
+    if (fstat(index, &st) != 0 || (st.st_size % MSGINDEX_RECLEN != 0
+            && ftruncate(index, st.st_size - st.st_size % MSGINDEX_RECLEN) != 0)) {
+        warn("%s", path);
+        goto append_done;
+    }
+    uint8_t rec[MSGINDEX_RECLEN];
+    pack_entry(rec, e);
+    if (write(index, rec, sizeof(rec)) != sizeof(rec) || fdatasync(index) != 0) {
+        warn("%s", path);
+        goto append_done;
+    }
+    summarise(teamdir, st.st_size / MSGINDEX_RECLEN, e);
+    okay = 1;
+
+append_done:
+    if (store >= 0) close(store);
+    close(index);
+    return okay;
+}
+
+/* summaries of whole blocks of the index of teamdir, as a malloc'd array in *blocks,
+ * number read (0 if there are none) */
+static long read_summaries(const char *teamdir, block_summary **blocks) {
+    *blocks = NULL;
+    char path[strlen(teamdir)+1+strlen(MSGINDEX_BLOCKS)+1];
+    sprintf(path, "%s/%s", teamdir, MSGINDEX_BLOCKS);
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        if (errno != ENOENT) warn("%s", path);
+        return 0;
+    }
+    long n = 0, size = 0;
+    uint8_t rec[BLOCK_SUMMARYLEN];
+    while (fread(rec, 1, sizeof(rec), fp) == sizeof(rec)) {
+        if (n == size) {
+            size = size ? 2*size : 64;
+            block_summary *more = realloc(*blocks, size * sizeof(block_summary));
+            /* without them every block is read */
+            if (!more) break;
+            *blocks = more;
+        }
+        unpack_summary(&(*blocks)[n++], rec);
+    }
+    fclose(fp);
+    return n;
+}
+
+/* entries of the index of teamdir, if timed leaving out whole blocks summarised as having
+ * no reltimes from after to before */
+static long read_index(const char *teamdir, int timed, rel_epoch after, rel_epoch before,
+                       msgindex_entry **entries) {
+    *entries = NULL;
+    char path[strlen(teamdir)+1+strlen(MSGINDEX_FILE)+1];
+    sprintf(path, "%s/%s", teamdir, MSGINDEX_FILE);
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        if (errno == ENOENT) return 0;
+        warn("%s", path);
+        return -1;
+    }
+
+    block_summary *blocks = NULL;
+    long nblocks = timed ? read_summaries(teamdir, &blocks) : 0;
+
+    long n = 0, size = 0;
+    long recno = 0;
+    uint8_t rec[MSGINDEX_RECLEN];
+    /* a record cut short is one still being appended */
+    while (1) {
+        long block = recno / MSGINDEX_BLOCK;
+        if (recno % MSGINDEX_BLOCK == 0 && block < nblocks && blocks[block].count == MSGINDEX_BLOCK
+                && (blocks[block].latest < after || blocks[block].earliest > before
+                    || blocks[block].latest < blocks[block].earliest)) {
+            if (fseek(fp, (long) MSGINDEX_BLOCK * MSGINDEX_RECLEN, SEEK_CUR) != 0) break;
+            recno += MSGINDEX_BLOCK;
+            continue;
+        }
+        if (fread(rec, 1, sizeof(rec), fp) != sizeof(rec)) break;
+        recno++;
+        if (n == size) {
+            size = size ? 2*size : 1024;
+            msgindex_entry *more = realloc(*entries, size * sizeof(msgindex_entry));
+            if (!more) {
+                warn("%s: could not allocate memory", __func__);
+                n = -1;
+                break;
+            }
+            *entries = more;
+        }
+        unpack_entry(&(*entries)[n++], rec);
+    }
+    if (n >= 0 && ferror(fp)) {
+        warn("%s", path);
+        n = -1;
+    }
+    fclose(fp);
+    free(blocks);
+    if (n < 0) {
+        free(*entries);
+        *entries = NULL;
+    }
+    return n;
+}
+
+long msgindex_read(const char *teamdir, msgindex_entry **entries) {
+    return read_index(teamdir, 0, 0, REL_EPOCH_MAX, entries);
+}
+
+long msgindex_read_between(const char *teamdir, rel_epoch after, rel_epoch before,
+                           msgindex_entry **entries) {
+    return read_index(teamdir, 1, after, before, entries);
+}
+
+int msgindex_open_store(const char *teamdir) {
+    char path[strlen(teamdir)+1+strlen(MSGINDEX_STORE)+1];
+    sprintf(path, "%s/%s", teamdir, MSGINDEX_STORE);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) warn("%s", path);
+    return fd;
+}
+
+int msgindex_load(int store, const msgindex_entry *e, uint8_t *buf) {
+    if (pread(store, buf, e->length, e->offset) != e->length) {
+        warnx("message %010u.%u: could not read from store", e->seq, e->msgnum);
+        return 0;
+    }
+    return 1;
+}
+
+const char *msgindex_type_name(int type) {
+    return (type >= 0 && type < NUM_TYPE_NAMES) ? type_names[type] : NULL;
+}
+
+int msgindex_type(const char *name) {
+    for (int i=0; i<NUM_TYPE_NAMES; i++) {
+        if (strcmp(name, type_names[i]) == 0) return i;
+    }
+    char *end;
+    long type = strtol(name, &end, 10);
+    if (name[0] == '\0' || *end != '\0' || type < 0 || type > MSG_TYPE_MAX) return -1;
+    return type;
+}
@@ -0,0 +1,63 @@
+#ifndef MSGINDEX_H
+#define MSGINDEX_H
+#include <stdint.h>
+#include "message.h"
+
+/* Each team's decoded messages are packed one after another in <team>/messages/store,
+ * and indexed by fixed size records appended to <team>/messages/index as they are decoded.
+ * A message indexed more than once (when decoding it was retried) is described by the
+ * last record for its seq and msgnum. The store is never compacted, so earlier copies of
+ * such messages (and anything left by a crash while appending) stay in it: it only grows
+ * by retries, and readers can use any offset indexed without locking.
+ * <team>/messages/index.blocks summarises each MSGINDEX_BLOCK records of the index with
+ * their earliest and latest reltime, so those outside a query's times need not be read. */
+#define MSGINDEX_FILE "messages/index"
+#define MSGINDEX_STORE "messages/store"
+#define MSGINDEX_BLOCKS "messages/index.blocks"
+#define MSGINDEX_RECLEN 32
+#define MSGINDEX_BLOCK 256
+
+/* flags of an entry */
+#define MSGINDEX_MEMBER 1   /* member is set */
+#define MSGINDEX_RELTIME 2  /* reltime is set */
+
+typedef struct {
+    uint32_t seq;
+    uint32_t msgnum;
+    uint8_t type;
+    uint8_t flags;
+    member_pos member;
+    rel_epoch reltime;  /* earliest, for messages holding several */
+    uint64_t offset;    /* of the message in the store */
+    uint32_t length;
+} msgindex_entry;
+
+/* set type, member and reltime of e from msg, the latter two only if msg has just one */
+void msgindex_describe(msgindex_entry *e, const message_t *msg);
+
+/* copy the message in file fd to the store of teamdir and index it as e (setting its offset
+ * and length), both durable before returning. 0 on error */
+int msgindex_append(const char *teamdir, msgindex_entry *e, int fd);
+
+/* every entry indexed for teamdir in the order appended, as a malloc'd array in *entries,
+ * number read (0 if nothing indexed yet) or negative on error */
+long msgindex_read(const char *teamdir, msgindex_entry **entries);
+
+/* as msgindex_read, but leaving out blocks of entries that all have reltimes outside after
+ * to before (or none), so some of those returned may be outside it too */
+long msgindex_read_between(const char *teamdir, rel_epoch after, rel_epoch before,
+                           msgindex_entry **entries);
+
+/* open the store of teamdir to read messages from, -1 on error */
+int msgindex_open_store(const char *teamdir);
+
+/* read the message of e from store into buf (of at least e->length bytes), 0 on error */
+int msgindex_load(int store, const msgindex_entry *e, uint8_t *buf);
+
+/* name of message type as in its JSON, NULL if not known */
+const char *msgindex_type_name(int type);
+
+/* type named name (as msgindex_type_name, or a number), negative if not known */
+int msgindex_type(const char *name);
+
+#endif /* !MSGINDEX_H */
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "message.h"
+#include "msgindex.h"
+#include "ccan/json/json.h"
+
+typedef struct {
+    msgindex_entry e;
+    long pos; /* in the index, later records replacing earlier ones */
+} indexed;
+
+static int compare_indexed(const void *a, const void *b) {
+    const indexed *x = a, *y = b;
+    if (x->e.seq != y->e.seq) return (x->e.seq > y->e.seq) - (x->e.seq < y->e.seq);
+    if (x->e.msgnum != y->e.msgnum) return (x->e.msgnum > y->e.msgnum) - (x->e.msgnum < y->e.msgnum);
+    return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+/* parse reltime as in JSON (100 per unit of rel_epoch) */
+static rel_epoch parse_reltime(const char *arg) {
+    char *end;
+    double t = strtod(arg, &end);
+    if (arg[0] == '\0' || *end != '\0' || t < 0 || t/100 > REL_EPOCH_MAX) errx(2, "%s: invalid reltime", arg);
+    return t/100;
+}
+
+/* print e as JSON, the whole message read from store if store is not negative */
+static int print_message(const char *teamid, const msgindex_entry *e, int store) {
+    JsonNode *root = json_mkobject();
+    json_append_member(root, "seq", json_mknumber(e->seq));
+    json_append_member(root, "msg", json_mknumber(e->msgnum));
+    int okay = 1;
+    uint8_t *buf = NULL;
+    if (store >= 0 && e->type != LARGE_CHUNK) {
+        buf = malloc(e->length ? e->length : 1);
+        if (!buf) err(1, "malloc");
+        message_t msg;
+        okay = msgindex_load(store, e, buf);
+        if (okay) {
+            msg = parse_message(buf, e->length);
+            okay = (msg.info.type != MSG_TYPE_ERROR && message_to_json(teamid, msg, root) == 0);
+            if (msg.info.type != MSG_TYPE_ERROR) free_message(msg);
+        }
+        if (!okay) warnx("message %010u.%u: could not decode", e->seq, e->msgnum);
+    } else {
+        const char *name = msgindex_type_name(e->type);
+        json_append_member(root, "type", name ? json_mkstring(name) : json_mknumber(e->type));
+        if (e->flags & MSGINDEX_MEMBER) json_append_member(root, "member", json_mknumber(e->member));
+        if (e->flags & MSGINDEX_RELTIME) json_append_member(root, "reltime", json_mknumber(100.0*e->reltime));
+        json_append_member(root, "length", json_mknumber(e->length));
+    }
+    if (okay) {
+        char *json = json_encode(root);
+        puts(json);
+        free(json);
+    }
+    free(buf);
+    json_delete(root);
+    return okay;
+}
+
+int main(int argc, char *argv[]) {
+    int types[MSG_TYPE_MAX+1] = {0};
+    int anytype = 1;
+    int member = -1;
+    rel_epoch after = 0, before = REL_EPOCH_MAX;
+    int timed = 0;
+    int whole = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "a:b:jm:t:")) != -1) {
+        switch (opt) {
+            case 'a':
+                after = parse_reltime(optarg);
+                timed = 1;
+                break;
+            case 'b':
+                before = parse_reltime(optarg);
+                timed = 1;
+                break;
+            case 'j':
+                whole = 1;
+                break;
+            case 'm':
+                member = atoi(optarg);
+                if (member < 0 || member > UINT8_MAX) errx(2, "%s: invalid member", optarg);
+                break;
+            case 't': {
+                int type = msgindex_type(optarg);
+                if (type < 0) errx(2, "%s: unknown message type", optarg);
+                types[type] = 1;
+                anytype = 0;
+                break;
+            }
+            default:
+                argc = 0;
+        }
+    }
+    if (argc - optind != 1) {
+        fprintf(stderr, "Usage: msgquery [-t type]... [-m member] [-a reltime] [-b reltime] [-j] teamdir\n");
+        fprintf(stderr, "Lists messages decoded for the team in teamdir (of the types given, from member, and\n");
+        fprintf(stderr, "from reltime after up to before), or with -j the messages themselves as JSON\n");
+        return 2;
+    }
+    char *teamdir = argv[optind];
+
+    /* the team id is the name of its directory */
+    size_t end = strlen(teamdir);
+    while (end > 1 && teamdir[end-1] == '/') end--;
+    size_t start = end;
+    while (start > 0 && teamdir[start-1] != '/') start--;
+    char teamid[end-start+1];
+    memcpy(teamid, teamdir+start, end-start);
+    teamid[end-start] = '\0';
+
+    msgindex_entry *entries;
+    long nentries = timed ? msgindex_read_between(teamdir, after, before, &entries) : msgindex_read(teamdir, &entries);
+    if (nentries < 0) errx(1, "%s: could not read index", teamdir);
+    /* only those wanted are sorted, every record of a message describes it the same way */
+    indexed *sorted = malloc((nentries ? nentries : 1) * sizeof(indexed));
+    if (!sorted) err(1, "malloc");
+    long n = 0;
+    for (long i=0; i<nentries; i++) {
+        const msgindex_entry *e = &entries[i];
+        if (!anytype && !types[e->type]) continue;
+        if (member >= 0 && (!(e->flags & MSGINDEX_MEMBER) || e->member != member)) continue;
+        if (timed && (!(e->flags & MSGINDEX_RELTIME) || e->reltime < after || e->reltime > before)) continue;
+        sorted[n].e = *e;
+        sorted[n].pos = i;
+        n++;
+    }
+    free(entries);
+    qsort(sorted, n, sizeof(indexed), compare_indexed);
+
+    int store = -1;
+    if (whole && n > 0 && (store = msgindex_open_store(teamdir)) < 0) return 1;
+
+    int status = 0;
+    for (long i=0; i<n; i++) {
+        const msgindex_entry *e = &sorted[i].e;
+        if (i+1 < n && sorted[i+1].e.seq == e->seq && sorted[i+1].e.msgnum == e->msgnum) continue;
+        if (!print_message(teamid, e, store)) status = 1;
+    }
+    if (store >= 0) close(store);
+    free(sorted);
+    return (fflush(stdout) == 0) ? status : 1;
+}
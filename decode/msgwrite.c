@@ -11,6 +11,8 @@ static uint8_t msgbuf[MSG_MAX_PAYLOAD+1];
 void print_usage(void);
 int write_chat_msg(char *member, char *epoch, char *msg);
 int write_raw_msg(char *type, char *filename);
+int write_alias_msg(char *alias, char *base);
+int write_large_msg(char *type, char *member, char *epoch, char *upload, char *filename, char *dir);
 
 int main(int argc, char *argv[]) {
     if (argc < 2) print_usage();
@@ -22,9 +24,15 @@ int main(int argc, char *argv[]) {
     } else if (strcmp(type, "chat") == 0) {
         if (argc != 5) print_usage();
         return write_chat_msg(argv[2], argv[3], argv[4]);
+    } else if (strcmp(type, "alias") == 0) {
+        if (argc != 4) print_usage();
+        return write_alias_msg(argv[2], argv[3]);
     } else if (strcmp(type, "raw") == 0) {
         if (argc != 4) print_usage();
         return write_raw_msg(argv[2], argv[3]);
+    } else if (strcmp(type, "large") == 0) {
+        if (argc != 8) print_usage();
+        return write_large_msg(argv[2], argv[3], argv[4], argv[5], argv[6], argv[7]);
     } else {
         errx(1, "%s: unknown type", type);
     }
@@ -38,7 +46,9 @@ void print_usage(void) {
                     "  msgwrite part member_pos epoch_ms\n"
                     "  msgwrite locations [member_pos epoch_ms lat lng acc]+\n"
                     "  msgwrite chat member_pos epoch_ms msg\n"
-                    "  msgwrite raw type datafile\n");
+                    "  msgwrite alias alias_hex base_seq\n"
+                    "  msgwrite raw type datafile\n"
+                    "  msgwrite large type member_pos epoch_ms upload datafile outdir\n");
     exit(2);
 }
 
@@ -106,3 +116,79 @@ int write_raw_msg(char *type, char *filename) {
 
     return 0;
 }
+
+int write_alias_msg(char *alias_s, char *base_s) {
+    char *endptr;
+
+    if (*alias_s == '\0') {
+        errx(1, "empty alias");
+    }
+    long int alias = strtol(alias_s, &endptr, 16);
+    if (*endptr != '\0' || alias < 0 || alias > UINT16_MAX) {
+        errx(1, "invalid alias");
+    }
+
+    if (*base_s == '\0') {
+        errx(1, "empty base sequence number");
+    }
+    long long int base = strtoll(base_s, &endptr, 10);
+    if (*endptr != '\0' || base < 0 || base > UINT32_MAX) {
+        errx(1, "invalid base sequence number");
+    }
+
+    message_t msg = new_team_alias_message(alias, base);
+    if (!write_message(stdout, msg)) {
+        errx(1, "could not write alias message");
+    }
+
+    return 0;
+}
+
+/* writes each chunk as a separate message file in dir, numbered from 00000 */
+int write_large_msg(char *type, char *member, char *epoch_s, char *upload_s, char *filename, char *dir) {
+    char *endptr;
+    long int t = strtol(type, &endptr, 10);
+    if (*type == '\0' || *endptr != '\0' || t != MAGPI_FORM) {
+        errx(1, "invalid type, only magpi forms (%d) can be sent as large messages", MAGPI_FORM);
+    }
+    long int sender = strtol(member, &endptr, 10);
+    if (*member == '\0' || *endptr != '\0' || sender < 0 || sender > 255) {
+        errx(1, "invalid sender number");
+    }
+    long long int epoch = strtoll(epoch_s, &endptr, 10)/100;
+    if (*epoch_s == '\0' || *endptr != '\0' || epoch < 0 || epoch > REL_EPOCH_MAX) {
+        errx(1, "invalid epoch or out of range");
+    }
+    long int upload = strtol(upload_s, &endptr, 10);
+    if (*upload_s == '\0' || *endptr != '\0' || upload < 0 || upload > UINT16_MAX) {
+        errx(1, "invalid upload number");
+    }
+
+    FILE *datafile = fopen(filename, "r");
+    if (!datafile) err(1, "%s", filename);
+    if (fseek(datafile, 0, SEEK_END) != 0) err(1, "%s", filename);
+    long total = ftell(datafile);
+    if (total <= 0) errx(1, "%s: message has zero length", filename);
+    if (total > LARGE_MAX_LENGTH) errx(1, "%s: message too long", filename);
+    rewind(datafile);
+
+    int n = 0;
+    for (long offset = 0; offset < total; offset += LARGE_CHUNK_MAXDATA, n++) {
+        size_t len = fread(msgbuf, 1, LARGE_CHUNK_MAXDATA, datafile);
+        if (len == 0) errx(1, "%s: could not read chunk at %ld", filename, offset);
+
+        message_t msg = new_large_chunk_message(sender, epoch, t, upload, total, offset, msgbuf, len);
+        if (msg.info.type < 0) errx(1, "could not construct chunk at %ld", offset);
+
+        char path[strlen(dir)+8];
+        sprintf(path, "%s/%05d", dir, n);
+        FILE *out = fopen(path, "w");
+        if (!out) err(1, "%s", path);
+        if (!write_message(out, msg) || fclose(out) != 0) errx(1, "could not write %s", path);
+        free_message(msg);
+    }
+    fclose(datafile);
+
+    printf("%d\n", n);
+    return 0;
+}
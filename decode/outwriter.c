@@ -0,0 +1,532 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "decode.h"
+#include "outwriter.h"
+#include "uring.h"
+#include "metrics.h"
+
+/* fewer files than this are synced one at a time rather than syncing the whole filesystem */
+#define SYNCFS_MIN_FILES 4
+
+/* size of the ring for batched commits, each file takes at most two entries per step */
+#define URING_ENTRIES 64
+
+typedef struct outfile {
+    char *path;
+    char *tmp;  /* NULL while an anonymous O_TMPFILE */
+    FILE *fp;
+    int fd;   /* kept open after fclose until synced */
+    int done; /* finished writing, waiting for commit */
+    char *data; /* written to memory when committing through a ring */
+    size_t size;
+    struct outfile *next;
+} outfile;
+
+struct outwriter {
+    long interval_ms;
+    int max_pending;
+    pthread_mutex_t lock;
+    outfile *files;
+    int pending;
+    struct timespec oldest;
+    long commits;
+    long completed; /* every commit up to this one has finished */
+    int active; /* commits taken but still syncing, outside the lock */
+    pthread_cond_t idle; /* signalled as each commit finishes */
+    outwriter_commit_fn on_commit;
+    void *on_commit_arg;
+    uring *ring; /* NULL unless committing in batches */
+    pthread_mutex_t ring_lock; /* held while the ring is in use */
+    int have_proc; /* anonymous files can be linked by their /proc name */
+};
+
+static long ms_since(const struct timespec *t) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+static void free_outfile(outfile *f) {
+    free(f->path);
+    free(f->tmp);
+    free(f->data);
+    free(f);
+}
+
+/* hidden name for path in the same directory, so the final rename is atomic, NULL on error */
+static char *tmp_name(const char *path) {
+    char *copy = strdup(path);
+    if (!copy) return NULL;
+    char *slash = strrchr(copy, '/');
+    const char *base = slash ? slash+1 : copy;
+    if (slash) *slash = '\0';
+    char *tmp;
+    if (asprintf(&tmp, "%s%s.%s.tmp", slash ? copy : "", slash ? "/" : "", base) < 0) tmp = NULL;
+    free(copy);
+    return tmp;
+}
+
+outwriter *outwriter_new(long interval_ms, int max_pending) {
+    if (interval_ms < 0 || max_pending < 1) return NULL;
+    outwriter *w = calloc(1, sizeof(outwriter));
+    if (!w) {
+        warn("%s: could not allocate memory", __func__);
+        return NULL;
+    }
+    w->interval_ms = interval_ms;
+    w->max_pending = max_pending;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->idle, NULL);
+    pthread_mutex_init(&w->ring_lock, NULL);
+    return w;
+}
+
+FILE *outwriter_open(outwriter *w, const char *path) {
+    outfile *f = calloc(1, sizeof(outfile));
+    if (!f) {
+        warn("%s: could not allocate memory", __func__);
+        return NULL;
+    }
+    f->fd = -1;
+    f->path = strdup(path);
+    if (!f->path) {
+        warn("%s: could not allocate memory", __func__);
+        free_outfile(f);
+        return NULL;
+    }
+
+    /* only written out when committed, all at once */
+    if (w->ring) {
+        f->fp = open_memstream(&f->data, &f->size);
+        if (!f->fp) {
+            warn("%s", path);
+            free_outfile(f);
+            return NULL;
+        }
+        pthread_mutex_lock(&w->lock);
+        f->next = w->files;
+        w->files = f;
+        pthread_mutex_unlock(&w->lock);
+        return f->fp;
+    }
+
+    /* nothing to clean up after a crash, and no name until committed */
+    char *copy = strdup(path);
+    int fd = copy ? open_tmpfile(AT_FDCWD, dirname(copy)) : -1;
+    free(copy);
+    if (fd >= 0) {
+        f->fp = fdopen(fd, "w");
+        if (!f->fp) {
+            warn("%s", path);
+            close(fd);
+            free_outfile(f);
+            return NULL;
+        }
+    } else {
+        f->tmp = tmp_name(path);
+        if (!f->tmp) {
+            warn("%s: could not allocate memory", __func__);
+            free_outfile(f);
+            return NULL;
+        }
+        f->fp = fopen(f->tmp, "w+");
+        if (!f->fp) {
+            warn("%s", f->tmp);
+            free_outfile(f);
+            return NULL;
+        }
+    }
+
+    pthread_mutex_lock(&w->lock);
+    f->next = w->files;
+    w->files = f;
+    pthread_mutex_unlock(&w->lock);
+    return f->fp;
+}
+
+/* add the directory of path to dirs, unless already there */
+static void add_dir(char **dirs, int *ndirs, char *path) {
+    char *dir = dirname(path);
+    for (int i=0; i<*ndirs; i++) {
+        if (strcmp(dirs[i], dir) == 0) return;
+    }
+    if ((dirs[*ndirs] = strdup(dir))) (*ndirs)++;
+}
+
+/* sync and free each of dirs, 0 on error */
+static int sync_dirs(char **dirs, int ndirs) {
+    int okay = 1;
+    for (int i=0; i<ndirs; i++) {
+        int fd = open(dirs[i], O_RDONLY|O_DIRECTORY);
+        if (fd < 0 || fsync(fd) != 0) {
+            warn("%s: fsync", dirs[i]);
+            okay = 0;
+        }
+        if (fd >= 0) close(fd);
+        free(dirs[i]);
+    }
+    return okay;
+}
+
+/* steps of a batched commit, in the low bits of each operation's tag */
+enum { STEP_OPEN, STEP_WRITE, STEP_SYNC, STEP_MOVE, STEP_CLOSE };
+#define STEP_BITS 3
+
+typedef struct {
+    outfile *f;
+    char *dir;
+    char proc[32];
+    int fd;
+    int error; /* errno from the first step to fail */
+    int moved; /* linked or renamed into place */
+} batch_file;
+
+static void batch_step_done(void *arg, uint64_t tag, int res) {
+    batch_file *b = (batch_file *) arg + (tag >> STEP_BITS);
+    int step = tag & ((1 << STEP_BITS) - 1);
+    if (step == STEP_OPEN && res >= 0) {
+        b->fd = res;
+    } else if (step == STEP_WRITE && res >= 0 && res != b->f->size) {
+        /* short, and the sync linked to it has been cancelled */
+        b->error = EIO;
+    } else if (step == STEP_CLOSE) {
+        b->fd = -1;
+    } else if (step == STEP_MOVE && res >= 0) {
+        b->moved = 1;
+    } else if (res < 0 && !b->error) {
+        b->error = -res;
+    }
+}
+
+static uint64_t step_tag(int i, int step) {
+    return ((uint64_t) i << STEP_BITS) | step;
+}
+
+/* write, sync and link nfiles (at most URING_ENTRIES/2) finished files into place through the
+ * ring, each step submitted for all the files at once, adding their directories to dirs,
+ * 0 if any could not be committed */
+static int commit_batch(outwriter *w, outfile **files, int nfiles, char **dirs, int *ndirs) {
+    int ran = 0;
+    batch_file batch[nfiles];
+    for (int i=0; i<nfiles; i++) {
+        batch[i] = (batch_file) {.f = files[i], .fd = -1};
+        char *copy = w->have_proc ? strdup(files[i]->path) : NULL;
+        if (copy) batch[i].dir = strdup(dirname(copy));
+        free(copy);
+        if (batch[i].dir) {
+            uring_openat(w->ring, AT_FDCWD, batch[i].dir, O_TMPFILE|O_RDWR, 0666, step_tag(i, STEP_OPEN));
+        }
+    }
+    if (!uring_run(w->ring, batch_step_done, batch)) goto batch_done;
+
+    /* a temporary name where the filesystem has no anonymous files */
+    for (int i=0; i<nfiles; i++) {
+        outfile *f = batch[i].f;
+        if (batch[i].fd >= 0) continue;
+        batch[i].error = 0;
+        f->tmp = tmp_name(f->path);
+        if (!f->tmp) {
+            batch[i].error = ENOMEM;
+            continue;
+        }
+        uring_openat(w->ring, AT_FDCWD, f->tmp, O_WRONLY|O_CREAT|O_TRUNC, 0666, step_tag(i, STEP_OPEN));
+    }
+    if (uring_queued(w->ring) && !uring_run(w->ring, batch_step_done, batch)) goto batch_done;
+
+    for (int i=0; i<nfiles; i++) {
+        outfile *f = batch[i].f;
+        if (batch[i].fd < 0) continue;
+        uring_write(w->ring, batch[i].fd, f->data, f->size, 0, 1, step_tag(i, STEP_WRITE));
+        uring_fdatasync(w->ring, batch[i].fd, 0, step_tag(i, STEP_SYNC));
+    }
+    if (!uring_run(w->ring, batch_step_done, batch)) goto batch_done;
+
+    for (int i=0; i<nfiles; i++) {
+        outfile *f = batch[i].f;
+        if (batch[i].fd < 0 || batch[i].error) continue;
+        if (f->tmp) {
+            uring_renameat(w->ring, AT_FDCWD, f->tmp, AT_FDCWD, f->path, 0, step_tag(i, STEP_MOVE));
+        } else {
+            snprintf(batch[i].proc, sizeof(batch[i].proc), "/proc/self/fd/%d", batch[i].fd);
+            uring_linkat(w->ring, AT_FDCWD, batch[i].proc, AT_FDCWD, f->path, AT_SYMLINK_FOLLOW, 0,
+                         step_tag(i, STEP_MOVE));
+        }
+    }
+    if (!uring_run(w->ring, batch_step_done, batch)) goto batch_done;
+
+    /* closed only once linked, as it is linked by its descriptor (a close linked after the
+     * link is not reliably cancelled when the link fails) */
+    for (int i=0; i<nfiles; i++) {
+        outfile *f = batch[i].f;
+        /* replacing an existing file is left to link_tmpfile */
+        if (batch[i].error == EEXIST && !f->tmp && batch[i].fd >= 0) {
+            batch[i].moved = link_tmpfile(batch[i].fd, AT_FDCWD, f->path);
+            batch[i].error = batch[i].moved ? 0 : errno;
+        }
+        if (batch[i].fd >= 0) uring_close(w->ring, batch[i].fd, step_tag(i, STEP_CLOSE));
+    }
+    if (uring_run(w->ring, batch_step_done, batch)) ran = 1;
+
+batch_done:
+    /* nothing of the batch can be released while the kernel may still be using it */
+    if (!ran && !uring_drain(w->ring, batch_step_done, batch)) {
+        warnx("%s: could not wait for batched commit, leaving its files open", __func__);
+        return 0;
+    }
+    int okay = ran;
+    for (int i=0; i<nfiles; i++) {
+        outfile *f = batch[i].f;
+        if (batch[i].fd >= 0) close(batch[i].fd);
+        if (batch[i].moved && !batch[i].error) {
+            add_dir(dirs, ndirs, f->path);
+        } else {
+            if (batch[i].error) {
+                errno = batch[i].error;
+                warn("%s", f->path);
+            }
+            if (f->tmp && !batch[i].moved) unlink(f->tmp);
+            okay = 0;
+        }
+        free(batch[i].dir);
+    }
+    return okay;
+}
+
+/* commit the list of n files through the ring, freeing them */
+static int commit_batched(outwriter *w, outfile *list, int n) {
+    int okay = 1;
+    char *dirs[n];
+    int ndirs = 0;
+    outfile *files[URING_ENTRIES/2];
+    int nfiles = 0;
+
+    /* one commit at a time uses the ring */
+    pthread_mutex_lock(&w->ring_lock);
+    while (list) {
+        outfile *f = list;
+        list = f->next;
+        files[nfiles++] = f;
+        if (nfiles == URING_ENTRIES/2 || !list) {
+            if (!commit_batch(w, files, nfiles, dirs, &ndirs)) okay = 0;
+            for (int i=0; i<nfiles; i++) free_outfile(files[i]);
+            nfiles = 0;
+        }
+    }
+    pthread_mutex_unlock(&w->ring_lock);
+    if (!sync_dirs(dirs, ndirs)) okay = 0;
+    return okay;
+}
+
+/* commit the list of n files one at a time, freeing them */
+static int commit_files(outwriter *w, outfile *list, int n) {
+    int okay = 1;
+    int same_fs = 1;
+    dev_t dev = 0;
+    outfile *first = NULL;
+    for (outfile *f = list; f; f = f->next) {
+        struct stat st;
+        if (fstat(f->fd, &st) != 0) {
+            same_fs = 0;
+            continue;
+        }
+        if (!first) {
+            first = f;
+            dev = st.st_dev;
+        } else if (st.st_dev != dev) {
+            same_fs = 0;
+        }
+    }
+
+    /* one durability point for the whole group */
+    int synced = 0;
+    if (same_fs && first && n >= SYNCFS_MIN_FILES) {
+        synced = (syncfs(first->fd) == 0);
+        if (!synced) warn("%s: syncfs", first->path);
+    }
+
+    /* directories to sync once the renames are done */
+    char *dirs[n];
+    int ndirs = 0;
+
+    while (list) {
+        outfile *f = list;
+        list = f->next;
+
+        int ok = synced || fdatasync(f->fd) == 0;
+        if (!ok) warn("%s: fdatasync", f->path);
+        if (ok && (f->tmp ? rename(f->tmp, f->path) != 0 : !link_tmpfile(f->fd, AT_FDCWD, f->path))) {
+            warn("%s: move", f->path);
+            ok = 0;
+        }
+        close(f->fd);
+        if (!ok) {
+            if (f->tmp) unlink(f->tmp);
+            okay = 0;
+        } else {
+            add_dir(dirs, &ndirs, f->path);
+        }
+        free_outfile(f);
+    }
+    if (!sync_dirs(dirs, ndirs)) okay = 0;
+    return okay;
+}
+
+/* take the finished files off w->files to be committed, in order, as commit number *commit,
+ * NULL if none; caller holds lock, and then calls commit_taken without it */
+static outfile *take_pending_locked(outwriter *w, int *n, long *commit) {
+    *n = w->pending;
+    if (w->pending == 0) return NULL;
+    outfile *taken = NULL;
+    outfile **tail = &taken;
+    outfile **prev = &w->files;
+    while (*prev) {
+        outfile *f = *prev;
+        if (!f->done) {
+            prev = &f->next;
+            continue;
+        }
+        *prev = f->next;
+        f->next = NULL;
+        *tail = f;
+        tail = &f->next;
+    }
+    w->pending = 0;
+    *commit = ++w->commits;
+    w->active++;
+    return taken;
+}
+
+/* sync and link files taken by take_pending_locked, without holding the lock so that
+ * other threads carry on writing meanwhile */
+static int commit_taken(outwriter *w, outfile *files, int n, long commit) {
+    double start = metrics_now();
+    int okay = w->ring ? commit_batched(w, files, n) : commit_files(w, files, n);
+    metrics_observe(METRIC_OUTPUT_COMMIT, metrics_now() - start);
+    metrics_count(METRIC_OUTPUT_FILES, n);
+
+    /* finished in the order taken, so on_commit hears of them in order */
+    pthread_mutex_lock(&w->lock);
+    while (w->completed != commit-1) pthread_cond_wait(&w->idle, &w->lock);
+    pthread_mutex_unlock(&w->lock);
+    if (w->on_commit) w->on_commit(w->on_commit_arg, commit, okay);
+
+    pthread_mutex_lock(&w->lock);
+    w->completed = commit;
+    w->active--;
+    pthread_cond_broadcast(&w->idle);
+    pthread_mutex_unlock(&w->lock);
+    return okay;
+}
+
+int outwriter_close(outwriter *w, FILE *fp) {
+    pthread_mutex_lock(&w->lock);
+    outfile **prev = &w->files;
+    while (*prev && (*prev)->fp != fp) prev = &(*prev)->next;
+    outfile *f = *prev;
+    if (f) f->fp = NULL;
+    pthread_mutex_unlock(&w->lock);
+    if (!f) {
+        warnx("%s: not an output file", __func__);
+        return 0;
+    }
+
+    /* keep a descriptor to sync later, fclose reports any write errors */
+    int written;
+    if (w->ring) {
+        written = (fclose(fp) == 0);
+        if (!written) warn("%s", f->path);
+    } else {
+        f->fd = dup(fileno(fp));
+        written = (fflush(fp) == 0 && !ferror(fp));
+        if (fclose(fp) != 0) written = 0;
+        if (!written || f->fd < 0) warn("%s", f->path);
+    }
+
+    pthread_mutex_lock(&w->lock);
+    if (!written || (!w->ring && f->fd < 0)) {
+        for (prev = &w->files; *prev != f; prev = &(*prev)->next);
+        *prev = f->next;
+        pthread_mutex_unlock(&w->lock);
+        if (f->fd >= 0) close(f->fd);
+        if (f->tmp) unlink(f->tmp);
+        free_outfile(f);
+        return 0;
+    }
+    f->done = 1;
+    if (w->pending++ == 0) clock_gettime(CLOCK_MONOTONIC, &w->oldest);
+    outfile *taken = NULL;
+    int n = 0;
+    long commit;
+    if (w->pending >= w->max_pending || ms_since(&w->oldest) >= w->interval_ms) {
+        taken = take_pending_locked(w, &n, &commit);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return taken ? commit_taken(w, taken, n, commit) : 1;
+}
+
+int outwriter_commit(outwriter *w) {
+    pthread_mutex_lock(&w->lock);
+    int n;
+    long commit;
+    outfile *taken = take_pending_locked(w, &n, &commit);
+    pthread_mutex_unlock(&w->lock);
+    int okay = taken ? commit_taken(w, taken, n, commit) : 1;
+
+    /* files taken by other threads are committed too before returning */
+    pthread_mutex_lock(&w->lock);
+    while (w->active > 0) pthread_cond_wait(&w->idle, &w->lock);
+    pthread_mutex_unlock(&w->lock);
+    return okay;
+}
+
+long outwriter_commits(outwriter *w) {
+    pthread_mutex_lock(&w->lock);
+    long commits = w->commits;
+    pthread_mutex_unlock(&w->lock);
+    return commits;
+}
+
+void outwriter_on_commit(outwriter *w, outwriter_commit_fn fn, void *arg) {
+    pthread_mutex_lock(&w->lock);
+    w->on_commit = fn;
+    w->on_commit_arg = arg;
+    pthread_mutex_unlock(&w->lock);
+}
+
+int outwriter_use_uring(outwriter *w) {
+    pthread_mutex_lock(&w->lock);
+    if (!w->ring && !w->files) {
+        w->ring = uring_new(URING_ENTRIES);
+        w->have_proc = (access("/proc/self/fd", X_OK) == 0);
+    }
+    int using = (w->ring != NULL);
+    pthread_mutex_unlock(&w->lock);
+    return using;
+}
+
+int outwriter_free(outwriter *w) {
+    int okay = outwriter_commit(w);
+    while (w->files) {
+        outfile *f = w->files;
+        w->files = f->next;
+        fclose(f->fp);
+        if (f->tmp) unlink(f->tmp);
+        free_outfile(f);
+    }
+    uring_free(w->ring);
+    pthread_mutex_destroy(&w->ring_lock);
+    pthread_cond_destroy(&w->idle);
+    pthread_mutex_destroy(&w->lock);
+    free(w);
+    return okay;
+}
@@ -0,0 +1,46 @@
+#ifndef OUTWRITER_H
+#define OUTWRITER_H
+#include <stdio.h>
+
+/* default maximum number of finished files waiting for a commit */
+#define OUTWRITER_MAX_PENDING 256
+
+/* output files made durable in groups: each file is written as an anonymous O_TMPFILE
+ * (or under a temporary name where that is not supported), then a whole group is synced
+ * at once and only then linked into place */
+typedef struct outwriter outwriter;
+
+/* commit whenever the oldest finished file has waited interval_ms (0 to commit every file),
+ * or max_pending files are waiting, NULL on error */
+outwriter *outwriter_new(long interval_ms, int max_pending);
+
+/* stream for writing path, which does not appear until committed, NULL on error. Unless
+ * using io_uring, what has been flushed so far can be read back through its fd */
+FILE *outwriter_open(outwriter *w, const char *path);
+
+/* finish writing fp, committing if due, 0 on error (in which case the file is discarded) */
+int outwriter_close(outwriter *w, FILE *fp);
+
+/* sync all finished files and link them into place, 0 if any could not be committed */
+int outwriter_commit(outwriter *w);
+
+/* number of commits that synced at least one file, files finished before it returns n are
+ * all in commits up to n+1 */
+long outwriter_commits(outwriter *w);
+
+/* called after each commit with its number (as counted by outwriter_commits) and whether
+ * all its files were committed, in order, from whichever thread committed */
+typedef void (*outwriter_commit_fn)(void *arg, long commit, int ok);
+
+/* call fn after every commit from now on, set before any files are opened */
+void outwriter_on_commit(outwriter *w, outwriter_commit_fn fn, void *arg);
+
+/* from now on, keep files in memory until committed, then write, sync and link them in
+ * batches submitted through io_uring, 1 if so or 0 if io_uring is not available
+ * (or files are already open) and files are written as before */
+int outwriter_use_uring(outwriter *w);
+
+/* commit any finished files and free w, discarding files still open, 0 on error */
+int outwriter_free(outwriter *w);
+
+#endif /* !OUTWRITER_H */
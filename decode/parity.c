@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fragment.h"
+#include "parity.h"
+
+int seq_is_parity(int64_t seq) {
+    return seq >= 0 && seq <= UINT32_MAX && (seq & PARITY_SEQ_FLAG);
+}
+
+/* read whole fragment into memory, NULL on error, should be free'd after use */
+static uint8_t *read_fragment(FILE *fragment, long *len) {
+    if (fseek(fragment, 0, SEEK_END) != 0) {
+        warn("%s: could not seek in file", __func__);
+        return NULL;
+    }
+    *len = ftell(fragment);
+    if (*len <= FRAGHDRLEN) {
+        warnx("%s: fragment too short", __func__);
+        return NULL;
+    }
+    if (*len - FRAGHDRLEN > UINT16_MAX) {
+        warnx("%s: fragment too long", __func__);
+        return NULL;
+    }
+    uint8_t *buf = malloc(*len);
+    if (!buf) {
+        warn("%s: could not allocate memory", __func__);
+        return NULL;
+    }
+    if (fseek(fragment, 0, SEEK_SET) != 0 || fread(buf, 1, *len, fragment) != *len) {
+        warnx("%s: could not read fragment", __func__);
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+static uint32_t header_seq(const uint8_t *buf) {
+    return ((uint32_t) buf[TEAMLEN] << 24) | ((uint32_t) buf[TEAMLEN+1] << 16)
+         | ((uint32_t) buf[TEAMLEN+2] << 8) | buf[TEAMLEN+3];
+}
+
+static void xor_block(uint8_t *block, const uint8_t *fragment, long len) {
+    long body = len - FRAGHDRLEN;
+    block[0] ^= fragment[TEAMLEN + SEQLEN];
+    block[1] ^= body >> 8;
+    block[2] ^= body & 0xff;
+    for (long i=0; i<body; i++) {
+        block[PARITY_OVERHEAD+i] ^= fragment[FRAGHDRLEN+i];
+    }
+}
+
+int parity_write(FILE *out, FILE *fragments[], int k) {
+    if (!out || k <= 0 || k > PARITY_MAX_GROUP) return 0;
+
+    uint8_t *bufs[PARITY_MAX_GROUP] = {0};
+    long lens[PARITY_MAX_GROUP];
+    uint8_t *block = NULL;
+    int okay = 0;
+
+    long maxbody = 0;
+    for (int i=0; i<k; i++) {
+        bufs[i] = read_fragment(fragments[i], &lens[i]);
+        if (!bufs[i]) goto parity_write_done;
+        if (memcmp(bufs[i], bufs[0], TEAMLEN) != 0) {
+            warnx("%s: fragments belong to different teams", __func__);
+            goto parity_write_done;
+        }
+        if (header_seq(bufs[i]) != header_seq(bufs[0]) + i) {
+            warnx("%s: fragments are not consecutive", __func__);
+            goto parity_write_done;
+        }
+        if (lens[i] - FRAGHDRLEN > maxbody) maxbody = lens[i] - FRAGHDRLEN;
+    }
+
+    uint32_t start = header_seq(bufs[0]);
+    if (seq_is_parity(start) || seq_is_parity(start + k - 1)) {
+        warnx("%s: sequence numbers out of range for parity", __func__);
+        goto parity_write_done;
+    }
+
+    block = calloc(1, PARITY_OVERHEAD + maxbody);
+    if (!block) {
+        warn("%s: could not allocate memory", __func__);
+        goto parity_write_done;
+    }
+    for (int i=0; i<k; i++) {
+        xor_block(block, bufs[i], lens[i]);
+    }
+
+    uint32_t seq = start | PARITY_SEQ_FLAG;
+    uint8_t header[FRAGHDRLEN];
+    memcpy(header, bufs[0], TEAMLEN);
+    header[TEAMLEN+0] = (seq >> 24) & 0xff;
+    header[TEAMLEN+1] = (seq >> 16) & 0xff;
+    header[TEAMLEN+2] = (seq >> 8)  & 0xff;
+    header[TEAMLEN+3] = (seq >> 0)  & 0xff;
+    header[TEAMLEN+SEQLEN] = k;
+
+    if (fwrite(header, 1, FRAGHDRLEN, out) != FRAGHDRLEN
+            || fwrite(block, 1, PARITY_OVERHEAD + maxbody, out) != PARITY_OVERHEAD + maxbody) {
+        warn("%s", __func__);
+        goto parity_write_done;
+    }
+    okay = 1;
+
+parity_write_done:
+    for (int i=0; i<k; i++) free(bufs[i]);
+    free(block);
+    return okay;
+}
+
+int parity_group_size(FILE *parity) {
+    int64_t seq = fragment_file_read_seq(parity);
+    if (seq < 0) return -1;
+    if (!seq_is_parity(seq)) {
+        warnx("%s: not a parity fragment", __func__);
+        return -1;
+    }
+    int k = fragment_file_read_raw_offset(parity);
+    if (k <= 0) {
+        warnx("%s: invalid group size", __func__);
+        return -1;
+    }
+    return k;
+}
+
+int parity_recover(FILE *out, FILE *parity, FILE *fragments[], int k, int missing) {
+    if (!out || k <= 0 || k > PARITY_MAX_GROUP || missing < 0 || missing >= k) return 0;
+    if (parity_group_size(parity) != k) {
+        warnx("%s: group size does not match parity fragment", __func__);
+        return 0;
+    }
+
+    long len;
+    uint8_t *block = read_fragment(parity, &len);
+    if (!block) return 0;
+    if (len < FRAGHDRLEN + PARITY_OVERHEAD) {
+        warnx("%s: parity fragment too short", __func__);
+        free(block);
+        return 0;
+    }
+    uint32_t start = header_seq(block) & ~PARITY_SEQ_FLAG;
+    long maxbody = len - FRAGHDRLEN - PARITY_OVERHEAD;
+
+    for (int i=0; i<k; i++) {
+        if (i == missing) continue;
+        long fraglen;
+        uint8_t *buf = read_fragment(fragments[i], &fraglen);
+        if (!buf) goto parity_recover_error;
+        if (memcmp(buf, block, TEAMLEN) != 0 || header_seq(buf) != start + i) {
+            warnx("%s: fragment %d does not belong to parity group", __func__, i);
+            free(buf);
+            goto parity_recover_error;
+        }
+        if (fraglen - FRAGHDRLEN > maxbody) {
+            warnx("%s: fragment %d longer than parity fragment", __func__, i);
+            free(buf);
+            goto parity_recover_error;
+        }
+        xor_block(block + FRAGHDRLEN, buf, fraglen);
+        free(buf);
+    }
+
+    uint8_t *recovered = block + FRAGHDRLEN;
+    long body = ((long) recovered[1] << 8) + recovered[2];
+    if (body == 0 || body > maxbody) {
+        warnx("%s: recovered fragment has invalid length", __func__);
+        goto parity_recover_error;
+    }
+
+    uint32_t seq = start + missing;
+    uint8_t header[FRAGHDRLEN];
+    memcpy(header, block, TEAMLEN);
+    header[TEAMLEN+0] = (seq >> 24) & 0xff;
+    header[TEAMLEN+1] = (seq >> 16) & 0xff;
+    header[TEAMLEN+2] = (seq >> 8)  & 0xff;
+    header[TEAMLEN+3] = (seq >> 0)  & 0xff;
+    header[TEAMLEN+SEQLEN] = recovered[0];
+
+    if (fwrite(header, 1, FRAGHDRLEN, out) != FRAGHDRLEN
+            || fwrite(recovered + PARITY_OVERHEAD, 1, body, out) != body) {
+        warn("%s", __func__);
+        goto parity_recover_error;
+    }
+    free(block);
+    return 1;
+
+parity_recover_error:
+    free(block);
+    return 0;
+}
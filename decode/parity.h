@@ -0,0 +1,35 @@
+#ifndef PARITY_H
+#define PARITY_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Parity fragments use the ordinary fragment header, but with the top bit of
+ * the sequence number set. The remaining bits give the sequence number of the
+ * first data fragment in the group, and the offset byte gives the group size.
+ *
+ * The parity payload is the XOR of one block per data fragment, where each
+ * block is | raw offset (1) | body length (2) | body |, zero padded to the
+ * longest body in the group. Any one missing data fragment can be rebuilt
+ * from the parity fragment and the rest of its group.
+ *
+ * Parity is only written for fragments that are final: fragwrite never appends
+ * to a fragment once parity covers it, nor rewrites parity, so a parity
+ * fragment always matches the data fragments it was written from. */
+#define PARITY_SEQ_FLAG 0x80000000u
+#define PARITY_MAX_GROUP 255
+#define PARITY_OVERHEAD 3
+
+/* returns 1 if seq is the sequence number of a parity fragment */
+int seq_is_parity(int64_t seq);
+
+/* write parity fragment covering k consecutive fragments, returns 0 on error */
+int parity_write(FILE *out, FILE *fragments[], int k);
+
+/* group size of parity fragment, negative on error */
+int parity_group_size(FILE *parity);
+
+/* rebuild fragments[missing] (which should be NULL) into out, returns 0 on error */
+int parity_recover(FILE *out, FILE *parity, FILE *fragments[], int k, int missing);
+
+#endif /* !PARITY_H */
@@ -1,51 +1,272 @@
 #include <stdio.h>
 #include <err.h>
+#include <errno.h>
+#include <signal.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/xattr.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include "fragment.h"
 #include "decode.h"
+#include "parity.h"
+#include "hex.h"
+#include "spool.h"
+#include "metrics.h"
+
+/* largest fragment accepted over the socket */
+#define PLACE_MAXLEN (FRAGHDR_MAXLEN + UINT16_MAX)
+/* seconds a client may take to send a fragment */
+#define PLACE_TIMEOUT 5
+/* teams whose fragment directories are kept open between fragments */
+#define TEAMDIR_CACHE_SIZE 64
+
+enum place_status {
+    PLACE_ERROR = -1,
+    PLACE_PLACED,
+    PLACE_DUPLICATE,
+    PLACE_MISMATCH,
+};
+
+static const char *status_names[] = {"placed", "duplicate", "mismatch"};
+
+/* whether a header that could be compact is an existing team's full header */
+static int team_known(const uint8_t *teamid);
+
+typedef struct {
+    char team[2*TEAMLEN+1];
+    char seq[11];
+    char path[64];
+} place_result;
+
+/* where and when a fragment was received, stamped on it as it is placed */
+typedef struct {
+    char channel[16];      /* empty if not known */
+    struct timespec time;  /* zero if not known, when its file was written is used */
+} receipt;
+
+/* a team's fragments directory and the subdirectories placed into, opened on first sight */
+typedef struct {
+    char team[2*TEAMLEN+1];
+    char *path;   /* of the fragments directory, relative to the spool, NULL if unused */
+    int fd;       /* only valid while path is set, as the cache starts zeroed */
+    int newfd;    /* -1 until first needed */
+    int parityfd;
+    unsigned long used;
+} team_dirs;
+
+static team_dirs teamdir_cache[TEAMDIR_CACHE_SIZE];
+static unsigned long teamdir_clock;
+
+/* cached directories of team, creating any missing, NULL on error */
+static team_dirs *open_team_dirs(const char *team);
+
+/* fd of subdir (new or parity) of a team's fragments directory, created if missing */
+static int open_team_subdir(team_dirs *t, const char *subdir);
+
+/* place fragment filename (relative to fromfd) into the spool directory, which must be the cwd,
+ * or with filename NULL the unnamed file fromfd from write_tmp_fragment
+ * if expected is not NULL, fragments from any other team are left in place and PLACE_MISMATCH returned
+ * rcpt (if not NULL) says how the fragment was received */
+static enum place_status place(int fromfd, const char *filename, const char *expected, const receipt *rcpt,
+                               place_result *res);
+
+/* move a fragment already identified by place into its team's fragments directory, stamped with stamp */
+static enum place_status move_fragment(int fromfd, const char *filename, const char *label,
+                                       FILE *fp, long filesize, fragment_header *hdr, const receipt *stamp,
+                                       const char *team, const char *seqstr, place_result *res);
+
+/* set modification time and channel of fragment fd from stamp, before it is linked into place */
+static void stamp_fragment(int fd, const char *label, const receipt *stamp);
+
+/* set r from a request argument channel=name or received=seconds since the epoch, 0 if invalid */
+static int receipt_arg(receipt *r, const char *arg);
+
+/* remove the fragment being placed, as for place */
+static void remove_source(int fromfd, const char *filename, const char *label);
+
+/* accept fragments on a unix socket until killed */
+static void serve(const char *socketpath);
+
+/* send the fragment in filename to the service on socketpath as a place (or placehex) request
+ * with the given arguments, printing its reply, 0 if it was not placed */
+static int send_fragment(const char *socketpath, const char *filename, int hex, const char *args);
+
+/* write fragment data to a new unnamed file in tmp/, or where the filesystem can not make
+ * one a file named *name there (otherwise set to NULL), returns its fd or -1 on error */
+static int write_tmp_fragment(const uint8_t *data, size_t len, char **name);
+
+/* place the fragment from write_tmp_fragment, removing it unless placed */
+static enum place_status place_tmp(int fd, char *name, const char *expected, const receipt *rcpt,
+                                   place_result *res);
+
+/* decode hex digits (ignoring trailing whitespace) in place, returns fragment length or -1 */
+static long decode_hex_fragment(uint8_t *data, size_t len);
+
+/* place the fragment held as hex in filename (relative to fromfd), removing it once placed */
+static enum place_status place_hex(int fromfd, const char *filename, const receipt *rcpt, place_result *res);
+
+/* returns 1 if path (relative to dirfd) holds the same fragment as fp, once its header is expanded */
+static int same_fragment(FILE *fp, long filesize, const fragment_header *hdr, int dirfd, const char *path);
+
+/* write fragment with its compact header expanded to a full header as seqstr in dirfd, stamped
+ * with stamp, returns 0 on error */
+static int expand_fragment(FILE *fp, const char *filename, fragment_header *hdr, const receipt *stamp,
+                           int dirfd, const char *seqstr);
 
 int main(int argc, char *argv[]) {
-    if (argc != 3 || (argc > 1 && argv[1][0] == '-')) {
-        fprintf(stderr, "Usage: place_fragment fragment dir\n");
+    char *socketpath = NULL;
+    char *sendpath = NULL;
+    int hex = 0;
+    receipt rcpt = {.channel = ""};
+    int stamped = 0;
+    /* the same, as arguments of a request to the service */
+    char args[256] = "";
+    int opt;
+    while ((opt = getopt(argc, argv, "c:r:s:S:x")) != -1) {
+        switch (opt) {
+            case 'c':
+            case 'r': {
+                char arg[strlen("received=")+strlen(optarg)+1];
+                sprintf(arg, "%s=%s", opt == 'c' ? "channel" : "received", optarg);
+                if (!receipt_arg(&rcpt, arg)) errx(2, "%s: invalid %s", optarg, opt == 'c' ? "channel" : "time");
+                if (strlen(args)+1+strlen(arg) >= sizeof(args)) errx(2, "%s: too long", optarg);
+                strcat(strcat(args, " "), arg);
+                stamped = 1;
+                break;
+            }
+            case 's':
+                socketpath = optarg;
+                break;
+            case 'S':
+                sendpath = optarg;
+                break;
+            case 'x':
+                hex = 1;
+                break;
+            default:
+                argc = 0;
+        }
+    }
+    if (argc - optind != ((socketpath || sendpath) ? 1 : 2) || (socketpath && (hex || stamped || sendpath))) {
+        fprintf(stderr, "Usage: place_fragment [-x] [-c channel] [-r received] fragment dir\n");
+        fprintf(stderr, "       place_fragment -s socket dir\n");
+        fprintf(stderr, "       place_fragment -S socket [-x] [-c channel] [-r received] fragment\n");
         return 2;
     }
-    char *filename = argv[1];
-    char *directory = argv[2];
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp) err(1, "%s: open", filename);
+    if (sendpath) return send_fragment(sendpath, argv[optind], hex, args) ? 0 : 1;
 
-    if (fseek(fp, 0, SEEK_END) != 0) err(1, "%s: fseek", filename);
-
-    long filesize = ftell(fp);
-
-    if (filesize <= TEAMLEN + SEQLEN + OFFSETLEN) {
-        errx(1, "%s: too small to be valid fragment", filename);
+    if (socketpath) {
+        char *directory = argv[optind];
+        /* resolve before changing directory */
+        if (socketpath[0] != '/') {
+            char *cwd = getcwd(NULL, 0);
+            if (!cwd) err(1, "getcwd");
+            char *abs = malloc(strlen(cwd)+1+strlen(socketpath)+1);
+            if (!abs) err(1, "malloc");
+            sprintf(abs, "%s/%s", cwd, socketpath);
+            free(cwd);
+            socketpath = abs;
+        }
+        if (chdir(directory) != 0) err(1, "%s: chdir", directory);
+        fragment_set_alias_dir("alias", team_known);
+        metrics_open(NULL);
+        serve(socketpath);
+        return 1;
     }
 
+    char *filename = argv[optind];
+    char *directory = argv[optind+1];
+
     int cwdfd = open(".", O_DIRECTORY);
     if (cwdfd < 0) err(1, ".");
 
     if (chdir(directory) != 0) err(1, "%s: chdir", directory);
 
-    char *team = fragment_file_read_teamid_hex(fp);
-    if (!team) errx(1, "%s: could not read team ID", filename);
+    fragment_set_alias_dir("alias", team_known);
+    metrics_open(NULL);
+
+    place_result res;
+    enum place_status status = hex ? place_hex(cwdfd, filename, &rcpt, &res) : place(cwdfd, filename, NULL, &rcpt, &res);
+    if (status == PLACE_ERROR) return 1;
+
+    puts(status == PLACE_DUPLICATE ? "duplicate" : res.path);
+
+    return 0;
+}
+
+static enum place_status place(int fromfd, const char *filename, const char *expected, const receipt *rcpt,
+                               place_result *res) {
+    enum place_status status = PLACE_ERROR;
+    char *team = NULL;
+    char *seqstr = NULL;
+    double start = metrics_now();
+
+    const char *label = filename ? filename : "received fragment";
+    int fd = filename ? openat(fromfd, filename, O_RDONLY) : dup(fromfd);
+    FILE *fp = (fd < 0) ? NULL : fdopen(fd, "r");
+    if (!fp) {
+        warn("%s: open", label);
+        if (fd >= 0) close(fd);
+        metrics_count(METRIC_FRAGMENTS_REJECTED, 1);
+        return PLACE_ERROR;
+    }
+
+    /* a fragment's file is written as it arrives */
+    receipt stamp = rcpt ? *rcpt : (receipt) {.channel = ""};
+    struct stat st;
+    if (stamp.time.tv_sec == 0 && fstat(fd, &st) == 0) stamp.time = st.st_mtim;
+
+    if (fseek(fp, 0, SEEK_END) != 0) {
+        warn("%s: fseek", label);
+        goto place_done;
+    }
+
+    long filesize = ftell(fp);
+
+    double parse_start = metrics_now();
+    fragment_header hdr;
+    if (fragment_file_read_header(fp, &hdr) < 0) {
+        warnx("%s: could not read header", label);
+        goto place_done;
+    }
 
-    int64_t seq = fragment_file_read_seq(fp);
-    if (seq < 0) errx(1, "%s: could not read sequence number", filename);
+    if (filesize <= hdr.length) {
+        warnx("%s: too small to be valid fragment", label);
+        goto place_done;
+    }
+
+    team = fragment_file_read_teamid_hex(fp);
+    if (!team) {
+        warnx("%s: could not read team ID", label);
+        goto place_done;
+    }
 
-    int raw = fragment_file_read_raw_offset(fp);
-    if (raw < 0) errx(1, "%s: could not read offset", filename);
+    int64_t seq = hdr.seq;
+    int raw = hdr.raw_offset;
 
     long firstoff = fragment_file_first_message_offset(fp);
-    if (firstoff < 0) errx(1, "%s: could not check next message offset", filename);
+    if (firstoff < 0) {
+        warnx("%s: could not check next message offset", label);
+        goto place_done;
+    }
+    metrics_observe(METRIC_HEADER_PARSE, metrics_now() - parse_start);
 
-    char *seqstr = format_seq(seq);
-    if (!seqstr) errx(1, "could not format sequence number");
+    seqstr = format_seq(seq);
+    if (!seqstr) {
+        warnx("could not format sequence number");
+        goto place_done;
+    }
+
+    snprintf(res->team, sizeof(res->team), "%s", team);
+    snprintf(res->seq, sizeof(res->seq), "%s", seqstr);
+    res->path[0] = '\0';
 
     fprintf(stderr, "team: %s\n", team);
     fprintf(stderr, "seq: %s\n", seqstr);
@@ -55,30 +276,524 @@ int main(int argc, char *argv[]) {
     } else {
         fprintf(stderr, "offset of next message: %ld\n", firstoff);
     }
+    if (hdr.compact) {
+        fprintf(stderr, "compact header: alias %04x (%ld bytes)\n", hdr.alias, hdr.length);
+    }
 
-    mkdir_or_die(team);
+    if (expected && strcmp(expected, team) != 0) {
+        fprintf(stderr, "expected team %s\n", expected);
+        status = PLACE_MISMATCH;
+        goto place_done;
+    }
 
-    char fragmentdir[sizeof(team)+strlen("/fragments")];
-    sprintf(fragmentdir, "%s/fragments", team);
+    status = move_fragment(fromfd, filename, label, fp, filesize, &hdr, &stamp, team, seqstr, res);
+    struct timespec now;
+    if (status == PLACE_PLACED && clock_gettime(CLOCK_REALTIME, &now) == 0) {
+        metrics_received(metrics_channel(stamp.channel),
+                         (now.tv_sec - stamp.time.tv_sec) + (now.tv_nsec - stamp.time.tv_nsec) / 1e9);
+    }
 
-    mkdir_or_die(fragmentdir);
+place_done:
+    fclose(fp);
+    free(team);
+    free(seqstr);
+    static const enum metric_counter status_counters[] = {
+        METRIC_FRAGMENTS_PLACED, METRIC_FRAGMENTS_DUPLICATE, METRIC_FRAGMENTS_MISMATCH
+    };
+    metrics_count(status == PLACE_ERROR ? METRIC_FRAGMENTS_REJECTED : status_counters[status], 1);
+    metrics_observe(METRIC_PLACEMENT, metrics_now() - start);
+    return status;
+}
 
-    char newdir[sizeof(fragmentdir)+strlen("/new")];
-    sprintf(newdir, "%s/new", fragmentdir);
+static void remove_source(int fromfd, const char *filename, const char *label) {
+    /* unnamed files go when closed */
+    if (filename && unlinkat(fromfd, filename, 0) != 0) warn("%s: unlink", label);
+}
 
-    mkdir_or_die(newdir);
+static enum place_status move_fragment(int fromfd, const char *filename, const char *label,
+                                       FILE *fp, long filesize, fragment_header *hdr, const receipt *stamp,
+                                       const char *team, const char *seqstr, place_result *res) {
+    team_dirs *t = open_team_dirs(team);
+    if (!t) return PLACE_ERROR;
 
-    char fragment[sizeof(newdir)+1+strlen(seqstr)];
-    sprintf(fragment, "%s/%s", newdir, seqstr);
+    /* parity fragments are kept apart until needed for recovery */
+    const char *subdir = seq_is_parity(hdr->seq) ? "parity" : "new";
 
-    if (renameat(cwdfd, filename, AT_FDCWD, fragment) != 0) {
-        err(1, "%s: move", fragment);
+    /* the same fragment often arrives over more than one channel */
+    static const char *datadirs[] = {"new", "partial", "done", NULL};
+    static const char *paritydirs[] = {"parity", NULL};
+    for (const char **d = seq_is_parity(hdr->seq) ? paritydirs : datadirs; *d; d++) {
+        char existing[strlen(*d)+1+strlen(seqstr)+1];
+        sprintf(existing, "%s/%s", *d, seqstr);
+        if (same_fragment(fp, filesize, hdr, t->fd, existing)) {
+            fprintf(stderr, "duplicate of %s/%s\n", t->path, existing);
+            remove_source(fromfd, filename, label);
+            return PLACE_DUPLICATE;
+        }
     }
 
-    puts(fragment);
+    int newfd = open_team_subdir(t, subdir);
+    if (newfd < 0) return PLACE_ERROR;
 
-    free(team);
-    free(seqstr);
+    char fragment[strlen(t->path)+1+strlen(subdir)+1+strlen(seqstr)+1];
+    sprintf(fragment, "%s/%s/%s", t->path, subdir, seqstr);
+
+    if (hdr->compact) {
+        /* everything downstream of placement only needs to handle full headers */
+        if (!expand_fragment(fp, label, hdr, stamp, newfd, seqstr)) return PLACE_ERROR;
+        remove_source(fromfd, filename, label);
+    } else {
+        stamp_fragment(fileno(fp), label, stamp);
+        if (filename ? renameat(fromfd, filename, newfd, seqstr) != 0 : !link_tmpfile(fromfd, newfd, seqstr)) {
+            warn("%s: move", fragment);
+            return PLACE_ERROR;
+        }
+    }
+
+    snprintf(res->path, sizeof(res->path), "%s", fragment);
+    return PLACE_PLACED;
+}
+
+static void stamp_fragment(int fd, const char *label, const receipt *stamp) {
+    /* only a diagnostic, so the fragment is placed regardless */
+    struct timespec times[2] = {{.tv_nsec = UTIME_OMIT}, stamp->time};
+    if (futimens(fd, times) != 0) warn("%s: futimens", label);
+    if (stamp->channel[0] && fsetxattr(fd, METRICS_CHANNEL_XATTR, stamp->channel, strlen(stamp->channel), 0) != 0
+            && errno != ENOTSUP) {
+        warn("%s: fsetxattr", label);
+    }
+}
+
+static int receipt_arg(receipt *r, const char *arg) {
+    if (strncmp(arg, "channel=", 8) == 0) {
+        const char *name = arg+8;
+        size_t len = strlen(name);
+        if (len == 0 || len >= sizeof(r->channel) || strspn(name, "abcdefghijklmnopqrstuvwxyz0123456789_-") != len) {
+            return 0;
+        }
+        strcpy(r->channel, name);
+        return 1;
+    }
+    if (strncmp(arg, "received=", 9) == 0) {
+        char *end;
+        double t = strtod(arg+9, &end);
+        if (end == arg+9 || *end != '\0' || !(t > 0 && t < 1e11)) return 0;
+        r->time.tv_sec = (time_t) t;
+        r->time.tv_nsec = (long) ((t - r->time.tv_sec) * 1e9);
+        return 1;
+    }
+    return 0;
+}
+
+static enum place_status place_hex(int fromfd, const char *filename, const receipt *rcpt, place_result *res) {
+    int fd = openat(fromfd, filename, O_RDONLY);
+    if (fd < 0) {
+        warn("%s: open", filename);
+        return PLACE_ERROR;
+    }
+    static uint8_t buf[2*PLACE_MAXLEN+2];
+    size_t len = 0;
+    ssize_t n;
+    while (len < sizeof(buf) && (n = read(fd, buf+len, sizeof(buf)-len)) > 0) len += n;
+    if (n < 0) warn("%s", filename);
+    /* otherwise the temporary file would be taken as arriving when it was decoded */
+    receipt stamp = *rcpt;
+    struct stat st;
+    if (stamp.time.tv_sec == 0 && fstat(fd, &st) == 0) stamp.time = st.st_mtim;
+    close(fd);
+    if (n < 0) return PLACE_ERROR;
+    if (len == sizeof(buf)) {
+        warnx("%s: fragment too long", filename);
+        return PLACE_ERROR;
+    }
+
+    long fraglen = decode_hex_fragment(buf, len);
+    if (fraglen < 0) {
+        warnx("%s: invalid hex", filename);
+        return PLACE_ERROR;
+    }
+    char *tmp;
+    int tmpfd = write_tmp_fragment(buf, fraglen, &tmp);
+    if (tmpfd < 0) return PLACE_ERROR;
+
+    enum place_status status = place_tmp(tmpfd, tmp, NULL, &stamp, res);
+    if (status != PLACE_ERROR && unlinkat(fromfd, filename, 0) != 0) warn("%s: unlink", filename);
+    return status;
+}
+
+static long decode_hex_fragment(uint8_t *data, size_t len) {
+    while (len > 0 && strchr(" \t\r\n", data[len-1])) len--;
+    /* each byte is written no further along than the digits it came from */
+    return hex_decode(data, (const char *) data, len);
+}
+
+static int write_tmp_fragment(const uint8_t *data, size_t len, char **name) {
+    *name = NULL;
+    if (mkdir_or_warn("tmp") < 0) return -1;
+    /* only linked into the spool once placed, so never left behind */
+    int fd = open_tmpfile(AT_FDCWD, "tmp");
+    if (fd < 0) {
+        *name = strdup("tmp/socket_fragment.XXXXXX");
+        if (!*name) {
+            warn("strdup");
+            return -1;
+        }
+        fd = mkstemp(*name);
+    }
+    if (fd < 0 || write(fd, data, len) != len) {
+        warn("%s", *name ? *name : "tmp");
+        if (fd >= 0) close(fd);
+        if (*name) unlink(*name);
+        free(*name);
+        return -1;
+    }
+    return fd;
+}
+
+static enum place_status place_tmp(int fd, char *name, const char *expected, const receipt *rcpt,
+                                   place_result *res) {
+    enum place_status status = place(name ? AT_FDCWD : fd, name, expected, rcpt, res);
+    if (name && (status == PLACE_ERROR || status == PLACE_MISMATCH)) unlink(name);
+    close(fd);
+    free(name);
+    return status;
+}
+
+/* read request line and fragment from client into a new file as write_tmp_fragment, -1 on error
+ * or for a request for metrics rather than placement, which sets *metrics */
+static int receive_fragment(int client, char *expected, receipt *rcpt, char **name, int *metrics) {
+    *metrics = 0;
+    /* room for a fragment sent as hex */
+    static uint8_t buf[2*PLACE_MAXLEN+256];
+    size_t len = 0;
+    ssize_t n;
+    while (len < sizeof(buf) && (n = read(client, buf+len, sizeof(buf)-len)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            warn("socket read");
+            return -1;
+        }
+        len += n;
+    }
+    if (len == sizeof(buf)) {
+        warnx("fragment too long");
+        return -1;
+    }
+
+    /* request line is "place [teamid] [channel=name] [received=time]", or "placehex ..." for
+     * a fragment sent as hex, or "metrics" alone */
+    uint8_t *nl = memchr(buf, '\n', len < 256 ? len : 256);
+    if (!nl) {
+        warnx("missing request line");
+        return -1;
+    }
+    *nl = '\0';
+    char *line = (char *) buf;
+    *metrics = (strcmp(line, "metrics") == 0);
+    if (*metrics) return -1;
+    int hex = (strncmp(line, "placehex", 8) == 0);
+    char *arg = line + (hex ? 8 : 5);
+    expected[0] = '\0';
+    *rcpt = (receipt) {.channel = ""};
+    if (strncmp(line, "place", 5) != 0 || (arg[0] != ' ' && arg[0] != '\0')) {
+        warnx("invalid request: %s", line);
+        return -1;
+    }
+    for (char *tok = strtok(arg, " "); tok; tok = strtok(NULL, " ")) {
+        if (strlen(tok) == 2*TEAMLEN && strspn(tok, "0123456789abcdef") == 2*TEAMLEN) {
+            strcpy(expected, tok);
+        } else if (!receipt_arg(rcpt, tok)) {
+            warnx("invalid request argument: %s", tok);
+            return -1;
+        }
+    }
+
+    uint8_t *data = nl+1;
+    size_t datalen = len - (data - buf);
+    if (hex) {
+        long n = decode_hex_fragment(data, datalen);
+        if (n < 0) {
+            warnx("invalid hex fragment");
+            return -1;
+        }
+        datalen = n;
+    } else if (datalen > PLACE_MAXLEN) {
+        warnx("fragment too long");
+        return -1;
+    }
+
+    return write_tmp_fragment(data, datalen, name);
+}
+
+/* reply to a metrics request in the Prometheus text format, empty if not enabled */
+static void send_metrics(int client) {
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    if (!out) {
+        warn("%s", __func__);
+        return;
+    }
+    metrics_write(out);
+    if (fclose(out) == 0 && write(client, text, len) != len) warn("socket write");
+    free(text);
+}
+
+static void serve(const char *socketpath) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socketpath) >= sizeof(addr.sun_path)) errx(1, "%s: socket path too long", socketpath);
+    strcpy(addr.sun_path, socketpath);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) err(1, "socket");
+
+    /* stale socket left from a previous run */
+    if (unlink(socketpath) != 0 && errno != ENOENT) err(1, "%s", socketpath);
+    if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0) err(1, "%s: bind", socketpath);
+    if (chmod(socketpath, 0660) != 0) err(1, "%s: chmod", socketpath);
+    if (listen(sock, 64) != 0) err(1, "%s: listen", socketpath);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    fprintf(stderr, "listening on %s\n", socketpath);
+
+    while (1) {
+        int client = accept(sock, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            err(1, "accept");
+        }
+
+        struct timeval timeout = {.tv_sec = PLACE_TIMEOUT};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        char expected[2*TEAMLEN+1];
+        receipt rcpt;
+        char reply[128];
+        place_result res;
+        enum place_status status = PLACE_ERROR;
+
+        char *tmp;
+        int metrics;
+        int tmpfd = receive_fragment(client, expected, &rcpt, &tmp, &metrics);
+        if (metrics) {
+            send_metrics(client);
+            close(client);
+            continue;
+        }
+        if (tmpfd >= 0) status = place_tmp(tmpfd, tmp, expected[0] ? expected : NULL, &rcpt, &res);
+
+        if (status == PLACE_ERROR) {
+            snprintf(reply, sizeof(reply), "error\n");
+        } else {
+            snprintf(reply, sizeof(reply), "%s %s %s\n", status_names[status], res.team, res.seq);
+        }
+        fputs(reply, stderr);
+        if (write(client, reply, strlen(reply)) != strlen(reply)) warn("socket write");
+        close(client);
+    }
+}
+
+static int send_fragment(const char *socketpath, const char *filename, int hex, const char *args) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) err(1, "%s", filename);
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socketpath) >= sizeof(addr.sun_path)) errx(1, "%s: socket path too long", socketpath);
+    strcpy(addr.sun_path, socketpath);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) err(1, "socket");
+    if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0) err(1, "%s: connect", socketpath);
+
+    /* the request line, then the fragment until the end of what is sent */
+    char line[strlen("placehex")+strlen(args)+2];
+    sprintf(line, "%s%s\n", hex ? "placehex" : "place", args);
+    if (write(sock, line, strlen(line)) != strlen(line)) err(1, "%s: write", socketpath);
+    uint8_t buf[8192];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        if (write(sock, buf, n) != n) err(1, "%s: write", socketpath);
+    }
+    if (n < 0) err(1, "%s", filename);
+    close(fd);
+    if (shutdown(sock, SHUT_WR) != 0) err(1, "%s: shutdown", socketpath);
+
+    char reply[128];
+    size_t len = 0;
+    while (len < sizeof(reply)-1 && (n = read(sock, reply+len, sizeof(reply)-1-len)) > 0) len += n;
+    if (n < 0) err(1, "%s: read", socketpath);
+    close(sock);
+    reply[len] = '\0';
+    fputs(reply, stdout);
+    return len > 0 && strncmp(reply, "error", 5) != 0;
+}
+
+static int team_known(const uint8_t *teamid) {
+    char team[2*TEAMLEN+1];
+    hex_encode(team, teamid, TEAMLEN);
+    return spool_has_team(NULL, team);
+}
+
+static void close_team_dirs(team_dirs *t) {
+    if (!t->path) {
+        /* never opened, whatever its descriptors say */
+        t->fd = t->newfd = t->parityfd = -1;
+        return;
+    }
+    if (t->fd >= 0) close(t->fd);
+    if (t->newfd >= 0) close(t->newfd);
+    if (t->parityfd >= 0) close(t->parityfd);
+    free(t->path);
+    t->path = NULL;
+    t->fd = t->newfd = t->parityfd = -1;
+}
+
+static team_dirs *open_team_dirs(const char *team) {
+    team_dirs *t = NULL;
+    team_dirs *victim = NULL;
+    for (int i=0; i<TEAMDIR_CACHE_SIZE && !t; i++) {
+        team_dirs *c = &teamdir_cache[i];
+        if (c->path && strcmp(c->team, team) == 0) {
+            t = c;
+        } else if (!victim || !c->path || (victim->path && c->used < victim->used)) {
+            victim = c;
+        }
+    }
+
+    /* removed since it was opened, so start again */
+    struct stat st;
+    if (t && (fstat(t->fd, &st) != 0 || st.st_nlink == 0)) {
+        close_team_dirs(t);
+        victim = t;
+        t = NULL;
+    }
+
+    if (!t) {
+        t = victim;
+        close_team_dirs(t);
+        char *teamdir = spool_make_team_dir(NULL, team);
+        if (!teamdir) return NULL;
+        t->path = malloc(strlen(teamdir)+strlen("/fragments")+1);
+        if (!t->path) {
+            warn("malloc");
+            free(teamdir);
+            return NULL;
+        }
+        sprintf(t->path, "%s/fragments", teamdir);
+        free(teamdir);
+        /* the service carries on for other teams, so nothing here exits */
+        if (mkdir_or_warn(t->path) < 0) {
+            close_team_dirs(t);
+            return NULL;
+        }
+        t->fd = open(t->path, O_RDONLY|O_DIRECTORY);
+        if (t->fd < 0) {
+            warn("%s", t->path);
+            close_team_dirs(t);
+            return NULL;
+        }
+        strcpy(t->team, team);
+    }
+    t->used = ++teamdir_clock;
+    return t;
+}
+
+static int open_team_subdir(team_dirs *t, const char *subdir) {
+    int *fd = (strcmp(subdir, "parity") == 0) ? &t->parityfd : &t->newfd;
+    if (*fd >= 0) return *fd;
+    if (mkdirat(t->fd, subdir, 0777) != 0 && errno != EEXIST) {
+        warn("%s/%s: mkdir", t->path, subdir);
+        return -1;
+    }
+    *fd = openat(t->fd, subdir, O_RDONLY|O_DIRECTORY);
+    if (*fd < 0) warn("%s/%s", t->path, subdir);
+    return *fd;
+}
+
+static int same_fragment(FILE *fp, long filesize, const fragment_header *hdr, int dirfd, const char *path) {
+    int fd = openat(dirfd, path, O_RDONLY);
+    FILE *other = (fd < 0) ? NULL : fdopen(fd, "r");
+    if (!other) {
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+
+    int same = 0;
+    uint8_t a[4096], b[4096];
+    fragment_header full = *hdr;
+    full.compact = 0;
+    long hdrlen = fragment_format_header(a, &full);
+
+    if (fseek(other, 0, SEEK_END) != 0) goto same_fragment_done;
+    if (ftell(other) != filesize - hdr->length + hdrlen) goto same_fragment_done;
+    if (fseek(other, 0, SEEK_SET) != 0) goto same_fragment_done;
+    if (fread(b, 1, hdrlen, other) != hdrlen || memcmp(a, b, hdrlen) != 0) goto same_fragment_done;
+
+    if (fseek(fp, hdr->length, SEEK_SET) != 0) goto same_fragment_done;
+    size_t n;
+    while ((n = fread(a, 1, sizeof(a), fp)) > 0) {
+        if (fread(b, 1, n, other) != n || memcmp(a, b, n) != 0) goto same_fragment_done;
+    }
+    same = !ferror(fp) && !ferror(other);
+
+same_fragment_done:
+    fclose(other);
+    return same;
+}
+
+static int expand_fragment(FILE *fp, const char *filename, fragment_header *hdr, const receipt *stamp,
+                           int dirfd, const char *seqstr) {
+    uint8_t header[FRAGHDR_MAXLEN];
+    fragment_header full = *hdr;
+    full.compact = 0;
+    long hdrlen = fragment_format_header(header, &full);
+
+    /* unnamed until complete where possible */
+    char tmp[2+strlen(seqstr)+strlen(".tmp")+1];
+    sprintf(tmp, ".%s.tmp", seqstr);
+    int named = 0;
+    int fd = open_tmpfile(dirfd, ".");
+    if (fd < 0) {
+        named = 1;
+        fd = openat(dirfd, tmp, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    }
+    FILE *out = (fd < 0) ? NULL : fdopen(fd, "w");
+    if (!out) {
+        warn("%s", tmp);
+        if (fd >= 0) close(fd);
+        if (named) unlinkat(dirfd, tmp, 0);
+        return 0;
+    }
+    if (fwrite(header, 1, hdrlen, out) != hdrlen) goto expand_fragment_error;
+
+    if (fseek(fp, hdr->length, SEEK_SET) != 0) {
+        warn("%s: fseek", filename);
+        goto expand_fragment_cleanup;
+    }
+    uint8_t buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        if (fwrite(buf, 1, n, out) != n) goto expand_fragment_error;
+    }
+    if (ferror(fp)) {
+        warn("%s", filename);
+        goto expand_fragment_cleanup;
+    }
+    if (fflush(out) != 0) goto expand_fragment_error;
+    stamp_fragment(fd, filename, stamp);
+
+    if (named ? renameat(dirfd, tmp, dirfd, seqstr) != 0 : !link_tmpfile(fd, dirfd, seqstr)) {
+        warn("%s: move", seqstr);
+        goto expand_fragment_cleanup;
+    }
+    fclose(out);
+    return 1;
 
+expand_fragment_error:
+    warn("%s", tmp);
+expand_fragment_cleanup:
+    fclose(out);
+    if (named) unlinkat(dirfd, tmp, 0);
     return 0;
 }
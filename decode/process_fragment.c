@@ -1,48 +1,122 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "fragment.h"
 #include "message.h"
+#include "cbor.h"
+#include "hex.h"
+#include "large.h"
+#include "outwriter.h"
+#include "metrics.h"
+#include "msgindex.h"
+#include "locarchive.h"
 #include "ccan/json/json.h"
 
 static uint8_t message[MSG_MAXLEN];
-static const char utf8hex[16] = u8"0123456789abcdef";
+
+/* stdout for "-", otherwise a file committed by writer */
+static FILE *open_output(outwriter *writer, const char *path);
+static void close_output(outwriter *writer, FILE *out, const char *path);
+
+/* append line to the log at path, durable before returning */
+static void append_line(const char *path, const char *line);
+
+/* copy magpi form message n starting in fragment seq to msgout, and its data to formout,
+ * returning the message without data */
+static message_t copy_form(uint32_t seq, int n, const uint8_t *header, FILE *msgout, FILE *formout);
+
+/* add msg, message n of seq written to out for msgfile, to the index of teamdir (and any
+ * fixes it holds to the team's location archive) */
+static void index_message(const char *teamdir, uint32_t seq, int n, const message_t *msg, FILE *out, const char *msgfile);
+
+/* time since fragment seqstr, in which the message starts, was placed */
+static void observe_wait(const char *seqstr);
+
+/* trace message n of teamid starting in fragment seq from its fragments arriving to now */
+static void trace_message(const char *teamid, const char *seqstr, uint32_t seq, int n);
+
+/* move a large message completed by chunk to path */
+static void finish_large(const char *largedir, const struct message_large_chunk *chunk, const char *path);
 
 int main(int argc, char *argv[]) {
-    if (argc != 8) {
-        fprintf(stderr, "Usage: process_fragment teamid directory seq msgnum msgfile jsonfile magpifile\n");
+    int append = 0;
+    int binary = 0;
+    char *largedir = NULL;
+    char *metricsfile = NULL;
+    char *teamdir = NULL;
+    int zerocopy = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "abi:l:m:z")) != -1) {
+        switch (opt) {
+            case 'i':
+                teamdir = optarg;
+                break;
+            case 'm':
+                metricsfile = optarg;
+                break;
+            case 'a':
+                append = 1;
+                break;
+            case 'b':
+                binary = 1;
+                break;
+            case 'l':
+                largedir = optarg;
+                break;
+            case 'z':
+                zerocopy = 1;
+                break;
+            default:
+                argc = 0;
+        }
+    }
+    /* logs are tailed line by line, which does not suit binary messages */
+    if (argc - optind != 7 || (append && binary) || (teamdir && strcmp(argv[optind+4], "-") == 0)) {
+        fprintf(stderr, "Usage: process_fragment [-a|-b] [-i teamdir] [-l largedir] [-m metricsfile] [-z] teamid directory seq msgnum msgfile jsonfile magpifile\n");
         return 2;
     }
-    char *teamidl = argv[1];
-    char *dir = argv[2];
-    char *seqstr = argv[3];
-    char *msgnum = argv[4];
-    char *msgfile = argv[5];
-    char *jsonfile = argv[6];
-    char *magpifile = argv[7];
+    char *teamidl = argv[optind];
+    char *dir = argv[optind+1];
+    char *seqstr = argv[optind+2];
+    char *msgnum = argv[optind+3];
+    char *msgfile = argv[optind+4];
+    char *jsonfile = argv[optind+5];
+    char *magpifile = argv[optind+6];
+
+    /* metrics are best effort, and never stop a message being processed */
+    if (metricsfile) metrics_open_file(metricsfile);
+
+    /* resolve before changing directory */
+    if (largedir) {
+        char *path = realpath(largedir, NULL);
+        if (!path) err(1, "%s", largedir);
+        largedir = path;
+    }
+    if (teamdir) {
+        char *path = realpath(teamdir, NULL);
+        if (!path) err(1, "%s", teamdir);
+        teamdir = path;
+    }
 
     if (chdir(dir) != 0) err(1, "%s: chdir", dir);
 
     /* check team id and convert to UTF8 if it's not already */
-    char teamid[2*TEAMLEN+1];
-    for (int i=0; i<2*TEAMLEN; i++) {
-        uint8_t val = 0;
-        switch (teamidl[i]) {
-            case 'f': case 'F': val++; case 'e': case 'E': val++;
-            case 'd': case 'D': val++; case 'c': case 'C': val++;
-            case 'b': case 'B': val++; case 'a': case 'A': val++;
-            case '9': val++; case '8': val++; case '7': val++; case '6': val++;
-            case '5': val++; case '4': val++; case '3': val++; case '2': val++;
-            case '1': val++; case '0': break;
-            default: errx(1, "%s: invalid team name", teamidl);
-        }
-        teamid[i] = utf8hex[val];
+    uint8_t teambin[TEAMLEN];
+    if (strlen(teamidl) != 2*TEAMLEN || hex_decode(teambin, teamidl, 2*TEAMLEN) != TEAMLEN) {
+        errx(1, "%s: invalid team name", teamidl);
     }
-    if (teamidl[2*TEAMLEN] != '\0') errx(1, "%s: invalid team name", teamidl);
-    teamid[2*TEAMLEN] = '\0';
+    char teamid[2*TEAMLEN+1];
+    hex_encode(teamid, teambin, TEAMLEN);
 
     int64_t seq = parse_seq(seqstr);
     if (seq < 0) errx(1, "%s: invalid sequence number", seqstr);
@@ -54,57 +128,272 @@ int main(int argc, char *argv[]) {
         errx(1, "%s: invalid message number", msgnum);
     }
 
-    long length = fragments_extract_message(seq, n, message, NULL);
-    if (!length) {
-        errx(1, "could not extract message %s/%s", seqstr, msgnum);
+    /* forms are copied out of the fragments by the kernel, without reading them,
+     * after checking from the header that the whole message is there */
+    uint8_t header[MSG_HDRLEN];
+    long length = 0;
+    if (zerocopy) {
+        length = fragments_walk_message_in(NULL, seq, n, header, NULL, NULL, NULL);
+        if (!length) errx(1, "could not extract message %s/%s", seqstr, msgnum);
+        zerocopy = (header[0] == MAGPI_FORM);
+        if (zerocopy && length < MSG_HDRLEN+6) errx(1, "%s: malformed message", msgfile);
+    }
+
+    message_t msg;
+    if (!zerocopy) {
+        length = fragments_extract_message(seq, n, message, NULL);
+        if (!length) {
+            errx(1, "could not extract message %s/%s", seqstr, msgnum);
+        }
+
+        double start = metrics_now();
+        msg = parse_message(message, length);
+        metrics_parsed(msg.info.type, metrics_now() - start);
+        if (msg.info.type == MSG_TYPE_ERROR) {
+            metrics_count(METRIC_MESSAGES_MALFORMED, 1);
+            errx(1, "%s: malformed message", msgfile);
+        }
     }
+    observe_wait(seqstr);
 
-    FILE *out;
-    if (strcmp(msgfile,"-")==0)
-        out = stdout;
-    else{
-        out = fopen(msgfile, "w");
-        if (!out)
-            errx(1, "could not open %s", msgfile);
+    /* chunks go straight into their message, which is output once complete */
+    struct message_large_chunk *chunk = NULL;
+    if (!zerocopy && msg.info.type == LARGE_CHUNK) {
+        if (!largedir) errx(1, "%s: large message chunk, but no directory to reassemble it", msgfile);
+        int r = large_store_chunk(largedir, &msg.data.large_chunk);
+        if (r < 0) errx(1, "%s: could not store large message chunk", msgfile);
+        if (r > 0) chunk = &msg.data.large_chunk;
     }
-    fwrite(message, 1, length, out);
-    if (out != stdout)
-        fclose(out);
 
-    message_t msg = parse_message(message, length);
-    if (msg.info.type == MSG_TYPE_ERROR) {
-        errx(1, "%s: malformed message", msgfile);
+    /* all output files become durable together before any appears under its name */
+    outwriter *writer = outwriter_new(LONG_MAX, OUTWRITER_MAX_PENDING);
+    if (!writer) errx(1, "could not start output writer");
+
+    FILE *out = open_output(writer, msgfile);
+    if (zerocopy) {
+        FILE *formout = open_output(writer, magpifile);
+        msg = copy_form(seq, n, header, out, formout);
+        close_output(writer, formout, magpifile);
+    } else {
+        fwrite(message, 1, length, out);
     }
+    /* indexed before any output is committed, so that a retry (which indexes it again,
+     * superseding this) never has to take back outputs already passed on */
+    if (teamdir) index_message(teamdir, seq, n, &msg, out, msgfile);
+    close_output(writer, out, msgfile);
 
-    if (msg.info.type == MAGPI_FORM){
-        if (strcmp(magpifile,"-")==0)
-            out = stdout;
-        else{
-            out = fopen(magpifile,"w");
-            if (!out)
-                errx(1, "could not open %s", magpifile);
-        }
+    if (!zerocopy && msg.info.type == MAGPI_FORM){
+        out = open_output(writer, magpifile);
         fwrite(msg.data.magpi_form.data, 1, msg.data.magpi_form.length, out);
-        if (out != stdout)
-           fclose(out);
+        close_output(writer, out, magpifile);
     }
 
-    JsonNode *root = json_mkobject();
-    int r = message_to_json(teamid, msg, root);
-    if (r==0){
-        if (strcmp(jsonfile,"-")==0)
-            out = stdout;
-        else{
-            out = fopen(jsonfile,"w");
-            if (!out)
-                errx(1, "could not open %s", jsonfile);
+    double encode_start = metrics_now();
+    if (binary) {
+        cbor_buf cbor;
+        cbor_init(&cbor);
+        int r = chunk ? large_message_to_cbor(teamid, chunk, &cbor) : message_to_cbor(teamid, msg, &cbor);
+        metrics_observe(METRIC_JSON_ENCODE, metrics_now() - encode_start);
+        if (r == 0) {
+            out = open_output(writer, jsonfile);
+            fwrite(cbor.data, 1, cbor.length, out);
+            close_output(writer, out, jsonfile);
         }
-        fputs(json_encode(root), out);
+        cbor_free(&cbor);
+        if (!outwriter_free(writer)) errx(1, "could not commit output files");
+        trace_message(teamid, seqstr, seq, n);
+        if (chunk) finish_large(largedir, chunk, magpifile);
+        return 0;
+    }
+
+    JsonNode *root = json_mkobject();
+    int r = chunk ? large_message_to_json(teamid, chunk, root) : message_to_json(teamid, msg, root);
+    char *json = (r == 0) ? json_encode(root) : NULL;
+    metrics_observe(METRIC_JSON_ENCODE, metrics_now() - encode_start);
+    if (r==0 && !append){
+        out = open_output(writer, jsonfile);
+        fputs(json, out);
         fputc('\n', out);
-        if (out != stdout)
-            fclose(out);
+        close_output(writer, out, jsonfile);
     }
+
+    /* logged before the message is committed, as once it is in messages/done it is never
+     * processed again, so the line could not be made up for. If the commit then fails,
+     * the retry logs it again, just as a resent message would be */
+    if (r==0 && append){
+        append_line(jsonfile, json);
+    }
+
+    if (!outwriter_free(writer)) errx(1, "could not commit output files");
+    trace_message(teamid, seqstr, seq, n);
+    free(json);
     json_delete(root);
 
+    if (chunk) finish_large(largedir, chunk, magpifile);
+
     return 0;
 }
+
+static FILE *open_output(outwriter *writer, const char *path) {
+    if (strcmp(path, "-") == 0) return stdout;
+    FILE *out = outwriter_open(writer, path);
+    if (!out) errx(1, "could not open %s", path);
+    return out;
+}
+
+static void close_output(outwriter *writer, FILE *out, const char *path) {
+    if (out == stdout) return;
+    if (!outwriter_close(writer, out)) errx(1, "could not write %s", path);
+}
+
+static void append_line(const char *path, const char *line) {
+    int fd = open(path, O_RDWR|O_APPEND|O_CREAT, 0666);
+    if (fd < 0) err(1, "%s", path);
+
+    /* a line cut short by a crash must not run into this one */
+    struct stat st;
+    if (fstat(fd, &st) != 0) err(1, "%s", path);
+    char last = '\n';
+    if (st.st_size > 0 && pread(fd, &last, 1, st.st_size-1) != 1) err(1, "%s", path);
+
+    size_t len = strlen(line);
+    char *buf = malloc(len+2);
+    if (!buf) err(1, "malloc");
+    size_t n = 0;
+    if (last != '\n') buf[n++] = '\n';
+    memcpy(buf+n, line, len);
+    n += len;
+    buf[n++] = '\n';
+
+    /* a single write, so readers never see part of a line followed by another */
+    if (write(fd, buf, n) != n) err(1, "%s", path);
+    if (fdatasync(fd) != 0) err(1, "%s: fdatasync", path);
+    if (close(fd) != 0) err(1, "%s", path);
+    free(buf);
+}
+
+static void index_message(const char *teamdir, uint32_t seq, int n, const message_t *msg, FILE *out, const char *msgfile) {
+    if (fflush(out) != 0) err(1, "%s", msgfile);
+    msgindex_entry e = {.seq = seq, .msgnum = n};
+    msgindex_describe(&e, msg);
+    if (!msgindex_append(teamdir, &e, fileno(out))) errx(1, "could not index %s", msgfile);
+    if (msg->info.type == LOCATION
+            && !locarchive_append(teamdir, msg->data.location.locations, msg->data.location.length)) {
+        errx(1, "could not archive locations of %s", msgfile);
+    }
+}
+
+static void observe_wait(const char *seqstr) {
+    /* fragments are placed by linking a finished file, so it was modified on arrival */
+    struct stat st;
+    struct timespec now;
+    if (stat(seqstr, &st) != 0 || clock_gettime(CLOCK_REALTIME, &now) != 0) return;
+    metrics_observe(METRIC_REASSEMBLY_WAIT, (now.tv_sec - st.st_mtim.tv_sec) + (now.tv_nsec - st.st_mtim.tv_nsec) / 1e9);
+}
+
+typedef struct {
+    double first;       /* when the earliest of the message's fragments was received */
+    double last;        /* and the latest */
+    char channel[16];   /* the latest was received over, empty if not known */
+} message_trace;
+
+static void trace_fragment(message_trace *t, FILE *fragment) {
+    /* placement sets when each fragment was received as its modification time */
+    struct stat st;
+    if (fstat(fileno(fragment), &st) != 0) return;
+    double received = st.st_mtim.tv_sec + st.st_mtim.tv_nsec / 1e9;
+    if (t->first == 0 || received < t->first) t->first = received;
+    if (received >= t->last) {
+        t->last = received;
+        ssize_t len = fgetxattr(fileno(fragment), METRICS_CHANNEL_XATTR, t->channel, sizeof(t->channel)-1);
+        t->channel[len > 0 ? len : 0] = '\0';
+    }
+}
+
+static int trace_piece(void *arg, FILE *fragment, long off, long pos, long len) {
+    trace_fragment(arg, fragment);
+    return 1;
+}
+
+static void trace_message(const char *teamid, const char *seqstr, uint32_t seq, int n) {
+    if (!metrics_enabled()) return;
+    message_trace t = {.first = 0};
+    /* the message's header may end its first fragment, which then holds no piece of the rest */
+    FILE *first = fopen(seqstr, "r");
+    if (first) {
+        trace_fragment(&t, first);
+        fclose(first);
+    }
+    uint8_t header[MSG_HDRLEN];
+    fragments_walk_message_in(NULL, seq, n, header, trace_piece, &t, NULL);
+
+    struct timespec now;
+    if (t.first == 0 || clock_gettime(CLOCK_REALTIME, &now) != 0) return;
+    metrics_traced(teamid, seqstr, n, metrics_channel(t.channel), t.first, t.last, now.tv_sec + now.tv_nsec / 1e9);
+}
+
+static void finish_large(const char *largedir, const struct message_large_chunk *chunk, const char *path) {
+    if (!large_finish(largedir, chunk, path)) errx(1, "could not move large message to %s", path);
+}
+
+/* copy len bytes at off in infd to the current position of outfd, in the kernel where possible */
+static int copy_range(int infd, off_t off, int outfd, size_t len) {
+    while (len > 0) {
+        ssize_t n = copy_file_range(infd, &off, outfd, NULL, len, 0);
+        if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) break;
+        if (n <= 0) return 0;
+        len -= n;
+    }
+    /* different filesystems, or a pipe */
+    uint8_t buf[8192];
+    while (len > 0) {
+        ssize_t n = pread(infd, buf, len < sizeof(buf) ? len : sizeof(buf), off);
+        if (n <= 0 || write(outfd, buf, n) != n) return 0;
+        off += n;
+        len -= n;
+    }
+    return 1;
+}
+
+typedef struct {
+    uint8_t head[MSG_HDRLEN+5]; /* message header and the form's member and time */
+    int msgfd;
+    int formfd;
+} form_copy;
+
+static int copy_form_piece(void *arg, FILE *fragment, long off, long pos, long len) {
+    form_copy *c = arg;
+    int fd = fileno(fragment);
+    if (pos < sizeof(c->head)) {
+        long n = sizeof(c->head) - pos < len ? sizeof(c->head) - pos : len;
+        if (pread(fd, c->head+pos, n, off) != n) return 0;
+    }
+    if (!copy_range(fd, off, c->msgfd, len)) return 0;
+    if (pos+len > sizeof(c->head)) {
+        long skip = pos < sizeof(c->head) ? sizeof(c->head) - pos : 0;
+        if (!copy_range(fd, off+skip, c->formfd, len-skip)) return 0;
+    }
+    return 1;
+}
+
+static message_t copy_form(uint32_t seq, int n, const uint8_t *header, FILE *msgout, FILE *formout) {
+    form_copy c = {.msgfd = fileno(msgout), .formfd = fileno(formout)};
+    memcpy(c.head, header, MSG_HDRLEN);
+    if (fwrite(header, 1, MSG_HDRLEN, msgout) != MSG_HDRLEN || fflush(msgout) != 0 || fflush(formout) != 0) {
+        err(1, "could not write message");
+    }
+    long length = fragments_walk_message_in(NULL, seq, n, c.head, copy_form_piece, &c, NULL);
+    if (!length) errx(1, "could not copy message");
+
+    message_t msg;
+    msg.info.type = MAGPI_FORM;
+    msg.info.length = length - MSG_HDRLEN;
+    msg.data.magpi_form.member = c.head[MSG_HDRLEN];
+    msg.data.magpi_form.time = 0;
+    for (int i=1; i<5; i++) {
+        msg.data.magpi_form.time = (msg.data.magpi_form.time << 8) + c.head[MSG_HDRLEN+i];
+    }
+    msg.data.magpi_form.length = length - sizeof(c.head);
+    msg.data.magpi_form.data = NULL;
+    return msg;
+}
@@ -0,0 +1,708 @@
+#include <stdio.h>
+#include <err.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "fragment.h"
+#include "message.h"
+#include "decode.h"
+#include "spool.h"
+#include "workpool.h"
+#include "outwriter.h"
+#include "uring.h"
+#include "fragcache.h"
+#include "checkpoint.h"
+#include "metrics.h"
+#include "ccan/json/json.h"
+
+typedef struct {
+    char team[2*TEAMLEN+1];
+    long fragments;
+    long messages;
+    long incomplete;
+    long errors;
+    long skipped; /* decoded by an earlier run */
+    long long bytes;
+    int finished;
+} team_stats;
+
+typedef struct {
+    const char *spool;
+    const char *outdir;
+    outwriter *writer;
+    fragcache *cache; /* NULL unless preloading fragments through io_uring */
+    checkpoint *checkpoint; /* NULL unless resuming from and recording progress */
+    team_stats *stats;
+    /* protects stats[].finished */
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    /* teams decoded and waiting for the commits of their outputs, with those below */
+    struct pending_checkpoint *pending;
+    long committed;     /* last commit reported by the writer */
+    long failed_commit; /* last commit that failed, 0 if none */
+    long checkpoint_errors;
+    pthread_mutex_t checkpoint_lock;
+} rebuild_context;
+
+/* a team's progress, recorded once commits first to last (which hold all its outputs) are done */
+typedef struct pending_checkpoint {
+    long first, last;
+    team_checkpoint progress;
+    struct pending_checkpoint *next;
+} pending_checkpoint;
+
+/* milliseconds between group commits of output files */
+#define DEFAULT_COMMIT_INTERVAL 1000
+
+/* where fragments of a team may be, in the order they are looked for */
+static const char *fragment_dirs[] = {"done", "partial"};
+#define NUM_FRAGMENT_DIRS (sizeof(fragment_dirs)/sizeof(fragment_dirs[0]))
+/* seconds since a directory was last changed before its modification time is trusted to
+ * change again with it, as times are only updated every clock tick */
+#define SETTLED_SECONDS 1
+
+/* fragments opened and read at once when preloading through io_uring */
+#define PRELOAD_BATCH 32
+/* largest fragment preloaded, bigger ones are read from their file as usual */
+#define PRELOAD_MAX_FRAGMENT 65536
+/* default megabytes of preloaded fragments held by all threads together */
+#define DEFAULT_CACHE_MB 64
+
+/* each fragment is preloaded at most once, READ_FROM_FILE if that failed */
+enum { NOT_PRELOADED, READ_FROM_FILE, PRELOADED };
+
+/* a team's fragments, those preloaded held in cache until used */
+typedef struct {
+    const char *team;
+    const int *search;
+    const int64_t *seqs;
+    long nseqs;
+    fragcache *cache;
+    char *state; /* for each of seqs */
+} team_fragments;
+
+static int compare_seqs(const void *a, const void *b) {
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* sorted sequence numbers of fragments in dirfds (terminated by -1), setting highest[i] to
+ * the highest in dirfds[i] (-1 if none), number found or negative on error */
+static long list_fragments(const int *dirfds, int64_t **seqs, int64_t *highest) {
+    long n = 0, max = 1024;
+    *seqs = malloc(max * sizeof(int64_t));
+    if (!*seqs) err(1, "malloc");
+    for (const int *dir = dirfds; *dir >= 0; dir++) {
+        highest[dir-dirfds] = -1;
+        /* a copy, as closedir closes it */
+        int fd = dup(*dir);
+        DIR *d = (fd < 0) ? NULL : fdopendir(fd);
+        if (!d) {
+            warn("%s", __func__);
+            if (fd >= 0) close(fd);
+            free(*seqs);
+            return -1;
+        }
+        rewinddir(d);
+        struct dirent *ent;
+        while ((ent = readdir(d))) {
+            if (strlen(ent->d_name) != 10 || strspn(ent->d_name, "0123456789") != 10) continue;
+            int64_t seq = parse_seq(ent->d_name);
+            if (seq < 0) continue;
+            if (seq > highest[dir-dirfds]) highest[dir-dirfds] = seq;
+            if (n == max) {
+                max *= 2;
+                *seqs = realloc(*seqs, max * sizeof(int64_t));
+                if (!*seqs) err(1, "realloc");
+            }
+            (*seqs)[n++] = seq;
+        }
+        closedir(d);
+    }
+    qsort(*seqs, n, sizeof(int64_t), compare_seqs);
+    /* a fragment is in at most one place, but may be moved while we scan */
+    long unique = 0;
+    for (long i=0; i<n; i++) {
+        if (unique == 0 || (*seqs)[unique-1] != (*seqs)[i]) (*seqs)[unique++] = (*seqs)[i];
+    }
+    return unique;
+}
+
+static FILE *open_fragment(const int *dirfds, const char *seqstr) {
+    for (const int *dir = dirfds; *dir >= 0; dir++) {
+        int fd = openat(*dir, seqstr, O_RDONLY);
+        if (fd < 0) continue;
+        FILE *fp = fdopen(fd, "r");
+        if (!fp) close(fd);
+        return fp;
+    }
+    return NULL;
+}
+
+/* a worker's ring and buffer for preloading, made for its first team and kept until it exits */
+typedef struct {
+    uring *ring; /* NULL where io_uring is not available */
+    uint8_t *buf;
+} preloader;
+
+static pthread_key_t preloader_key;
+
+static void free_preloader(void *arg) {
+    preloader *p = arg;
+    uring_free(p->ring);
+    free(p->buf);
+    free(p);
+}
+
+/* the calling worker's preloader, NULL if it can not preload */
+static preloader *worker_preloader(void) {
+    preloader *p = pthread_getspecific(preloader_key);
+    if (!p) {
+        p = calloc(1, sizeof(preloader));
+        if (!p) err(1, "calloc");
+        p->ring = uring_new(PRELOAD_BATCH*2);
+        if (p->ring) {
+            p->buf = malloc(PRELOAD_BATCH * PRELOAD_MAX_FRAGMENT);
+            if (!p->buf) err(1, "malloc");
+        }
+        if (pthread_setspecific(preloader_key, p) != 0) errx(1, "could not keep preloader");
+    }
+    return p->ring ? p : NULL;
+}
+
+/* steps of preloading a fragment, in the low bit of each operation's tag */
+enum { PRELOAD_READ, PRELOAD_CLOSE };
+
+typedef struct {
+    char seqstr[11];
+    int fd;
+    int res;    /* from open, then from read */
+    int closed;
+} preload_slot;
+
+static void preload_step_done(void *arg, uint64_t tag, int res) {
+    preload_slot *slot = (preload_slot *) arg + (tag >> 1);
+    if ((tag & 1) == PRELOAD_CLOSE) {
+        slot->closed = 1;
+    } else {
+        slot->res = res;
+    }
+}
+
+/* read the team's next PRELOAD_BATCH fragments from first into the cache, submitting them
+ * through ring all at once, using buf (PRELOAD_BATCH * PRELOAD_MAX_FRAGMENT long).
+ * any that can not be are left to be read from their file */
+static void preload_fragments(uring *ring, uint8_t *buf, team_fragments *frags, long first) {
+    int nslots = 0;
+    while (nslots < PRELOAD_BATCH && first+nslots < frags->nseqs && frags->state[first+nslots] == NOT_PRELOADED) {
+        frags->state[first+nslots] = READ_FROM_FILE;
+        nslots++;
+    }
+    if (nslots == 0) return;
+    preload_slot slots[nslots];
+    for (int i=0; i<nslots; i++) {
+        snprintf(slots[i].seqstr, sizeof(slots[i].seqstr), "%010lld", (long long) frags->seqs[first+i]);
+        slots[i].fd = -1;
+        slots[i].res = -ENOENT;
+        slots[i].closed = 0;
+    }
+
+    /* each directory in turn, for those not found in the last */
+    for (int dir=0; frags->search[dir] >= 0; dir++) {
+        for (int i=0; i<nslots; i++) {
+            if (slots[i].res != -ENOENT) continue;
+            uring_openat(ring, frags->search[dir], slots[i].seqstr, O_RDONLY, 0, (uint64_t) i << 1);
+        }
+        if (uring_queued(ring) && !uring_run(ring, preload_step_done, slots)) errx(1, "could not preload fragments");
+    }
+
+    /* closed after rather than linked to the read, which is short for any fragment that fits
+     * in the buffer and so would cancel the close */
+    for (int i=0; i<nslots; i++) {
+        if (slots[i].res < 0) continue;
+        slots[i].fd = slots[i].res;
+        uring_read(ring, slots[i].fd, buf + i*PRELOAD_MAX_FRAGMENT, PRELOAD_MAX_FRAGMENT, 0, 0, (uint64_t) i << 1);
+    }
+    if (uring_queued(ring) && !uring_run(ring, preload_step_done, slots)) errx(1, "could not preload fragments");
+    for (int i=0; i<nslots; i++) {
+        if (slots[i].fd >= 0) uring_close(ring, slots[i].fd, ((uint64_t) i << 1) | PRELOAD_CLOSE);
+    }
+    if (uring_queued(ring) && !uring_run(ring, preload_step_done, slots)) errx(1, "could not preload fragments");
+
+    for (int i=0; i<nslots; i++) {
+        if (slots[i].fd < 0) continue;
+        if (!slots[i].closed) close(slots[i].fd);
+        /* a fragment filling the buffer may be longer, and is read as usual */
+        int len = slots[i].res;
+        if (len <= 0 || len == PRELOAD_MAX_FRAGMENT) continue;
+        if (fragcache_add(frags->cache, frags->team, frags->seqs[first+i], buf + i*PRELOAD_MAX_FRAGMENT, len)) {
+            frags->state[first+i] = PRELOADED;
+        }
+    }
+}
+
+/* fragment_open_fn over team_fragments */
+static FILE *open_team_fragment(void *arg, const char *seqstr) {
+    team_fragments *frags = arg;
+    int64_t seq = parse_seq(seqstr);
+    if (frags->cache && seq >= 0) {
+        const int64_t *found = bsearch(&seq, frags->seqs, frags->nseqs, sizeof(int64_t), compare_seqs);
+        long i = found ? found - frags->seqs : -1;
+        /* if evicted since, read again as usual */
+        if (i >= 0 && frags->state[i] == PRELOADED) {
+            FILE *fp = fragcache_open(frags->cache, frags->team, seq, 1);
+            if (fp) return fp;
+        }
+    }
+    return open_fragment(frags->search, seqstr);
+}
+
+static int write_json(outwriter *writer, const char *outdir, const char *team, const char *seqstr, int n, const char *json) {
+    char path[strlen(outdir)+1+2*TEAMLEN+1+strlen(seqstr)+1+5+strlen(".json")+1];
+    sprintf(path, "%s/%s-%s.%05d.json", outdir, team, seqstr, n);
+
+    FILE *out = outwriter_open(writer, path);
+    if (!out) return 0;
+    fputs(json, out);
+    fputc('\n', out);
+    return outwriter_close(writer, out);
+}
+
+/* decode message n starting in fragment seq, 0 if it can not be yet but may be later */
+static int rebuild_message(team_fragments *frags, outwriter *writer, const char *outdir, team_stats *stats,
+                           uint8_t *message, int64_t seq, const char *seqstr, int n) {
+    long length = fragments_extract_message_with(open_team_fragment, frags, seq, n, message, NULL);
+    if (!length) {
+        /* the rest of the message has not been received yet */
+        stats->incomplete++;
+        metrics_count(METRIC_MESSAGES_INCOMPLETE, 1);
+        return 0;
+    }
+    double start = metrics_now();
+    message_t msg = parse_message(message, length);
+    metrics_parsed(msg.info.type, metrics_now() - start);
+    if (msg.info.type == MSG_TYPE_ERROR) {
+        warnx("%s/%s.%05d: malformed message", stats->team, seqstr, n);
+        stats->errors++;
+        metrics_count(METRIC_MESSAGES_MALFORMED, 1);
+        return 1;
+    }
+    /* large messages are only reported once reassembled, which process_fragment has done */
+    if (msg.info.type == LARGE_CHUNK) {
+        free_message(msg);
+        return 1;
+    }
+    int done = 1;
+    start = metrics_now();
+    JsonNode *root = json_mkobject();
+    char *json = (message_to_json(stats->team, msg, root) == 0) ? json_encode(root) : NULL;
+    metrics_observe(METRIC_JSON_ENCODE, metrics_now() - start);
+    if (json) {
+        if (write_json(writer, outdir, stats->team, seqstr, n, json)) {
+            stats->messages++;
+        } else {
+            stats->errors++;
+            done = 0;
+        }
+    } else {
+        warnx("%s/%s.%05d: could not convert message to JSON", stats->team, seqstr, n);
+        stats->errors++;
+    }
+    free(json);
+    json_delete(root);
+    free_message(msg);
+    return done;
+}
+
+static int has_seq(const int64_t *seqs, long n, int64_t seq) {
+    return bsearch(&seq, seqs, n, sizeof(int64_t), compare_seqs) != NULL;
+}
+
+/* decode every message of a team in order, after any decoded by an earlier run recorded in
+ * cp (if not NULL), setting progress to record once its outputs are durable, run in a pool thread */
+static void rebuild_team(const char *spool, const char *outdir, outwriter *writer, fragcache *cache,
+                         checkpoint *cp, team_stats *stats, team_checkpoint *progress) {
+    char *teamdir = spool_team_dir(spool, stats->team);
+    if (!teamdir) errx(1, "%s: could not find team directory", stats->team);
+    char fragmentdir[strlen(teamdir)+strlen("/fragments")+1];
+    sprintf(fragmentdir, "%s/fragments", teamdir);
+    free(teamdir);
+
+    /* opened once, so each fragment is found without resolving the whole path again */
+    int search[NUM_FRAGMENT_DIRS+1];
+    int nsearch = 0;
+    int donefd = -1;
+    int fragfd = open(fragmentdir, O_RDONLY|O_DIRECTORY);
+    if (fragfd < 0 && errno != ENOENT) {
+        warn("%s", fragmentdir);
+        stats->errors++;
+    }
+    for (int i=0; fragfd >= 0 && i<NUM_FRAGMENT_DIRS; i++) {
+        int fd = openat(fragfd, fragment_dirs[i], O_RDONLY|O_DIRECTORY);
+        if (fd >= 0) {
+            search[nsearch++] = fd;
+            if (strcmp(fragment_dirs[i], "done") == 0) donefd = fd;
+        } else if (errno != ENOENT) {
+            warn("%s/%s", fragmentdir, fragment_dirs[i]);
+            stats->errors++;
+        }
+    }
+    search[nsearch] = -1;
+    if (fragfd >= 0) close(fragfd);
+
+    uint8_t *message = malloc(MSG_MAXLEN);
+    if (!message) err(1, "malloc");
+
+    /* done/ is not listed again while unchanged since it held nothing after the frontier,
+     * though fragments are still looked for there */
+    team_checkpoint last = checkpoint_get(cp, stats->team);
+    struct timespec now;
+    struct stat donest;
+    int statted = donefd >= 0 && clock_gettime(CLOCK_REALTIME, &now) == 0 && fstat(donefd, &donest) == 0;
+    int unchanged = statted && (last.done_mtime.tv_sec || last.done_mtime.tv_nsec)
+        && donest.st_mtim.tv_sec == last.done_mtime.tv_sec && donest.st_mtim.tv_nsec == last.done_mtime.tv_nsec;
+    int listed[NUM_FRAGMENT_DIRS+1];
+    int nlisted = 0;
+    for (int i=0; i<nsearch; i++) {
+        if (!unchanged || search[i] != donefd) listed[nlisted++] = search[i];
+    }
+    listed[nlisted] = -1;
+
+    int64_t *seqs;
+    int64_t highest[NUM_FRAGMENT_DIRS];
+    long nseqs = list_fragments(listed, &seqs, highest);
+    if (nseqs < 0) {
+        stats->errors++;
+        nseqs = 0;
+        seqs = NULL;
+        statted = 0;
+    }
+
+    /* opened and read in batches rather than one by one, just ahead of being needed */
+    team_fragments frags = {.team = stats->team, .search = search, .seqs = seqs, .nseqs = nseqs};
+    preloader *pre = (cache && nseqs > 0) ? worker_preloader() : NULL;
+    uring *ring = pre ? pre->ring : NULL;
+    if (ring) {
+        frags.cache = cache;
+        frags.state = calloc(nseqs, 1);
+        if (!frags.state) err(1, "calloc");
+    }
+
+    /* fragments up to the frontier are done with, and of those after it that were seen before
+     * only the messages still waiting for more fragments are tried again */
+    team_checkpoint next = checkpoint_get(NULL, stats->team);
+    next.frontier = last.frontier;
+    long first = 0;
+    while (first < nseqs && seqs[first] <= last.frontier) first++;
+    /* every fragment up to the frontier is present, whether listed or not */
+    stats->skipped = unchanged ? last.frontier+1 : first;
+    /* the frontier stops at the first gap or incomplete message */
+    int stopped = 0;
+    long waiting = 0;
+
+    /* no need to preload fragments seen before with no messages waiting */
+    for (long i=first; ring && i<nseqs; i++) {
+        if (!has_seq(last.fragments, last.nfragments, seqs[i])) continue;
+        while (waiting < last.nwaiting && last.waiting[waiting].seq < seqs[i]) waiting++;
+        if (waiting == last.nwaiting || last.waiting[waiting].seq != seqs[i]) frags.state[i] = READ_FROM_FILE;
+    }
+    waiting = 0;
+
+    for (long i=first; i<nseqs; i++) {
+        if (ring && frags.state[i] == NOT_PRELOADED) preload_fragments(ring, pre->buf, &frags, i);
+        char *seqstr = format_seq(seqs[i]);
+        if (!seqstr) {
+            stats->errors++;
+            stopped = 1;
+            continue;
+        }
+
+        int decoded = 1;
+        if (has_seq(last.fragments, last.nfragments, seqs[i])) {
+            stats->skipped++;
+            while (waiting < last.nwaiting && last.waiting[waiting].seq < seqs[i]) waiting++;
+            for (; waiting < last.nwaiting && last.waiting[waiting].seq == seqs[i]; waiting++) {
+                int n = last.waiting[waiting].n;
+                if (!rebuild_message(&frags, writer, outdir, stats, message, seqs[i], seqstr, n)) {
+                    decoded = 0;
+                    if (!team_checkpoint_add_waiting(&next, seqs[i], n)) err(1, "realloc");
+                }
+            }
+        } else {
+            FILE *fp = open_team_fragment(&frags, seqstr);
+            if (!fp) {
+                /* moved from partial to done while listing */
+                free(seqstr);
+                stopped = 1;
+                continue;
+            }
+            stats->fragments++;
+            if (fseek(fp, 0, SEEK_END) == 0) stats->bytes += ftell(fp);
+            int starts = fragment_file_messages_started(fp);
+            fclose(fp);
+            if (starts < 0) {
+                warnx("%s/%s: could not count message starts", stats->team, seqstr);
+                stats->errors++;
+                free(seqstr);
+                stopped = 1;
+                continue;
+            }
+
+            for (int n=1; n<=starts; n++) {
+                if (!rebuild_message(&frags, writer, outdir, stats, message, seqs[i], seqstr, n)) {
+                    decoded = 0;
+                    if (!team_checkpoint_add_waiting(&next, seqs[i], n)) err(1, "realloc");
+                }
+            }
+        }
+
+        if (!stopped && decoded && seqs[i] == next.frontier+1) {
+            next.frontier = seqs[i];
+        } else {
+            stopped = 1;
+            if (!team_checkpoint_add_fragment(&next, seqs[i])) err(1, "realloc");
+        }
+        free(seqstr);
+        /* every message starting here has been extracted, so it is not needed again */
+        if (ring) fragcache_drop(cache, stats->team, seqs[i]);
+    }
+    free(frags.state);
+
+    /* a change to done/ after it was looked at gives it a later time, once it has settled */
+    if (unchanged) {
+        next.done_mtime = last.done_mtime;
+    } else if (statted && listed[0] == donefd && highest[0] <= next.frontier
+            && donest.st_mtim.tv_sec + SETTLED_SECONDS <= now.tv_sec) {
+        next.done_mtime = donest.st_mtim;
+    }
+
+    team_checkpoint_clear(&last);
+    *progress = next;
+    free(seqs);
+    free(message);
+    for (int i=0; i<nsearch; i++) close(search[i]);
+}
+
+/* record p, freeing it, unless a commit that may hold its outputs failed; caller holds
+ * checkpoint_lock */
+static void record_checkpoint(rebuild_context *ctx, pending_checkpoint *p) {
+    if (p->first <= ctx->failed_commit || !checkpoint_record(ctx->checkpoint, &p->progress)) {
+        warnx("%s: could not record progress", p->progress.team);
+        ctx->checkpoint_errors++;
+    }
+    team_checkpoint_clear(&p->progress);
+    free(p);
+}
+
+/* outwriter_commit_fn recording the progress of teams whose outputs are now durable */
+static void record_committed(void *arg, long commit, int ok) {
+    rebuild_context *ctx = arg;
+    pthread_mutex_lock(&ctx->checkpoint_lock);
+    ctx->committed = commit;
+    if (!ok) ctx->failed_commit = commit;
+    pending_checkpoint **prev = &ctx->pending;
+    while (*prev) {
+        pending_checkpoint *p = *prev;
+        if (p->last <= commit || p->first <= ctx->failed_commit) {
+            *prev = p->next;
+            record_checkpoint(ctx, p);
+        } else {
+            prev = &p->next;
+        }
+    }
+    pthread_mutex_unlock(&ctx->checkpoint_lock);
+}
+
+static void rebuild_team_task(void *arg, long task) {
+    rebuild_context *ctx = arg;
+    /* the team's outputs go in this commit or later, rather than committing after each team */
+    long first = outwriter_commits(ctx->writer) + 1;
+    team_checkpoint progress;
+    rebuild_team(ctx->spool, ctx->outdir, ctx->writer, ctx->cache, ctx->checkpoint, &ctx->stats[task], &progress);
+    if (ctx->checkpoint) {
+        pending_checkpoint *p = malloc(sizeof(pending_checkpoint));
+        if (!p) err(1, "malloc");
+        p->first = first;
+        p->progress = progress;
+        pthread_mutex_lock(&ctx->checkpoint_lock);
+        /* read under the lock, so the commit it waits for is not reported in between */
+        p->last = outwriter_commits(ctx->writer) + 1;
+        if (p->last <= ctx->committed) {
+            record_checkpoint(ctx, p);
+        } else {
+            p->next = ctx->pending;
+            ctx->pending = p;
+        }
+        pthread_mutex_unlock(&ctx->checkpoint_lock);
+    } else {
+        team_checkpoint_clear(&progress);
+    }
+    pthread_mutex_lock(&ctx->lock);
+    ctx->stats[task].finished = 1;
+    pthread_cond_broadcast(&ctx->finished);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/* teams are sharded by id, so a given team always starts on the same queue */
+static unsigned long team_shard(const char *team) {
+    return strtoul(team + 2*TEAMLEN - 8, NULL, 16);
+}
+
+static double elapsed_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    long interval = DEFAULT_COMMIT_INTERVAL;
+    int use_uring = 0;
+    long cache_mb = DEFAULT_CACHE_MB;
+    char *checkpointfile = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:c:k:m:u")) != -1) {
+        switch (opt) {
+            case 'k':
+                checkpointfile = optarg;
+                break;
+            case 'u':
+                use_uring = 1;
+                break;
+            case 'm': {
+                char *end = NULL;
+                cache_mb = strtol(optarg, &end, 10);
+                if (optarg[0] == '\0' || end[0] != '\0' || cache_mb < 1) {
+                    errx(1, "%s: invalid cache size", optarg);
+                }
+                break;
+            }
+            case 'c': {
+                char *end = NULL;
+                interval = strtol(optarg, &end, 10);
+                if (optarg[0] == '\0' || end[0] != '\0' || interval < 0) {
+                    errx(1, "%s: invalid commit interval", optarg);
+                }
+                break;
+            }
+            case 'j': {
+                char *end = NULL;
+                workers = strtol(optarg, &end, 10);
+                if (optarg[0] == '\0' || end[0] != '\0' || workers < 1) {
+                    errx(1, "%s: invalid number of workers", optarg);
+                }
+                break;
+            }
+            default:
+                argc = 0;
+        }
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, "Usage: rebuild_all [-j workers] [-c commit_interval_ms] [-k checkpoint] [-u [-m cache_mb]] spooldir outdir\n");
+        fprintf(stderr, "Writes every message decoded from the fragments in spooldir to outdir as JSON, leaving\n");
+        fprintf(stderr, "each team's message index and location archive as process_fragment made them, and\n");
+        fprintf(stderr, "large messages (whose chunks are only output once reassembled) to process_fragment\n");
+        return 2;
+    }
+    if (workers < 1) workers = 1;
+
+    char *spool = argv[optind];
+    char *outdir = argv[optind+1];
+    mkdir_or_die(outdir);
+    metrics_open(spool);
+
+    char **teams;
+    int nteams = spool_list_teams(spool, &teams);
+    if (nteams < 0) return 1;
+
+    rebuild_context ctx = {.spool = spool, .outdir = outdir};
+    ctx.writer = outwriter_new(interval, OUTWRITER_MAX_PENDING);
+    if (!ctx.writer) errx(1, "could not start output writer");
+    /* plain system calls where io_uring is not available */
+    if (use_uring && !outwriter_use_uring(ctx.writer)) {
+        warnx("io_uring not available, reading and writing files one by one");
+    } else if (use_uring) {
+        ctx.cache = fragcache_new(cache_mb * 1024 * 1024);
+        if (!ctx.cache) errx(1, "could not start fragment cache");
+        if (pthread_key_create(&preloader_key, free_preloader) != 0) errx(1, "could not make preloader key");
+    }
+    /* only what was not decoded into outdir by an earlier run with the same checkpoint */
+    if (checkpointfile) {
+        ctx.checkpoint = checkpoint_open(checkpointfile);
+        if (!ctx.checkpoint) errx(1, "%s: could not open checkpoint", checkpointfile);
+        outwriter_on_commit(ctx.writer, record_committed, &ctx);
+    }
+    pthread_mutex_init(&ctx.lock, NULL);
+    pthread_mutex_init(&ctx.checkpoint_lock, NULL);
+    pthread_cond_init(&ctx.finished, NULL);
+    ctx.stats = calloc(nteams > 0 ? nteams : 1, sizeof(team_stats));
+    if (!ctx.stats) err(1, "calloc");
+    for (int i=0; i<nteams; i++) {
+        strcpy(ctx.stats[i].team, teams[i]);
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    workpool *pool = workpool_new(workers, rebuild_team_task, &ctx);
+    if (!pool) errx(1, "could not start worker threads");
+    for (int i=0; i<nteams; i++) {
+        if (!workpool_submit(pool, team_shard(teams[i]), i)) errx(1, "%s: could not queue team", teams[i]);
+    }
+
+    /* report teams in order as soon as all before them have finished */
+    for (int i=0; i<nteams; i++) {
+        pthread_mutex_lock(&ctx.lock);
+        while (!ctx.stats[i].finished) pthread_cond_wait(&ctx.finished, &ctx.lock);
+        team_stats t = ctx.stats[i];
+        pthread_mutex_unlock(&ctx.lock);
+        printf("%s fragments %ld messages %ld incomplete %ld errors %ld\n",
+               t.team, t.fragments, t.messages, t.incomplete, t.errors);
+        fflush(stdout);
+    }
+
+    long stolen = workpool_finish(pool);
+    int failed = !outwriter_commit(ctx.writer);
+    long commits = outwriter_commits(ctx.writer);
+    outwriter_free(ctx.writer);
+    if (ctx.checkpoint) {
+        /* teams whose last commit had nothing left to commit, everything is durable now */
+        record_committed(&ctx, LONG_MAX, !failed);
+        if (ctx.checkpoint_errors) failed = 1;
+        if (!checkpoint_write(ctx.checkpoint)) failed = 1;
+        checkpoint_free(ctx.checkpoint);
+    }
+
+    double secs = elapsed_since(&start);
+    long fragments = 0, messages = 0, skipped = 0;
+    long long bytes = 0;
+    for (int i=0; i<nteams; i++) {
+        fragments += ctx.stats[i].fragments;
+        skipped += ctx.stats[i].skipped;
+        messages += ctx.stats[i].messages;
+        bytes += ctx.stats[i].bytes;
+        if (ctx.stats[i].errors) failed++;
+    }
+    if (secs <= 0) secs = 1e-9;
+    fprintf(stderr, "rebuilt %ld messages from %ld fragments (%.1f MB) for %d teams in %.2f s"
+            " using %ld threads (%ld teams stolen) and %ld commits: %.0f messages/s, %.1f MB/s\n",
+            messages, fragments, bytes / 1e6, nteams, secs, workers, stolen, commits,
+            messages / secs, bytes / 1e6 / secs);
+    if (checkpointfile) fprintf(stderr, "skipped %ld fragments decoded by earlier runs\n", skipped);
+    if (ctx.cache) {
+        fragcache_stats cs = fragcache_get_stats(ctx.cache);
+        fprintf(stderr, "preloaded %ld fragments, at most %.0f kB at once: %ld evicted, %ld read again\n",
+                cs.added, cs.peak_bytes / 1e3, cs.evictions, cs.reloads);
+        fragcache_free(ctx.cache);
+    }
+
+    return failed ? 1 : 0;
+}
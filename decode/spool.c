@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <dirent.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "fragment.h"
+#include "decode.h"
+#include "spool.h"
+
+static int is_team_id(const char *name) {
+    return strlen(name) == 2*TEAMLEN && strspn(name, "0123456789abcdef") == 2*TEAMLEN;
+}
+
+int spool_sharded(const char *spool) {
+    char path[(spool ? strlen(spool)+1 : 0)+strlen(SPOOL_SHARD_DIR)+1];
+    sprintf(path, "%s%s%s", spool ? spool : "", spool ? "/" : "", SPOOL_SHARD_DIR);
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+char *spool_team_dir(const char *spool, const char *team) {
+    if (!is_team_id(team)) {
+        warnx("%s: invalid team identifier", team);
+        return NULL;
+    }
+    char *path = malloc((spool ? strlen(spool)+1 : 0)+SPOOL_SHARD_PATHLEN+1+2*TEAMLEN+1);
+    if (!path) {
+        warn("%s: could not allocate memory", __func__);
+        return NULL;
+    }
+    int n = sprintf(path, "%s%s", spool ? spool : "", spool ? "/" : "");
+    if (spool_sharded(spool)) {
+        n += sprintf(path+n, "%s/%.2s/%.2s/", SPOOL_SHARD_DIR, team+2*TEAMLEN-4, team+2*TEAMLEN-2);
+    }
+    strcpy(path+n, team);
+    return path;
+}
+
+int spool_has_team(const char *spool, const char *team) {
+    char *path = spool_team_dir(spool, team);
+    if (!path) return 0;
+    struct stat st;
+    int found = stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+    free(path);
+    return found;
+}
+
+char *spool_make_team_dir(const char *spool, const char *team) {
+    char *path = spool_team_dir(spool, team);
+    if (!path) return NULL;
+    /* each shard level in turn, from the spool down */
+    size_t start = spool ? strlen(spool)+1 : 0;
+    for (char *slash = strchr(path+start, '/'); slash; slash = strchr(slash+1, '/')) {
+        *slash = '\0';
+        int r = mkdir_or_warn(path);
+        *slash = '/';
+        if (r < 0) goto make_failed;
+    }
+    if (mkdir_or_warn(path) < 0) goto make_failed;
+    return path;
+
+make_failed:
+    free(path);
+    return NULL;
+}
+
+typedef struct {
+    char **ids;
+    int n;
+    int max;
+} team_list;
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* add teams directly in dir, or in the shard directories depth levels below it */
+static int add_teams(team_list *list, const char *dir, int depth) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        warn("%s", dir);
+        return -1;
+    }
+    int r = 0;
+    struct dirent *ent;
+    while (r == 0 && (ent = readdir(d))) {
+        if (depth > 0) {
+            if (strlen(ent->d_name) != 2 || strspn(ent->d_name, "0123456789abcdef") != 2) continue;
+            char sub[strlen(dir)+1+2+1];
+            sprintf(sub, "%s/%s", dir, ent->d_name);
+            r = add_teams(list, sub, depth-1);
+            continue;
+        }
+        if (!is_team_id(ent->d_name)) continue;
+        if (list->n == list->max) {
+            list->max *= 2;
+            list->ids = realloc(list->ids, list->max * sizeof(char *));
+            if (!list->ids) err(1, "realloc");
+        }
+        list->ids[list->n] = strdup(ent->d_name);
+        if (!list->ids[list->n]) err(1, "strdup");
+        list->n++;
+    }
+    closedir(d);
+    return r;
+}
+
+int spool_list_teams(const char *spool, char ***teams) {
+    team_list list = {.n = 0, .max = 64};
+    list.ids = malloc(list.max * sizeof(char *));
+    if (!list.ids) err(1, "malloc");
+
+    int sharded = spool_sharded(spool);
+    char dir[strlen(spool)+1+strlen(SPOOL_SHARD_DIR)+1];
+    sprintf(dir, sharded ? "%s/"SPOOL_SHARD_DIR : "%s", spool);
+    if (add_teams(&list, dir, sharded ? 2 : 0) < 0) {
+        for (int i=0; i<list.n; i++) free(list.ids[i]);
+        free(list.ids);
+        return -1;
+    }
+    qsort(list.ids, list.n, sizeof(char *), compare_strings);
+    *teams = list.ids;
+    return list.n;
+}
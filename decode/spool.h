@@ -0,0 +1,27 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+/* Team directories are normally kept directly in the spool, as <spool>/<teamid>.
+ * Once <spool>/teams exists they are sharded under it by the last two bytes of the
+ * team id instead, as <spool>/teams/<byte 7>/<byte 8>/<teamid>, see shard_spool. */
+#define SPOOL_SHARD_DIR "teams"
+#define SPOOL_SHARD_PATHLEN (sizeof(SPOOL_SHARD_DIR)-1 + 6)
+
+/* 1 if teams in spool (the current directory if NULL) are sharded */
+int spool_sharded(const char *spool);
+
+/* directory of team in spool (relative to the current directory if NULL), whether or
+ * not it exists. NULL on error, should be free'd after use */
+char *spool_team_dir(const char *spool, const char *team);
+
+/* 1 if team has a directory in spool (the current directory if NULL) */
+int spool_has_team(const char *spool, const char *team);
+
+/* as spool_team_dir, creating the team's directory and any shard above it, NULL
+ * (with a warning) if that fails */
+char *spool_make_team_dir(const char *spool, const char *team);
+
+/* sorted ids of teams with a directory in spool, number found or negative on error */
+int spool_list_teams(const char *spool, char ***teams);
+
+#endif /* !SPOOL_H */
@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <err.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "uring.h"
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* every operation used, any missing from the running kernel means no ring at all */
+static const int uring_ops[] = {
+    IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_FSYNC,
+    IORING_OP_LINKAT, IORING_OP_RENAMEAT, IORING_OP_CLOSE
+};
+
+struct uring {
+    int fd;
+    unsigned entries;
+    void *sqmap, *cqmap;
+    size_t sqmaplen, cqmaplen;
+    struct io_uring_sqe *sqes;
+    size_t sqeslen;
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_cqe *cqes;
+    unsigned queued;
+    unsigned pending;   /* submitted, not yet completed */
+};
+
+static int supported(int fd) {
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    if (!probe) return 0;
+    int ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (int i=0; ok && i<sizeof(uring_ops)/sizeof(uring_ops[0]); i++) {
+        int op = uring_ops[i];
+        ok = op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+uring *uring_new(unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) return NULL;
+    if (!supported(fd)) {
+        close(fd);
+        return NULL;
+    }
+
+    uring *r = calloc(1, sizeof(uring));
+    if (!r) {
+        warn("%s: could not allocate memory", __func__);
+        close(fd);
+        return NULL;
+    }
+    r->fd = fd;
+    r->entries = p.sq_entries;
+
+    r->sqmaplen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cqmaplen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    /* both rings in the one mapping */
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cqmaplen > r->sqmaplen) r->sqmaplen = r->cqmaplen;
+        r->cqmaplen = 0;
+    }
+    r->sqmap = mmap(NULL, r->sqmaplen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    r->cqmap = r->cqmaplen == 0 ? r->sqmap :
+        mmap(NULL, r->cqmaplen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    r->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqeslen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (r->sqmap == MAP_FAILED || r->cqmap == MAP_FAILED || r->sqes == MAP_FAILED) {
+        warn("%s: mmap", __func__);
+        if (r->sqmap != MAP_FAILED) munmap(r->sqmap, r->sqmaplen);
+        if (r->cqmaplen && r->cqmap != MAP_FAILED) munmap(r->cqmap, r->cqmaplen);
+        if (r->sqes != MAP_FAILED) munmap(r->sqes, r->sqeslen);
+        close(fd);
+        free(r);
+        return NULL;
+    }
+
+    char *sq = r->sqmap, *cq = r->cqmap;
+    r->sqhead = (unsigned *) (sq + p.sq_off.head);
+    r->sqtail = (unsigned *) (sq + p.sq_off.tail);
+    r->sqmask = (unsigned *) (sq + p.sq_off.ring_mask);
+    r->sqarray = (unsigned *) (sq + p.sq_off.array);
+    r->cqhead = (unsigned *) (cq + p.cq_off.head);
+    r->cqtail = (unsigned *) (cq + p.cq_off.tail);
+    r->cqmask = (unsigned *) (cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    return r;
+}
+
+void uring_free(uring *r) {
+    if (!r) return;
+    munmap(r->sqes, r->sqeslen);
+    if (r->cqmaplen) munmap(r->cqmap, r->cqmaplen);
+    munmap(r->sqmap, r->sqmaplen);
+    close(r->fd);
+    free(r);
+}
+
+unsigned uring_queued(uring *r) {
+    return r->queued;
+}
+
+unsigned uring_space(uring *r) {
+    return r->entries - r->queued;
+}
+
+/* next free submission entry, cleared, NULL if full */
+static struct io_uring_sqe *next_sqe(uring *r, int op, int fd, int link, uint64_t tag) {
+    if (r->queued == r->entries) return NULL;
+    unsigned tail = *r->sqtail + r->queued;
+    unsigned i = tail & *r->sqmask;
+    struct io_uring_sqe *sqe = &r->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->flags = link ? IOSQE_IO_LINK : 0;
+    sqe->user_data = tag;
+    r->sqarray[i] = i;
+    r->queued++;
+    return sqe;
+}
+
+int uring_openat(uring *r, int dirfd, const char *path, int flags, mode_t mode, uint64_t tag) {
+    struct io_uring_sqe *sqe = next_sqe(r, IORING_OP_OPENAT, dirfd, 0, tag);
+    if (!sqe) return 0;
+    sqe->addr = (uintptr_t) path;
+    sqe->len = mode;
+    sqe->open_flags = flags;
+    return 1;
+}
+
+int uring_read(uring *r, int fd, void *buf, unsigned len, off_t off, int link, uint64_t tag) {
+    struct io_uring_sqe *sqe = next_sqe(r, IORING_OP_READ, fd, link, tag);
+    if (!sqe) return 0;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = len;
+    sqe->off = off;
+    return 1;
+}
+
+int uring_write(uring *r, int fd, const void *buf, unsigned len, off_t off, int link, uint64_t tag) {
+    struct io_uring_sqe *sqe = next_sqe(r, IORING_OP_WRITE, fd, link, tag);
+    if (!sqe) return 0;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = len;
+    sqe->off = off;
+    return 1;
+}
+
+int uring_fdatasync(uring *r, int fd, int link, uint64_t tag) {
+    struct io_uring_sqe *sqe = next_sqe(r, IORING_OP_FSYNC, fd, link, tag);
+    if (!sqe) return 0;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    return 1;
+}
+
+int uring_linkat(uring *r, int olddirfd, const char *oldpath, int newdirfd, const char *newpath,
+                 int flags, int link, uint64_t tag) {
+    struct io_uring_sqe *sqe = next_sqe(r, IORING_OP_LINKAT, olddirfd, link, tag);
+    if (!sqe) return 0;
+    sqe->addr = (uintptr_t) oldpath;
+    sqe->len = newdirfd;
+    sqe->addr2 = (uintptr_t) newpath;
+    sqe->hardlink_flags = flags;
+    return 1;
+}
+
+int uring_renameat(uring *r, int olddirfd, const char *oldpath, int newdirfd, const char *newpath,
+                   int link, uint64_t tag) {
+    struct io_uring_sqe *sqe = next_sqe(r, IORING_OP_RENAMEAT, olddirfd, link, tag);
+    if (!sqe) return 0;
+    sqe->addr = (uintptr_t) oldpath;
+    sqe->len = newdirfd;
+    sqe->addr2 = (uintptr_t) newpath;
+    return 1;
+}
+
+int uring_close(uring *r, int fd, uint64_t tag) {
+    return next_sqe(r, IORING_OP_CLOSE, fd, 0, tag) != NULL;
+}
+
+int uring_run(uring *r, uring_fn fn, void *arg) {
+    /* publish the queued entries before the kernel looks at the tail */
+    __atomic_store_n(r->sqtail, *r->sqtail + r->queued, __ATOMIC_RELEASE);
+    unsigned submit = r->queued;
+    r->pending += r->queued;
+    r->queued = 0;
+
+    while (r->pending > 0) {
+        int n = syscall(__NR_io_uring_enter, r->fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        /* EAGAIN and EBUSY until completions have been reaped, which they are below */
+        if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            warn("%s: io_uring_enter", __func__);
+            return 0;
+        }
+        if (n < 0) n = 0;
+        submit -= (n < submit) ? n : submit;
+
+        unsigned head = *r->cqhead;
+        unsigned tail = __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cqmask];
+            if (fn) fn(arg, cqe->user_data, cqe->res);
+            head++;
+            r->pending--;
+        }
+        __atomic_store_n(r->cqhead, head, __ATOMIC_RELEASE);
+    }
+    return 1;
+}
+
+int uring_drain(uring *r, uring_fn fn, void *arg) {
+    /* entries the kernel has not consumed are taken back, nothing else reads the tail */
+    unsigned head = __atomic_load_n(r->sqhead, __ATOMIC_ACQUIRE);
+    r->pending -= *r->sqtail - head;
+    __atomic_store_n(r->sqtail, head, __ATOMIC_RELEASE);
+    r->queued = 0;
+    return uring_run(r, fn, arg);
+}
+
+#else /* !HAVE_IO_URING */
+
+uring *uring_new(unsigned entries) {
+    return NULL;
+}
+
+void uring_free(uring *r) {
+}
+
+unsigned uring_queued(uring *r) {
+    return 0;
+}
+
+unsigned uring_space(uring *r) {
+    return 0;
+}
+
+int uring_openat(uring *r, int dirfd, const char *path, int flags, mode_t mode, uint64_t tag) {
+    return 0;
+}
+
+int uring_read(uring *r, int fd, void *buf, unsigned len, off_t off, int link, uint64_t tag) {
+    return 0;
+}
+
+int uring_write(uring *r, int fd, const void *buf, unsigned len, off_t off, int link, uint64_t tag) {
+    return 0;
+}
+
+int uring_fdatasync(uring *r, int fd, int link, uint64_t tag) {
+    return 0;
+}
+
+int uring_linkat(uring *r, int olddirfd, const char *oldpath, int newdirfd, const char *newpath,
+                 int flags, int link, uint64_t tag) {
+    return 0;
+}
+
+int uring_renameat(uring *r, int olddirfd, const char *oldpath, int newdirfd, const char *newpath,
+                   int link, uint64_t tag) {
+    return 0;
+}
+
+int uring_close(uring *r, int fd, uint64_t tag) {
+    return 0;
+}
+
+int uring_run(uring *r, uring_fn fn, void *arg) {
+    return 0;
+}
+
+int uring_drain(uring *r, uring_fn fn, void *arg) {
+    return 1;
+}
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,49 @@
+#ifndef URING_H
+#define URING_H
+#include <stdint.h>
+#include <sys/types.h>
+
+/* A small io_uring ring for submitting batches of file operations with one system call,
+ * used directly through the kernel interface rather than liburing. uring_new returns NULL
+ * wherever io_uring or any of the operations below is unavailable (old kernels, seccomp,
+ * or built without <linux/io_uring.h>), and callers then use plain system calls instead. */
+typedef struct uring uring;
+
+/* called for each completed operation with the tag it was queued with and its result,
+ * as the equivalent system call's return value, or -errno */
+typedef void (*uring_fn)(void *arg, uint64_t tag, int res);
+
+/* ring with room for entries queued operations, NULL if not available */
+uring *uring_new(unsigned entries);
+
+void uring_free(uring *r);
+
+/* operations queued so far and not yet run */
+unsigned uring_queued(uring *r);
+
+/* number of operations that can still be queued before uring_run */
+unsigned uring_space(uring *r);
+
+/* queue an operation, 0 if the ring is full. link makes the next operation queued wait
+ * for this one, and usually cancels it if this one fails (though not after every kind of
+ * operation on every kernel). paths and buffers must remain valid until uring_run */
+int uring_openat(uring *r, int dirfd, const char *path, int flags, mode_t mode, uint64_t tag);
+int uring_read(uring *r, int fd, void *buf, unsigned len, off_t off, int link, uint64_t tag);
+int uring_write(uring *r, int fd, const void *buf, unsigned len, off_t off, int link, uint64_t tag);
+int uring_fdatasync(uring *r, int fd, int link, uint64_t tag);
+int uring_linkat(uring *r, int olddirfd, const char *oldpath, int newdirfd, const char *newpath,
+                 int flags, int link, uint64_t tag);
+int uring_renameat(uring *r, int olddirfd, const char *oldpath, int newdirfd, const char *newpath,
+                   int link, uint64_t tag);
+int uring_close(uring *r, int fd, uint64_t tag);
+
+/* submit everything queued and wait for it all to complete, passing each result to fn,
+ * 0 on error (in which case results of some operations may not have been seen) */
+int uring_run(uring *r, uring_fn fn, void *arg);
+
+/* after uring_run has failed, drop whatever the kernel has not taken yet and wait for the
+ * rest to complete, passing each result to fn, 0 if that failed too (and the operations'
+ * paths, buffers and descriptors may still be in use) */
+int uring_drain(uring *r, uring_fn fn, void *arg);
+
+#endif /* !URING_H */
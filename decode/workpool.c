@@ -0,0 +1,195 @@
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "workpool.h"
+
+typedef struct {
+    pthread_mutex_t lock;
+    long *tasks;
+    long head;
+    long tail;
+    long size;
+} work_queue;
+
+typedef struct {
+    workpool *pool;
+    int id;
+} worker;
+
+struct workpool {
+    int nthreads;
+    pthread_t *threads;
+    worker *workers;
+    work_queue *queues;
+    workpool_fn fn;
+    void *arg;
+
+    /* protects the fields below */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    long pending;
+    long stolen;
+    int closed;
+};
+
+static int queue_push(work_queue *q, long task) {
+    pthread_mutex_lock(&q->lock);
+    if (q->tail == q->size) {
+        /* reclaim space from tasks already taken before growing */
+        if (q->head > 0) {
+            memmove(q->tasks, q->tasks + q->head, (q->tail - q->head) * sizeof(long));
+            q->tail -= q->head;
+            q->head = 0;
+        } else {
+            long size = q->size ? 2 * q->size : 64;
+            long *tasks = realloc(q->tasks, size * sizeof(long));
+            if (!tasks) {
+                warn("%s: could not allocate memory", __func__);
+                pthread_mutex_unlock(&q->lock);
+                return 0;
+            }
+            q->tasks = tasks;
+            q->size = size;
+        }
+    }
+    q->tasks[q->tail++] = task;
+    pthread_mutex_unlock(&q->lock);
+    return 1;
+}
+
+/* own tasks are taken from the front, stolen ones from the back */
+static int queue_take(work_queue *q, int steal, long *task) {
+    int found = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) {
+        *task = steal ? q->tasks[--q->tail] : q->tasks[q->head++];
+        found = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+static int take_task(workpool *pool, int id, long *task) {
+    int stolen = 0;
+    if (!queue_take(&pool->queues[id], 0, task)) {
+        for (int i=1; i<pool->nthreads && !stolen; i++) {
+            stolen = queue_take(&pool->queues[(id + i) % pool->nthreads], 1, task);
+        }
+        if (!stolen) return 0;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->pending--;
+    if (stolen) pool->stolen++;
+    pthread_mutex_unlock(&pool->lock);
+    return 1;
+}
+
+static void *worker_main(void *arg) {
+    worker *w = arg;
+    workpool *pool = w->pool;
+    while (1) {
+        long task;
+        if (take_task(pool, w->id, &task)) {
+            pool->fn(pool->arg, task);
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        while (pool->pending == 0 && !pool->closed) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        int done = (pool->pending == 0 && pool->closed);
+        pthread_mutex_unlock(&pool->lock);
+        if (done) break;
+    }
+    return NULL;
+}
+
+workpool *workpool_new(int nthreads, workpool_fn fn, void *arg) {
+    if (nthreads < 1 || !fn) return NULL;
+
+    workpool *pool = calloc(1, sizeof(workpool));
+    if (!pool) {
+        warn("%s: could not allocate memory", __func__);
+        return NULL;
+    }
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->threads = calloc(nthreads, sizeof(pthread_t));
+    pool->workers = calloc(nthreads, sizeof(worker));
+    pool->queues = calloc(nthreads, sizeof(work_queue));
+    if (!pool->threads || !pool->workers || !pool->queues) {
+        warn("%s: could not allocate memory", __func__);
+        free(pool->threads);
+        free(pool->workers);
+        free(pool->queues);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    for (int i=0; i<nthreads; i++) {
+        pthread_mutex_init(&pool->queues[i].lock, NULL);
+    }
+
+    for (int i=0; i<nthreads; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+        int r = pthread_create(&pool->threads[i], NULL, worker_main, &pool->workers[i]);
+        if (r != 0) {
+            errno = r;
+            warn("%s: could not start thread", __func__);
+            break;
+        }
+        pool->nthreads++;
+    }
+    if (pool->nthreads == 0) {
+        pool->closed = 1;
+        workpool_finish(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+int workpool_submit(workpool *pool, unsigned long shard, long task) {
+    /* counted before it can be taken, so that pending never drops below zero */
+    pthread_mutex_lock(&pool->lock);
+    pool->pending++;
+    pthread_mutex_unlock(&pool->lock);
+
+    int pushed = queue_push(&pool->queues[shard % pool->nthreads], task);
+    pthread_mutex_lock(&pool->lock);
+    if (pushed) {
+        /* wake everyone, any idle thread may steal it */
+        pthread_cond_broadcast(&pool->cond);
+    } else {
+        pool->pending--;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return pushed;
+}
+
+long workpool_finish(workpool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->closed = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i=0; i<pool->nthreads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    long stolen = pool->stolen;
+    for (int i=0; i<pool->nthreads; i++) {
+        pthread_mutex_destroy(&pool->queues[i].lock);
+        free(pool->queues[i].tasks);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    free(pool->threads);
+    free(pool->workers);
+    free(pool->queues);
+    free(pool);
+    return stolen;
+}
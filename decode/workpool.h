@@ -0,0 +1,21 @@
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+/* fixed pool of threads, each taking tasks from its own queue in order
+ * and stealing from the back of the other queues when its own is empty */
+typedef struct workpool workpool;
+
+/* called in a pool thread for each task */
+typedef void (*workpool_fn)(void *arg, long task);
+
+/* start nthreads threads running fn, NULL on error */
+workpool *workpool_new(int nthreads, workpool_fn fn, void *arg);
+
+/* queue task on the queue for shard (modulo the number of threads), 0 on error */
+int workpool_submit(workpool *pool, unsigned long shard, long task);
+
+/* wait for all queued tasks to finish, then stop the threads and free the pool,
+ * returns the number of tasks that were stolen */
+long workpool_finish(workpool *pool);
+
+#endif /* !WORKPOOL_H */
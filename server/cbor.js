@@ -0,0 +1,77 @@
+'use strict';
+
+// Decodes the CBOR written by the decoder for binary messages (process_fragment -b):
+// definite-length integers, byte and text strings, arrays, maps and floats.
+function decode(buf) {
+    var pos = 0;
+
+    function need(n) {
+        if (pos + n > buf.length) throw new Error('truncated CBOR data');
+    }
+
+    function argument(info) {
+        if (info < 24) return info;
+        switch (info) {
+            case 24: need(1); pos += 1; return buf.readUInt8(pos-1);
+            case 25: need(2); pos += 2; return buf.readUInt16BE(pos-2);
+            case 26: need(4); pos += 4; return buf.readUInt32BE(pos-4);
+            case 27:
+                need(8);
+                pos += 8;
+                return buf.readUInt32BE(pos-8) * 0x100000000 + buf.readUInt32BE(pos-4);
+        }
+        throw new Error('unsupported CBOR length encoding '+info);
+    }
+
+    function item() {
+        need(1);
+        var head = buf[pos++];
+        var major = head >> 5;
+        var info = head & 0x1f;
+
+        if (major == 7) {
+            switch (info) {
+                case 20: return false;
+                case 21: return true;
+                case 22: return null;
+                case 26: need(4); pos += 4; return buf.readFloatBE(pos-4);
+                case 27: need(8); pos += 8; return buf.readDoubleBE(pos-8);
+            }
+            throw new Error('unsupported CBOR simple value '+info);
+        }
+
+        var arg = argument(info);
+        switch (major) {
+            case 0:
+                return arg;
+            case 1:
+                return -1 - arg;
+            case 2:
+                need(arg);
+                pos += arg;
+                return Buffer.from(buf.slice(pos-arg, pos));
+            case 3:
+                need(arg);
+                pos += arg;
+                return buf.toString('utf8', pos-arg, pos);
+            case 4:
+                var array = [];
+                for (var i=0; i<arg; i++) array.push(item());
+                return array;
+            case 5:
+                var map = {};
+                for (var i=0; i<arg; i++) {
+                    var key = item();
+                    map[key] = item();
+                }
+                return map;
+        }
+        throw new Error('unsupported CBOR type '+major);
+    }
+
+    var value = item();
+    if (pos != buf.length) throw new Error('trailing data after CBOR item');
+    return value;
+}
+
+module.exports = { decode: decode };
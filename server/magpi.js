@@ -0,0 +1,9 @@
+'use strict';
+
+process.on('unhandledRejection', r => console.log(r));
+
+const config = require('./config');
+const MagpiQueue = require('./magpiqueue');
+
+// runs on its own, separately from the websocket server
+new MagpiQueue(config.magpi);
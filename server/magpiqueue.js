@@ -0,0 +1,239 @@
+'use strict';
+
+const fs = require('fs');
+const os = require('os');
+const path = require('path');
+const url = require('url');
+const http = require('http');
+const https = require('https');
+const child_process = require('child_process');
+
+const DEFAULT_UPLOAD_URL = 'https://www.magpi.com/mobileApi/uploadData';
+const UPLOAD_TIMEOUT = 60000;
+
+// Decompresses MagPi form records arriving in magpi/new with smac, and uploads the
+// xml this leaves in magpi/out. Each file is picked up once, when it appears, by a
+// fixed number of decompression workers and a single uploader keeping its connection
+// open. Failures are retried with exponential backoff, the number of attempts and
+// time of the next being kept in magpi/queue so they survive a restart, until
+// max_attempts have failed and the file is moved to magpi/failed to be looked at.
+class MagpiQueue {
+    constructor(config) {
+        this.dir = path.resolve(config.spool)+'/magpi';
+        this.smac = path.resolve(config.smac);
+        this.upload_url = url.parse(config.upload_url || DEFAULT_UPLOAD_URL);
+        this.workers = config.workers || os.cpus().length;
+        this.retry_base = config.retry_base || 30000;
+        this.retry_max = config.retry_max || 3600000;
+        this.max_attempts = config.max_attempts || 10;
+
+        this.queues = {decompress: [], upload: []};
+        this.queued = new Set(); // stage/name, from when added until done
+        this.decompressing = 0;
+        this.uploading = false;
+
+        this.proto = (this.upload_url.protocol == 'http:') ? http : https;
+        this.agent = new this.proto.Agent({keepAlive: true, maxSockets: 1});
+
+        // rebuild_messages leaves forms to this queue while the queue directory exists
+        ['new', 'out', 'done', 'uploaded', 'recipe', 'tmp', 'queue', 'failed'].forEach(d => mkdir(this.dir+'/'+d));
+
+        this.watchers = [
+            fs.watch(this.dir+'/new', (type, filename) => {
+                if (filename) this.add('decompress', filename);
+            }),
+            fs.watch(this.dir+'/out', (type, filename) => {
+                if (filename && filename.endsWith('.xml')) this.add('upload', filename);
+            })
+        ];
+
+        // anything left from before
+        fs.readdirSync(this.dir+'/new').forEach(filename => this.add('decompress', filename));
+        fs.readdirSync(this.dir+'/out').filter(filename => filename.endsWith('.xml'))
+            .forEach(filename => this.add('upload', filename));
+    }
+
+    source(stage, name) {
+        return this.dir+(stage == 'decompress' ? '/new/' : '/out/')+name;
+    }
+
+    state_file(stage, name) {
+        return this.dir+'/queue/'+stage+'.'+name;
+    }
+
+    add(stage, name) {
+        var key = stage+'/'+name;
+        if (this.queued.has(key) || name.startsWith('.')) return;
+        // watch events also come for files moved away
+        if (!fs.existsSync(this.source(stage, name))) return;
+        this.queued.add(key);
+
+        var delay = 0;
+        try {
+            var state = JSON.parse(fs.readFileSync(this.state_file(stage, name), 'utf8'));
+            delay = state.next - Date.now();
+        } catch (err) {
+            if (err.code != 'ENOENT') console.error(key, 'could not read retry state:', err.message);
+        }
+        if (delay > 0) {
+            console.log(key, 'waiting '+Math.round(delay/1000)+'s to retry');
+            setTimeout(() => this.ready(stage, name), delay);
+        } else {
+            this.ready(stage, name);
+        }
+    }
+
+    ready(stage, name) {
+        this.queues[stage].push(name);
+        this.run();
+    }
+
+    run() {
+        while (this.decompressing < this.workers && this.queues.decompress.length > 0) {
+            var record = this.queues.decompress.shift();
+            this.decompressing++;
+            this.decompress(record, this.finished.bind(this, 'decompress', record));
+        }
+        if (!this.uploading && this.queues.upload.length > 0) {
+            var xml = this.queues.upload.shift();
+            this.uploading = true;
+            this.upload(xml, this.finished.bind(this, 'upload', xml));
+        }
+    }
+
+    finished(stage, name, err) {
+        if (stage == 'decompress') {
+            this.decompressing--;
+        } else {
+            this.uploading = false;
+        }
+        var key = stage+'/'+name;
+        var file = this.state_file(stage, name);
+
+        if (!err) {
+            console.log(key, 'done');
+            fs.unlink(file, () => {});
+            this.queued.delete(key);
+        } else if (err.code == 'ENOENT') {
+            // moved away by something else
+            this.queued.delete(key);
+        } else {
+            var state = {attempts: 0};
+            try {
+                state = JSON.parse(fs.readFileSync(file, 'utf8'));
+            } catch (e) {}
+            state.attempts++;
+            if (state.attempts >= this.max_attempts) {
+                console.error(key, 'failed (attempt '+state.attempts+'), giving up:', err.message);
+                this.give_up(stage, name);
+                return this.run();
+            }
+            var delay = Math.min(this.retry_base * Math.pow(2, state.attempts-1), this.retry_max);
+            state.next = Date.now() + delay;
+            console.error(key, 'failed (attempt '+state.attempts+'), retrying in '+Math.round(delay/1000)+'s:', err.message);
+            try {
+                fs.writeFileSync(file+'.tmp', JSON.stringify(state)+'\n');
+                fs.renameSync(file+'.tmp', file);
+            } catch (e) {
+                console.error(key, 'could not save retry state:', e.message);
+            }
+            setTimeout(() => this.ready(stage, name), delay);
+        }
+        this.run();
+    }
+
+    // out of the way, until moved back by hand to be tried again from the start
+    give_up(stage, name) {
+        var key = stage+'/'+name;
+        var file = this.state_file(stage, name);
+        try {
+            fs.renameSync(this.source(stage, name), this.dir+'/failed/'+name);
+            fs.unlinkSync(file);
+        } catch (e) {
+            if (e.code != 'ENOENT') console.error(key, 'could not move to failed:', e.message);
+        }
+        this.queued.delete(key);
+    }
+
+    close() {
+        this.watchers.forEach(w => w.close());
+        this.agent.destroy();
+    }
+
+    // smac writes into a directory of its own, so that only whole output appears in out
+    decompress(name, callback) {
+        var record = this.source('decompress', name);
+        var tmpdir = this.dir+'/tmp/'+name+'.out';
+        rmtree(tmpdir);
+        mkdir(tmpdir);
+        child_process.execFile(this.smac, ['recipe', 'decompress', this.dir+'/recipe', record, tmpdir],
+            {cwd: path.dirname(this.smac), encoding: 'utf8'},
+            (err, stdout, stderr) => {
+                if (err) {
+                    rmtree(tmpdir);
+                    if (!fs.existsSync(record)) return callback(Object.assign(err, {code: 'ENOENT'}));
+                    return callback(new Error(stderr.trim() || err.message));
+                }
+                try {
+                    fs.readdirSync(tmpdir).forEach(f => fs.renameSync(tmpdir+'/'+f, this.dir+'/out/'+f));
+                    fs.rmdirSync(tmpdir);
+                    fs.renameSync(record, this.dir+'/done/'+name);
+                } catch (e) {
+                    return callback(e);
+                }
+                callback(null);
+            });
+    }
+
+    upload(name, callback) {
+        // an aborted request may report its error after the response ends
+        var called = false;
+        var done = err => {
+            if (!called) callback(err);
+            called = true;
+        };
+        var file = this.source('upload', name);
+        fs.readFile(file, (err, data) => {
+            if (err) return done(err);
+            var req = this.proto.request({
+                method: 'POST',
+                protocol: this.upload_url.protocol,
+                hostname: this.upload_url.hostname,
+                port: this.upload_url.port,
+                path: this.upload_url.path,
+                agent: this.agent,
+                headers: {'Content-Type': 'text/xml', 'Content-Length': data.length}
+            }, res => {
+                res.resume();
+                res.on('end', () => {
+                    if (res.statusCode >= 400) return done(new Error('HTTP status '+res.statusCode));
+                    fs.rename(file, this.dir+'/uploaded/'+name, done);
+                });
+            });
+            req.setTimeout(UPLOAD_TIMEOUT, () => req.abort());
+            req.on('error', done);
+            req.end(data);
+        });
+    }
+}
+
+module.exports = MagpiQueue;
+
+function mkdir(dir) {
+    try {
+        fs.mkdirSync(dir);
+    } catch (err) {
+        if (err.code != 'EEXIST') throw err;
+    }
+}
+
+function rmtree(dir) {
+    var files;
+    try {
+        files = fs.readdirSync(dir);
+    } catch (err) {
+        return;
+    }
+    files.forEach(f => fs.unlinkSync(dir+'/'+f));
+    fs.rmdirSync(dir);
+}
@@ -0,0 +1,168 @@
+'use strict';
+
+const fs = require('fs');
+
+// Tails the per-team message logs (<team>.ndjson) appended to by the decoder.
+// How far each log has been consumed is kept in <team>.offset: every line before
+// offset has been processed, as have the lines at any offsets listed in done.
+class MsgLog {
+    constructor(logdir, on_line) {
+        this.logdir = logdir;
+        this.on_line = on_line;
+        this.logs = {};
+
+        this.watcher = fs.watch(logdir, (type, filename) => {
+            if (filename) this.changed(filename);
+        });
+
+        // catch up with anything appended while not running
+        fs.readdir(logdir, (err, files) => {
+            if (err) throw err;
+            files.forEach(filename => this.changed(filename), this);
+        });
+    }
+
+    changed(filename) {
+        var m = /^([0-9a-f]{16})\.ndjson$/.exec(filename);
+        if (m) this.read(m[1]);
+    }
+
+    open(team) {
+        if (this.logs[team]) return this.logs[team];
+        var log = {
+            team: team,
+            offset: 0,           // everything before here has been processed
+            done: new Set(),     // processed lines after offset
+            next: new Map(),     // line offset => offset of the following line
+            pos: 0,              // where the next unread line starts
+            reading: false,
+            again: false,
+            saving: false,
+            dirty: false
+        };
+        try {
+            var state = JSON.parse(fs.readFileSync(this.offset_file(team), 'utf8'));
+            log.offset = state.offset;
+            state.done.forEach(offset => log.done.add(offset));
+        } catch (err) {
+            if (err.code != 'ENOENT') console.error('could not read offset for '+team+' log:', err.message);
+        }
+        log.pos = log.offset;
+        this.logs[team] = log;
+        return log;
+    }
+
+    log_file(team) {
+        return this.logdir+'/'+team+'.ndjson';
+    }
+
+    offset_file(team) {
+        return this.logdir+'/'+team+'.offset';
+    }
+
+    read(team) {
+        var log = this.open(team);
+        if (log.reading) {
+            log.again = true;
+            return;
+        }
+        log.reading = true;
+        fs.open(this.log_file(team), 'r', (err, fd) => {
+            if (err) {
+                console.error(team+' log:', err.message);
+                log.reading = false;
+                return;
+            }
+            this.read_from(log, fd, Buffer.alloc(0));
+        });
+    }
+
+    read_from(log, fd, partial) {
+        var buf = Buffer.alloc(65536);
+        fs.read(fd, buf, 0, buf.length, log.pos + partial.length, (err, n) => {
+            if (err || n == 0) {
+                if (err) console.error(log.team+' log:', err.message);
+                fs.close(fd, () => {});
+                log.reading = false;
+                if (log.again) {
+                    log.again = false;
+                    this.read(log.team);
+                }
+                return;
+            }
+
+            // only complete lines, a line still being appended is read next time
+            var data = Buffer.concat([partial, buf.slice(0, n)]);
+            var start = 0;
+            var nl;
+            while ((nl = data.indexOf(10, start)) >= 0) {
+                var offset = log.pos + start;
+                log.next.set(offset, log.pos + nl + 1);
+                if (!log.done.has(offset)) {
+                    this.on_line(log.team+':'+offset, data.toString('utf8', start, nl));
+                }
+                start = nl + 1;
+            }
+            log.pos += start;
+            // lines already processed before a restart
+            if (this.advance(log)) this.save(log);
+            this.read_from(log, fd, data.slice(start));
+        });
+    }
+
+    // id as passed to on_line
+    complete(id) {
+        var sep = id.indexOf(':');
+        var log = this.logs[id.slice(0, sep)];
+        if (!log) return;
+        log.done.add(parseInt(id.slice(sep+1), 10));
+        this.advance(log);
+        this.save(log);
+    }
+
+    advance(log) {
+        var moved = false;
+        while (log.done.has(log.offset) && log.next.has(log.offset)) {
+            var next = log.next.get(log.offset);
+            log.done.delete(log.offset);
+            log.next.delete(log.offset);
+            log.offset = next;
+            moved = true;
+        }
+        return moved;
+    }
+
+    save(log) {
+        if (log.saving) {
+            log.dirty = true;
+            return;
+        }
+        log.saving = true;
+        log.dirty = false;
+
+        var file = this.offset_file(log.team);
+        var tmp = file+'.tmp';
+        var state = JSON.stringify({offset: log.offset, done: Array.from(log.done)})+'\n';
+        var finish = err => {
+            if (err) console.error('could not save offset for '+log.team+' log:', err.message);
+            log.saving = false;
+            if (log.dirty) this.save(log);
+        };
+
+        // written and synced before replacing the old offset, so it is never lost
+        fs.open(tmp, 'w', (err, fd) => {
+            if (err) return finish(err);
+            fs.write(fd, state, err => {
+                if (err) return fs.close(fd, () => finish(err));
+                fs.fsync(fd, err => {
+                    fs.close(fd, () => {
+                        if (err) return finish(err);
+                        fs.rename(tmp, file, finish);
+                    });
+                });
+            });
+        });
+    }
+}
+
+module.exports = MsgLog;
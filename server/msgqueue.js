@@ -1,6 +1,8 @@
 'use strict';
 
 const fs = require('fs');
+const MsgLog = require('./msglog');
+const cbor = require('./cbor');
 
 class MsgQueue {
     constructor(teamdata, msgdir) {
@@ -20,15 +22,36 @@ class MsgQueue {
             if (err) throw err;
             files.forEach(filename => this.process_file(filename), this);
         });
+
+        // the decoder appends to per-team logs instead if the log directory exists,
+        // their lines are processed like files, named team:offset
+        this.log_lines = new Map();
+        if (fs.existsSync(msgdir+'/log')) {
+            this.log = new MsgLog(msgdir+'/log', (id, line) => {
+                this.log_lines.set(id, line);
+                this.process_file(id);
+            });
+        }
+    }
+
+    // message from a log line or a file will not be processed again
+    skip(filename) {
+        this.pending_files.delete(filename);
+        if (this.log_lines.delete(filename)) this.log.complete(filename);
     }
 
     async process_file(filename) {
-        if (this.pending_files.has(filename)) return;
+        // hidden files are the decoder's, still being written or about to replace a message
+        if (this.pending_files.has(filename) || filename.startsWith('.')) return;
         this.pending_files.add(filename);
 
+        // binary messages are CBOR maps with the same members as the json
+        var binary = filename.endsWith('.cbor');
+
         try {
-            var json = await new Promise((resolve, reject) => {
-                fs.readFile(this.msgdir+'/new/'+filename, {encoding: 'utf8'}, (err, data) => {
+            var data = this.log_lines.get(filename);
+            if (data === undefined) data = await new Promise((resolve, reject) => {
+                fs.readFile(this.msgdir+'/new/'+filename, binary ? null : {encoding: 'utf8'}, (err, data) => {
                     if (err) reject(err);
                     resolve(data);
                 });
@@ -39,9 +62,9 @@ class MsgQueue {
         }
 
         try {
-            var msg = JSON.parse(json);
+            var msg = binary ? cbor.decode(data) : JSON.parse(data);
         } catch (err) {
-            this.pending_files.delete(filename);
+            this.skip(filename);
             throw err;
         }
 
@@ -51,7 +74,7 @@ class MsgQueue {
             validate_msg(msg);
         } catch (err) {
             console.error(err.message);
-            this.pending_files.delete(filename);
+            this.skip(filename);
             return;
         }
 
@@ -93,12 +116,19 @@ class MsgQueue {
                 break;
             default:
                 console.error('unexpected team state '+team.state+' for team '+teamid);
-                this.pending_files.delete(filename);
+                this.skip(filename);
                 unlock();
                 return;
         }
 
         var done = function () {
+            if (this.log_lines.delete(filename)) {
+                this.log.complete(filename);
+                console.log(filename, 'processed from log');
+                this.pending_files.delete(filename);
+                unlock();
+                return;
+            }
             fs.rename(this.msgdir+'/new/'+filename, this.msgdir+'/done/'+filename, err => {
                 if (err) {
                     console.error(filename, err.message);
@@ -113,7 +143,7 @@ class MsgQueue {
         if (msgtype == 'start') {
             if (team.state != 'starting' && team.state != 'unknown') {
                 console.warn('unexpected start message for '+teamid+' while in state '+team.state);
-                this.pending_files.delete(filename);
+                this.skip(filename);
                 unlock();
                 return;
             }
@@ -134,7 +164,7 @@ class MsgQueue {
         if (msgtype == 'end') {
             if (team.state != 'active') {
                 console.warn('unexpected end message for '+teamid+' while in state '+team.state);
-                this.pending_files.delete(filename);
+                this.skip(filename);
                 unlock();
                 return;
             }
@@ -164,7 +194,7 @@ class MsgQueue {
         if (msgtype == 'join') {
             if (member) {
                 console.warn('unexpected join for '+teamid+'/'+msg.member+' (already joined)');
-                this.pending_files.delete(filename);
+                this.skip(filename);
                 unlock();
                 return;
             }
@@ -185,7 +215,7 @@ class MsgQueue {
         if (msgtype == 'part') {
             if (member.parted !== null) {
                 console.warn('already parted:', teamid+'/'+msg.member);
-                this.pending_files.delete(filename);
+                this.skip(filename);
                 unlock();
                 return;
             }
@@ -204,7 +234,7 @@ class MsgQueue {
 
         if (msgtype == 'magpi_form') {
             console.warn('processing for magpi forms not implemented here');
-            this.pending_files.delete(filename);
+            this.skip(filename);
             unlock();
             return;
         }
@@ -289,6 +319,9 @@ function validate_msg(msg) {
         case 'magpi_form':
             validate_member(msg);
             validate_reltime(msg);
+            if (Buffer.isBuffer(msg.data)) break;
+            // forms sent as large messages only go to magpi, and just give their length
+            if (msg.hexdata === undefined && Number.isInteger(msg.length) && msg.length > 0) break;
             if (typeof msg.hexdata != 'string' || !/^(?:[0-9a-f]{2})*$/.test(msg.hexdata))
                 throw new Error('bad hexdata in magpi message');
             break;
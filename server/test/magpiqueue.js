@@ -0,0 +1,81 @@
+'use strict';
+
+// Runs MagpiQueue against an HTTP stub on localhost, with a stand in for smac that
+// copies each record to an xml file: one form is accepted, and one is always refused
+// so must end up in magpi/failed once its attempts run out.
+
+const assert = require('assert');
+const child_process = require('child_process');
+const fs = require('fs');
+const http = require('http');
+const os = require('os');
+const path = require('path');
+const MagpiQueue = require('../magpiqueue');
+
+const MAX_ATTEMPTS = 3;
+const TIMEOUT = 10000;
+
+var tmp = fs.mkdtempSync(path.join(os.tmpdir(), 'magpiqueue-'));
+var spool = tmp+'/spool';
+fs.mkdirSync(spool);
+fs.mkdirSync(spool+'/magpi');
+
+// smac recipe decompress recipedir record outdir
+var smac = tmp+'/smac';
+fs.writeFileSync(smac, '#!/bin/sh\ncp "$4" "$5/$(basename "$4").xml"\n', {mode: 0o755});
+
+var posts = {};
+var server = http.createServer((req, res) => {
+    var body = '';
+    req.on('data', chunk => body += chunk);
+    req.on('end', () => {
+        posts[body] = (posts[body] || 0) + 1;
+        res.statusCode = body.startsWith('refused') ? 500 : 200;
+        res.end();
+    });
+});
+
+function wait_for(file, callback) {
+    var start = Date.now();
+    var timer = setInterval(() => {
+        if (fs.existsSync(file)) {
+            clearInterval(timer);
+            callback();
+        } else if (Date.now() - start > TIMEOUT) {
+            clearInterval(timer);
+            callback(new Error('timed out waiting for '+file));
+        }
+    }, 20);
+}
+
+server.listen(0, '127.0.0.1', () => {
+    var queue = new MagpiQueue({
+        spool: spool,
+        smac: smac,
+        upload_url: 'http://127.0.0.1:'+server.address().port+'/mobileApi/uploadData',
+        workers: 1,
+        retry_base: 10,
+        retry_max: 50,
+        max_attempts: MAX_ATTEMPTS
+    });
+    var magpi = spool+'/magpi';
+    fs.writeFileSync(magpi+'/new/accepted', 'accepted form');
+    fs.writeFileSync(magpi+'/new/refused', 'refused form');
+
+    wait_for(magpi+'/uploaded/accepted.xml', err => {
+        assert.ifError(err);
+        wait_for(magpi+'/failed/refused.xml', err => {
+            assert.ifError(err);
+            assert.strictEqual(posts['accepted form'], 1);
+            assert.strictEqual(posts['refused form'], MAX_ATTEMPTS);
+            assert(!fs.existsSync(magpi+'/out/refused.xml'));
+            assert(!fs.existsSync(magpi+'/queue/upload.refused.xml'));
+            assert(fs.existsSync(magpi+'/done/refused'));
+
+            queue.close();
+            server.close();
+            child_process.execFileSync('rm', ['-rf', tmp]);
+            console.log('magpiqueue: ok');
+        });
+    });
+});
@@ -75,6 +75,38 @@ chown -R succinct:succinct $SUCCINCT_HOME/spool
 mkdir $SUCCINCT_HOME/log
 chown -R succinct:succinct $SUCCINCT_HOME/log
 
+# placement service for the receivers, which fall back on running place_fragment if it is down
+cat > /etc/systemd/system/succinct-place.service << EOF
+[Unit]
+Description=Succinct fragment placement service
+
+[Service]
+User=succinct
+Group=succinct
+ExecStart=$SUCCINCT_HOME/decode/place_fragment -s $SUCCINCT_HOME/spool/place.sock $SUCCINCT_HOME/spool
+Restart=always
+
+[Install]
+WantedBy=multi-user.target
+EOF
+
+# decompresses and uploads magpi forms as they arrive, rebuild_messages leaves them to it
+# once it has created spool/magpi/queue
+cat > /etc/systemd/system/succinct-magpi.service << EOF
+[Unit]
+Description=Succinct MagPi form decompression and upload
+
+[Service]
+User=succinct
+Group=succinct
+WorkingDirectory=$SUCCINCT_HOME/server
+ExecStart=/usr/bin/node magpi.js
+Restart=always
+
+[Install]
+WantedBy=multi-user.target
+EOF
+
 mysql < <<EOF
 grant all on ramp.* to 'ramp'@'localhost';
 create database ramp;
@@ -91,3 +123,9 @@ sed -i 's/user = www-data/user = succinct/' /etc/php/7.0/fpm/pool.d/www.conf
 
 service php7.0-fpm restart
 service apache2 restart
+
+systemctl daemon-reload
+systemctl enable succinct-place
+systemctl restart succinct-place
+systemctl enable succinct-magpi
+systemctl restart succinct-magpi
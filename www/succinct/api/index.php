@@ -5,7 +5,7 @@ require('../../../config/succinct.php');
 ignore_user_abort(true);
 
 const TAG = 'Direct';
-const MIN_FRAGMENT_SIZE = 13;
+const MIN_FRAGMENT_SIZE = 6; // compact header and one byte of data
 const MAX_FRAGMENT_SIZE = 65535;
 const MAX_FORM_SIZE = 1048576;
 
@@ -120,41 +120,24 @@ class API {
 
         fclose($post);
 
-        $tmp = tempnam(Succinct::TMP_DIR, 'direct_fragment');
-        if ($tmp === false) throw new Exception('could not create temporary file');
-
-        if (file_put_contents($tmp, $fragment) === false) {
-            unlink($tmp);
-            throw new Exception("could not write to temporary file $tmp");
-        }
-
-        $fragment_teamid = Succinct::fraginfo($tmp, 'teamid');
-        if ($fragment_teamid === false) {
-            unlink($tmp);
-            throw new Exception('could not decode teamid');
-        }
-        if ($teamid !== $fragment_teamid) {
-            unlink($tmp);
+        $placed = Succinct::place_fragment_data($fragment, 'direct_fragment', $teamid, 'api');
+        if ($placed === false)
+            throw new Exception("could not place fragment for team $teamid");
+        if ($placed['status'] === 'mismatch')
             throw new InvalidArgumentException('uploadFragment: team id does not match fragment data');
-        }
-        $seq = Succinct::fraginfo($tmp, 'seq');
-        if ($seq === false) {
-            unlink($tmp);
-            throw new Exception('could not decode seq');
-        }
+        $seq = $placed['seq'];
 
         if (Succinct::team_is_finished($teamid))
             Succinct::logw(TAG, "received fragment for finished team $teamid");
 
         Succinct::update_lastseen($teamid, 'http', $_SERVER['REMOTE_ADDR']);
-        if (Succinct::place_fragment($tmp)) {
-            Succinct::logd(TAG, "received fragment for team $teamid with seq $seq");
+        if ($placed['status'] === 'duplicate') {
+            Succinct::logd(TAG, "received duplicate fragment for team $teamid with seq $seq");
         } else {
-            unlink($tmp);
-            throw new Exception("could not place fragment for team $teamid with seq $seq");
+            Succinct::logd(TAG, "received fragment for team $teamid with seq $seq");
         }
 
-        if (!Succinct::rebuild_messages($teamid, $seq, false)) {
+        if ($placed['status'] !== 'duplicate' && !Succinct::rebuild_messages($teamid, $seq, false)) {
             throw new Exception("could not rebuild message $teamid/$seq");
         }
 
@@ -188,13 +171,13 @@ class API {
         $team = strtolower($args[0]);
         $seq = sprintf('%010d', intval($args[1]));
 
-        if (!is_dir(Succinct::SPOOL_DIR."/$team")) {
+        if (!is_dir(Succinct::team_dir($team))) {
             Succinct::logw(TAG, "receiveFragment for unknown team: $team");
             http_response_code(404);
             return;
         }
 
-        $queuedir = Succinct::SPOOL_DIR."/$team/queue";
+        $queuedir = Succinct::team_dir($team).'/queue';
 
         if (!silent_mkdir($queuedir))
             throw new Exception("receiveFragment: unable to make $team/queue directory");
@@ -312,7 +295,7 @@ class API {
 }
 
 function print_ack($team) {
-    $ackfile = Succinct::SPOOL_DIR.'/'.$team.'/ack';
+    $ackfile = Succinct::team_dir($team).'/ack';
     if (!file_exists($ackfile)) {
         http_response_code(404);
         return;
@@ -323,6 +306,11 @@ function print_ack($team) {
     } else {
         $ack = preg_replace('/^0+/', '', $ack);
     }
+    // fragments received past the ack pointer, e.g. "12-15,18"
+    $sack = @file_get_contents(Succinct::team_dir($team).'/sack');
+    if ($sack !== false && preg_match('/^[0-9,-]+$/', trim($sack))) {
+        header('X-Succinct-Sack: '.trim($sack));
+    }
     echo $ack;
 }
 
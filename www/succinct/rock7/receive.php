@@ -22,7 +22,7 @@ $req = [date('Y-m-d H:i:s O'), $_POST];
 file_put_contents(Succinct::ROOT.'/log/rock7.log', json_encode($req)."\n", FILE_APPEND|LOCK_EX);
 
 const MAX_DATA_LENGTH = 1000;
-const MIN_FRAGMENT_SIZE = 13;
+const MIN_FRAGMENT_SIZE = 6; // compact header and one byte of data
 
 // require all _POST variables to be scalar
 $postargs = array_filter($_POST, 'is_scalar');
@@ -77,65 +77,39 @@ if (strlen($data) > MAX_DATA_LENGTH) {
     exit();
 }
 
-$fragment = data_to_fragment($data);
-if ($fragment === false) {
-    Succinct::logw(TAG, 'received invalid data');
-    exit();
-}
+Succinct::logv(TAG, "data: $data");
 
-if (strlen($fragment) < MIN_FRAGMENT_SIZE) {
+// userData is already checked to be whole bytes of hex
+if (strlen($data) / 2 < MIN_FRAGMENT_SIZE) {
     Succinct::logw(TAG, 'received fragment too short');
     exit();
 }
 
-$tmp = tempnam(Succinct::TMP_DIR, 'rock7_fragment');
-if ($tmp === false) {
-    Succinct::loge(TAG, 'could not create temporary file');
-    exit();
-}
-if (file_put_contents($tmp, $fragment) === false) {
-    Succinct::loge(TAG, "could not write to temporary file $tmp");
-    unlink($tmp);
-    exit();
-}
-
-$teamid = Succinct::fraginfo($tmp, 'teamid');
-if ($teamid === false) {
-    Succinct::loge(TAG, 'could not decode teamid from fragment');
-    unlink($tmp);
-    exit();
-}
-
-$seq = Succinct::fraginfo($tmp, 'seq');
-if ($seq === false) {
-    Succinct::loge(TAG, 'could not decode sequence number from fragment');
-    unlink($tmp);
+// decoded by the placement service
+$placed = Succinct::place_fragment_hex($data, 'rock7_fragment', null, 'rock7');
+if ($placed === false) {
+    Succinct::loge(TAG, 'could not place fragment');
     exit();
 }
+$teamid = $placed['teamid'];
+$seq = $placed['seq'];
 
 if (Succinct::team_is_finished($teamid))
     Succinct::logw(TAG, "received fragment for finished team $teamid");
 
 Succinct::update_lastseen($teamid, 'rock', $serial);
 
-if (Succinct::place_fragment($tmp)) {
-    Succinct::logd(TAG, "received fragment for team $teamid with seq $seq");
+if ($placed['status'] === 'duplicate') {
+    Succinct::logd(TAG, "received duplicate fragment for team $teamid with seq $seq");
 } else {
-    Succinct::loge(TAG, "could not place fragment for team $teamid with seq $seq");
-    unlink($tmp);
-    exit();
+    Succinct::logd(TAG, "received fragment for team $teamid with seq $seq");
 }
 
-if (!Succinct::rebuild_messages($teamid, $seq)) {
+if ($placed['status'] !== 'duplicate' && !Succinct::rebuild_messages($teamid, $seq)) {
     Succinct::loge(TAG, "could not start process to rebuild messages for team $teamid seq $seq");
 }
 
 if (!Succinct::send_rock($teamid, $serial)) {
     Succinct::loge(TAG, "could not start process to send outgoing rock messages for team $teamid serial $serial");
 }
-
-function data_to_fragment($data) {
-    Succinct::logv(TAG, "data: $data");
-    return hex2bin($data);
-}
 ?>
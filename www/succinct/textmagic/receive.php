@@ -17,7 +17,7 @@ if (!isset($_GET['key']) || $_GET['key'] !== Succinct::TEXTMAGIC_CALLBACK_KEY) {
 }
 
 const MAX_TEXT_LENGTH = 1000;
-const MIN_FRAGMENT_SIZE = 13;
+const MIN_FRAGMENT_SIZE = 6; // compact header and one byte of data
 
 $filter = [
     'id'          => ['filter'  => FILTER_UNSAFE_RAW,
@@ -72,45 +72,26 @@ if (strlen($fragment) < MIN_FRAGMENT_SIZE) {
     exit();
 }
 
-$tmp = tempnam(Succinct::TMP_DIR, 'textmagic_fragment');
-if ($tmp === false) {
-    Succinct::loge(TAG, 'could not create temporary file');
-    exit();
-}
-if (file_put_contents($tmp, $fragment) === false) {
-    Succinct::loge(TAG, "could not write to temporary file $tmp");
-    unlink($tmp);
-    exit();
-}
-
-$teamid = Succinct::fraginfo($tmp, 'teamid');
-if ($teamid === false) {
-    Succinct::loge(TAG, 'could not decode teamid from fragment');
-    unlink($tmp);
-    exit();
-}
-
-$seq = Succinct::fraginfo($tmp, 'seq');
-if ($seq === false) {
-    Succinct::loge(TAG, 'could not decode sequence number from fragment');
-    unlink($tmp);
+$placed = Succinct::place_fragment_data($fragment, 'textmagic_fragment', null, 'textmagic');
+if ($placed === false) {
+    Succinct::loge(TAG, 'could not place fragment');
     exit();
 }
+$teamid = $placed['teamid'];
+$seq = $placed['seq'];
 
 if (Succinct::team_is_finished($teamid))
     Succinct::logw(TAG, "received fragment for finished team $teamid");
 
 Succinct::update_lastseen($teamid, 'sms', $sender);
 
-if (Succinct::place_fragment($tmp)) {
-    Succinct::logd(TAG, "received fragment for team $teamid with seq $seq");
+if ($placed['status'] === 'duplicate') {
+    Succinct::logd(TAG, "received duplicate fragment for team $teamid with seq $seq");
 } else {
-    Succinct::loge(TAG, "could not place fragment for team $teamid with seq $seq");
-    unlink($tmp);
-    exit();
+    Succinct::logd(TAG, "received fragment for team $teamid with seq $seq");
 }
 
-if (!Succinct::rebuild_messages($teamid, $seq)) {
+if ($placed['status'] !== 'duplicate' && !Succinct::rebuild_messages($teamid, $seq)) {
     Succinct::loge(TAG, "could not start process to rebuild messages for team $teamid seq $seq");
 }
 